@@ -12,6 +12,16 @@ SOURCES += main.cpp \
     markovnode.cpp \
     markovedge.cpp \
     markovchain.cpp \
+    markovvocabulary.cpp \
+    markovfrozenchain.cpp \
+    markovcontextmodel.cpp \
+    markovonlinemodel.cpp \
+    markovtokenizer.cpp \
+    markovsnapshot.cpp \
+    markovgenerator.cpp \
+    markovmetrics.cpp \
+    markovbatch.cpp \
+    markovmerger.cpp \
     mainwindow.cpp \
     globals.cpp
 
@@ -19,6 +29,17 @@ HEADERS += \
     markovnode.h \
     markovedge.h \
     markovchain.h \
+    markovvocabulary.h \
+    markovfrozenchain.h \
+    markovcontextmodel.h \
+    markovonlinemodel.h \
+    markovtokenizer.h \
+    markovsnapshot.h \
+    markovgenerator.h \
+    markovmetrics.h \
+    markovpool.h \
+    markovbatch.h \
+    markovmerger.h \
     mainwindow.h \
     globals.h
 
@@ -0,0 +1,42 @@
+# Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+# All rights reserved.
+
+QT += core concurrent
+QT -= gui
+
+TARGET = belletristiq-benchmark
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    ../markovnode.cpp \
+    ../markovedge.cpp \
+    ../markovchain.cpp \
+    ../markovvocabulary.cpp \
+    ../markovfrozenchain.cpp \
+    ../markovcontextmodel.cpp \
+    ../markovonlinemodel.cpp \
+    ../markovtokenizer.cpp \
+    ../markovsnapshot.cpp \
+    ../markovmetrics.cpp \
+    ../markovgenerator.cpp \
+    ../markovmerger.cpp
+
+HEADERS += \
+    ../markovnode.h \
+    ../markovedge.h \
+    ../markovchain.h \
+    ../markovvocabulary.h \
+    ../markovfrozenchain.h \
+    ../markovcontextmodel.h \
+    ../markovonlinemodel.h \
+    ../markovtokenizer.h \
+    ../markovsnapshot.h \
+    ../markovmetrics.h \
+    ../markovgenerator.h \
+    ../markovmerger.h \
+    ../markovpool.h
@@ -0,0 +1,769 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+// Times the hot paths of the Markov core on synthetic corpora of several
+// vocabulary sizes, with tokens drawn uniformly or Zipf-distributed (which
+// gives few nodes of very high degree and many of low degree), e.g.
+//   belletristiq-benchmark --tokens 2000000 --vocabularies 1000,100000
+// and --corpus to check the tokenizer on a text of one's own, too.
+// Every measurement is written to stdout as one JSON object per line:
+//   {"benchmark":"tokenize","distribution":"zipf","vocabulary":1000,
+//    "variant":"","n":1000000,"ns":51234567,"perSecond":19518221.6}
+// where `n` counts what `perSecond` refers to: tokens, nodes, draws or bytes.
+// The program also checks that adding a corpus to one chain from many
+// threads gives the same counts as adding it serially, that the tokenizer
+// splits the corpus like the regular expression it replaced, that a paged
+// snapshot walks like a mapped one, that walks made in lockstep give the
+// same texts as walks made one by one, and that an online model counts
+// like the frozen chain, that texts generated with one seed are the same
+// however the chain was filled, that merging model files gives the same
+// counts as merging or loading the models, that a pruned chain keeps to
+// its limits when read back, and fails if not.
+
+#include <QBitArray>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QCommandLineOption>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "markovchain.h"
+#include "markovedge.h"
+#include "markovgenerator.h"
+#include "markovmerger.h"
+#include "markovnode.h"
+#include "markovtokenizer.h"
+#include "markovvocabulary.h"
+
+
+namespace {
+
+struct Corpus {
+  QByteArray text;
+  QString distribution;
+  int vocabulary;
+};
+
+
+QByteArray word(int i)
+{
+  QByteArray w;
+  do {
+    w.append(char('a' + i % 26));
+    i /= 26;
+  } while (i > 0);
+  return w;
+}
+
+
+// A sentence ends after 5 to 25 words.
+Corpus makeCorpus(int vocabulary, bool zipf, int tokenCount, quint32 seed)
+{
+  std::mt19937 rng(seed);
+  std::vector<double> weights(size_t(vocabulary), 1.0);
+  if (zipf) {
+    for (int i = 0; i < vocabulary; ++i) {
+      weights[size_t(i)] = 1.0 / std::pow(double(i + 1), 1.1);
+    }
+  }
+  std::discrete_distribution<int> wordDist(weights.begin(), weights.end());
+  std::uniform_int_distribution<int> sentenceDist(5, 25);
+  QVector<QByteArray> words(vocabulary);
+  for (int i = 0; i < vocabulary; ++i) {
+    words[i] = word(i);
+  }
+  Corpus corpus;
+  corpus.distribution = zipf ? "zipf" : "uniform";
+  corpus.vocabulary = vocabulary;
+  int untilStop = sentenceDist(rng);
+  for (int n = 0; n < tokenCount; ++n) {
+    if (--untilStop == 0) {
+      // the terminator follows the word, as the tokenizer expects
+      corpus.text.chop(1);
+      corpus.text.append(".\n");
+      untilStop = sentenceDist(rng);
+    }
+    else {
+      corpus.text.append(words.at(wordDist(rng))).append(' ');
+    }
+  }
+  return corpus;
+}
+
+
+void report(const QString &benchmark, const Corpus &corpus, const QString &variant, qint64 n, qint64 ns)
+{
+  static QTextStream out(stdout);
+  QJsonObject result;
+  result["benchmark"] = benchmark;
+  result["distribution"] = corpus.distribution;
+  result["vocabulary"] = corpus.vocabulary;
+  result["variant"] = variant;
+  result["n"] = double(n);
+  result["ns"] = double(ns);
+  result["perSecond"] = ns > 0 ? 1e9 * double(n) / double(ns) : 0.0;
+  out << QJsonDocument(result).toJson(QJsonDocument::Compact) << '\n';
+  out.flush();
+}
+
+
+bool edgeLessThan(MarkovEdge *a, MarkovEdge *b)
+{
+  return a->target() < b->target();
+}
+
+
+// the LINEAR variant of MarkovNode::addSuccessor()
+void addLinear(MarkovNode::MarkovEdgeList &successors, MarkovVocabulary::TokenId target, MarkovEdgePool &edges)
+{
+  MarkovNode::MarkovEdgeList::iterator i;
+  for (i = successors.begin(); i != successors.end(); ++i) {
+    if ((*i)->target() == target) {
+      (*i)->increaseCount();
+      break;
+    }
+  }
+  if (i == successors.end()) {
+    successors.append(edges.create(target));
+  }
+}
+
+
+// the INSERTION variant of MarkovNode::addSuccessor()
+void addInsertion(MarkovNode::MarkovEdgeList &successors, MarkovVocabulary::TokenId target, MarkovEdgePool &edges)
+{
+  MarkovEdge soughtEdge(target);
+  MarkovNode::MarkovEdgeList::iterator i = std::lower_bound(successors.begin(), successors.end(), &soughtEdge, edgeLessThan);
+  if (i == successors.end()) {
+    successors.append(edges.create(target));
+  }
+  else if ((*i)->target() == target) {
+    (*i)->increaseCount();
+  }
+  else {
+    successors.insert(i, edges.create(target));
+  }
+}
+
+
+template <typename AddFunction>
+void benchmarkAddSuccessor(const Corpus &corpus, const QVector<MarkovVocabulary::TokenId> &ids, int nodeCount, const QString &variant, AddFunction add)
+{
+  QVector<MarkovNode::MarkovEdgeList> successors(nodeCount);
+  MarkovEdgePool edges;
+  QElapsedTimer timer;
+  timer.start();
+  for (int i = 1; i < ids.size(); ++i) {
+    add(successors[int(ids.at(i - 1))], ids.at(i), edges);
+  }
+  report("addSuccessor", corpus, variant, ids.size() - 1, timer.nsecsElapsed());
+}
+
+
+// The count of every transition, keyed by its tokens, because chains
+// filled concurrently number the tokens in a different order.
+QHash<QByteArray, quint32> transitionCounts(const MarkovChain &chain)
+{
+  QHash<QByteArray, quint32> counts;
+  const MarkovVocabulary &vocabulary = chain.vocabulary();
+  const MarkovFrozenChain &frozen = chain.frozen();
+  for (int i = 0; i < frozen.nodeCount(); ++i) {
+    const MarkovVocabulary::TokenId source = MarkovVocabulary::TokenId(i);
+    const QByteArray &sourceToken = QByteArray(vocabulary.data(source), vocabulary.size(source)) + ' ';
+    const MarkovFrozenChain::Edges &edges = frozen.edges(source);
+    for (int edge = 0; edge < edges.degree; ++edge) {
+      const MarkovVocabulary::TokenId target = edges.target(edge);
+      counts.insert(sourceToken + QByteArray(vocabulary.data(target), vocabulary.size(target)), edges.count(edge));
+    }
+  }
+  return counts;
+}
+
+
+// Compares the tokens of `text` with those of the regular expression the
+// tokenizer replaced.
+bool checkTokenizer(const QByteArray &text, const QString &source)
+{
+  QString difference;
+  if (!MarkovTokenizer().verify(text, &difference)) {
+    QTextStream(stderr) << "the tokenizer differs from the regular expression on " << source << ": " << difference << '\n';
+    return false;
+  }
+  return true;
+}
+
+
+// Checks the tokenizer on lines the synthetic corpora lack: letters
+// beyond ASCII, quotation marks, apostrophes, carons, characters beyond
+// the BMP and malformed UTF-8.
+bool checkTokenizerSamples(void)
+{
+  static const char *Samples[] = {
+    "Übergrößenträger küssen Öfen, naïve façades. Ελληνικά и русский текст; 日本語のテキスト!",
+    "»Guillemets« und «umgekehrte», „deutsche“ Anführungszeichen, “curly” ‹single› \"straight\" quotes.",
+    "Don't rock'n'roll, 'quoted' o'clock, l’amour d’été ’tis' ''",
+    "Hačekˇ mitˇCaron, ˇ allein, aˇb ˇ.",
+    "𝔘𝔫𝔦𝔠𝔬𝔡𝔢 and emoji 😀 between words, a😀b, 😀. 𝟙𝟚𝟛!",
+    "bad \xff byte, cut \xc3" " off, lone \x80" "continuation, overlong \xc0\xaf" "slash, "
+    "truncated \xe2\x82" " euro, \xed\xa0\x80" " surrogate\xc3\n"
+    "at the end \xe2\x82"
+  };
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(Samples) / sizeof(Samples[0]); ++i) {
+    ok = checkTokenizer(QByteArray(Samples[i]), QString("sample %1").arg(i)) && ok;
+  }
+  return ok;
+}
+
+
+// Splits the corpus into pieces of whole lines of about 64 KB.
+QStringList splitCorpus(const Corpus &corpus)
+{
+  QStringList pieces;
+  int begin = 0;
+  while (begin < corpus.text.size()) {
+    int end = corpus.text.indexOf('\n', begin + 64 * 1024);
+    end = (end < 0) ? corpus.text.size() : end + 1;
+    pieces.append(QString::fromUtf8(corpus.text.mid(begin, end - begin)));
+    begin = end;
+  }
+  return pieces;
+}
+
+
+// Adds the corpus in pieces of whole lines to one chain on all cores and
+// compares the result with adding the same pieces one after another.
+bool checkConcurrentAdd(const Corpus &corpus, int order)
+{
+  QStringList pieces = splitCorpus(corpus);
+  MarkovChain serial;
+  serial.setModelOrder(order);
+  foreach (QString piece, pieces) {
+    serial.addText(piece);
+  }
+  serial.postProcess();
+
+  MarkovChain concurrent;
+  concurrent.setModelOrder(order);
+  QElapsedTimer timer;
+  timer.start();
+  QtConcurrent::blockingMap(pieces, [&concurrent](const QString &piece) {
+    concurrent.addText(piece);
+  });
+  report("addConcurrent", corpus, QString("order%1").arg(order), concurrent.metrics().tokens, timer.nsecsElapsed());
+  concurrent.postProcess();
+
+  bool same = serial.count() == concurrent.count() && transitionCounts(serial) == transitionCounts(concurrent);
+  for (int k = 2; k <= order; ++k) {
+    same = same
+        && serial.contexts().contextCount(k) == concurrent.contexts().contextCount(k)
+        && serial.contexts().ngramCount(k) == concurrent.contexts().ngramCount(k);
+  }
+  if (!same) {
+    QTextStream(stderr) << "concurrent add() of the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words differs from serial add() at order " << order << '\n';
+  }
+  return same;
+}
+
+
+// Generates texts with one seed from chains that learned the corpus
+// serially, backwards and on all cores, which numbers the tokens
+// differently, and checks that they are all the same.
+bool checkSeeded(const Corpus &corpus, int order)
+{
+  const int textCount = 256;
+  const int wordCount = 64;
+  const quint32 seed = 5;
+  QStringList pieces = splitCorpus(corpus);
+  MarkovChain serial;
+  MarkovChain backwards;
+  MarkovChain concurrent;
+  serial.setModelOrder(order);
+  backwards.setModelOrder(order);
+  concurrent.setModelOrder(order);
+  for (int i = 0; i < pieces.size(); ++i) {
+    serial.addText(pieces.at(i));
+    backwards.addText(pieces.at(pieces.size() - 1 - i));
+  }
+  QtConcurrent::blockingMap(pieces, [&concurrent](const QString &piece) {
+    concurrent.addText(piece);
+  });
+  serial.postProcess();
+  backwards.postProcess();
+  concurrent.postProcess();
+  const QStringList &expected = MarkovGenerator(&serial).generate(0, textCount, wordCount, seed);
+  const bool same = MarkovGenerator(&serial).generate(0, textCount, wordCount, seed) == expected
+      && MarkovGenerator(&backwards).generate(0, textCount, wordCount, seed) == expected
+      && MarkovGenerator(&concurrent).generate(0, textCount, wordCount, seed) == expected;
+  if (!same) {
+    QTextStream(stderr) << "texts generated with one seed from the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words differ at order " << order << '\n';
+  }
+  return same;
+}
+
+
+// Adds the first half of the corpus to a chain, then the second half from
+// many threads in online mode while another thread walks it. Compares the
+// online counts with those of the frozen chain and times draws from the
+// online model.
+bool checkOnline(const Corpus &corpus)
+{
+  QStringList pieces = splitCorpus(corpus);
+  MarkovChain chain;
+  for (int i = 0; i < pieces.size() / 2; ++i) {
+    chain.addText(pieces.at(i));
+  }
+  chain.postProcess();
+  pieces = pieces.mid(pieces.size() / 2);
+  chain.setOnline(true);
+  QAtomicInt adding(1);
+  QFuture<void> walking = QtConcurrent::run([&chain, &adding](void) {
+    std::mt19937 rng(4);
+    MarkovWalker walker(&chain, rng);
+    while (adding.load()) {
+      QString text;
+      walker.next(text, 64);
+    }
+  });
+  QtConcurrent::blockingMap(pieces, [&chain](const QString &piece) {
+    chain.addText(piece);
+  });
+  adding.store(0);
+  walking.waitForFinished();
+  chain.postProcess();
+  const MarkovFrozenChain &frozen = chain.frozen();
+  const MarkovOnlineModel &online = chain.online();
+  bool same = true;
+  for (int i = 0; same && i < chain.count(); ++i) {
+    const MarkovVocabulary::TokenId id = MarkovVocabulary::TokenId(i);
+    same = online.totalCount(id) == frozen.totalCount(id);
+    for (int edge = frozen.begin(id); same && edge < frozen.end(id); ++edge) {
+      same = online.count(id, frozen.target(edge)) == frozen.count(edge);
+    }
+  }
+  const int drawCount = 1000000;
+  std::mt19937 rng(2);
+  std::uniform_int_distribution<int> nodeDist(0, chain.count() - 1);
+  std::uniform_real_distribution<qreal> pDist(0.0, 1.0);
+  MarkovVocabulary::TokenId id = MarkovVocabulary::InvalidId;
+  QElapsedTimer timer;
+  timer.start();
+  for (int i = 0; i < drawCount; ++i) {
+    if (id == MarkovVocabulary::InvalidId) {
+      id = MarkovVocabulary::TokenId(nodeDist(rng));
+    }
+    id = online.selectSuccessor(id, pDist(rng));
+  }
+  report("selectSuccessor", corpus, "online", drawCount, timer.nsecsElapsed());
+  if (!same) {
+    QTextStream(stderr) << "the online model of the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words differs from the frozen chain" << '\n';
+  }
+  return same;
+}
+
+
+// Saves the two halves of the corpus as a .markov and a .markovz file and
+// merges the files. Compares the counts with those of merging the chains
+// in memory and of loading one file after the other, and checks that a
+// file cut short is refused.
+bool checkMerge(const Corpus &corpus, const QString &tempPath)
+{
+  const QStringList &pieces = splitCorpus(corpus);
+  MarkovChain first;
+  MarkovChain second;
+  for (int i = 0; i < pieces.size(); ++i) {
+    (i < pieces.size() / 2 ? first : second).addText(pieces.at(i));
+  }
+  first.postProcess();
+  second.postProcess();
+  const QString prefix = QString("%1/%2-%3-merge").arg(tempPath).arg(corpus.distribution).arg(corpus.vocabulary);
+  const QStringList inputs = { prefix + "1.markov", prefix + "2.markovz" };
+  if (!first.save(inputs.at(0)) || !second.save(inputs.at(1))) {
+    QTextStream(stderr) << "cannot save " << inputs.join(", ") << '\n';
+    return false;
+  }
+  MarkovMerger merger;
+  QElapsedTimer timer;
+  timer.start();
+  const bool merged = merger.merge(inputs, prefix + ".markov");
+  report("merge", corpus, QString(), merger.lineCount(), timer.nsecsElapsed());
+  MarkovChain streamed;
+  if (!merged || !streamed.readFromMarkovFile(prefix + ".markov")) {
+    QTextStream(stderr) << "cannot merge the models of the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words: " << merger.errorString() << '\n';
+    return false;
+  }
+  MarkovChain inMemory;
+  inMemory.merge(QList<const MarkovChain*>() << &first << &second);
+  MarkovChain loaded;
+  const bool same = loaded.readFromMarkovFile(inputs.at(0)) && loaded.readFromMarkovFile(inputs.at(1))
+      && streamed.count() == inMemory.count() && streamed.count() == loaded.count()
+      && transitionCounts(streamed) == transitionCounts(inMemory)
+      && transitionCounts(streamed) == transitionCounts(loaded);
+  if (!same) {
+    QTextStream(stderr) << "merging the model files of the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words differs from merging or loading the models" << '\n';
+    return false;
+  }
+  QFile file(inputs.at(1));
+  QFile cut(prefix + "3.markovz");
+  if (!file.open(QIODevice::ReadOnly) || !cut.open(QIODevice::WriteOnly)) {
+    QTextStream(stderr) << "cannot copy " << inputs.at(1) << '\n';
+    return false;
+  }
+  cut.write(file.readAll().left(int(file.size()) - 16));
+  cut.close();
+  if (merger.merge(QStringList() << inputs.at(0) << cut.fileName(), prefix + ".markov")) {
+    QTextStream(stderr) << "merging a model file cut short succeeds on the " << corpus.distribution
+                        << " corpus with " << corpus.vocabulary << " words" << '\n';
+    return false;
+  }
+  return true;
+}
+
+
+// Prunes the order-2 chain of the corpus to edges counted at least twice,
+// at most four per node, once with counts quantized and once without,
+// saves both and reads them back. Checks that no edge is rarer than the
+// minimum, that no node or context keeps more edges, that a sentence can
+// end from every node, that quantizing keeps the same edges, and that the
+// quantized chain takes no more text.
+bool checkPrune(const Corpus &corpus, const QString &tempPath)
+{
+  typedef MarkovVocabulary::TokenId TokenId;
+  MarkovChain::PruneOptions options;
+  options.minCount = 2;
+  options.topK = 4;
+  const QString prefix = QString("%1/%2-%3-pruned").arg(tempPath).arg(corpus.distribution).arg(corpus.vocabulary);
+  const QStringList filenames = { prefix + ".markov", prefix + MarkovChain::SnapshotSuffix };
+  for (int quantize = 0; quantize <= 1; ++quantize) {
+    MarkovChain chain;
+    chain.setModelOrder(2);
+    chain.addText(QString::fromUtf8(corpus.text));
+    chain.postProcess();
+    options.quantize = quantize != 0;
+    chain.prune(options);
+    if (!chain.save(filenames.at(quantize))) {
+      QTextStream(stderr) << "cannot save " << filenames.at(quantize) << '\n';
+      return false;
+    }
+  }
+  MarkovChain pruned;
+  MarkovChain quantized;
+  if (!pruned.readFromMarkovFile(filenames.at(0)) || !quantized.readFromMarkovFile(filenames.at(1))) {
+    QTextStream(stderr) << "cannot read " << filenames.join(", ") << '\n';
+    return false;
+  }
+
+  const MarkovFrozenChain &frozen = pruned.frozen();
+  QVector<QVector<TokenId> > sources(frozen.nodeCount());
+  bool ok = true;
+  for (int i = 0; i < frozen.nodeCount(); ++i) {
+    const MarkovFrozenChain::Edges &edges = frozen.edges(TokenId(i));
+    ok = ok && edges.degree <= options.topK;
+    for (int edge = 0; edge < edges.degree; ++edge) {
+      ok = ok && edges.count(edge) >= quint32(options.minCount);
+      sources[int(edges.target(edge))].append(TokenId(i));
+    }
+  }
+  QBitArray leading(frozen.nodeCount());
+  QVector<TokenId> pending;
+  foreach (QString terminator, MarkovChain::SentenceTerminators) {
+    const TokenId id = pruned.vocabulary().find(terminator);
+    if (id != MarkovVocabulary::InvalidId) {
+      pending.append(id);
+    }
+  }
+  while (!pending.isEmpty()) {
+    const TokenId id = pending.takeLast();
+    if (leading.testBit(int(id)))
+      continue;
+    leading.setBit(int(id));
+    pending << sources.at(int(id));
+  }
+  ok = ok && leading.count(true) == frozen.nodeCount();
+
+  const QHash<QByteArray, quint32> &counts = transitionCounts(pruned);
+  ok = ok && quantized.isQuantized() && quantized.count() == pruned.count()
+      && transitionCounts(quantized).keys().toSet() == counts.keys().toSet()
+      && quantized.contexts().ngramCount(2) <= qint64(options.topK) * quantized.contexts().contextCount(2);
+  quantized.addText("a sentence of words never seen before.");
+  quantized.postProcess();
+  ok = ok && quantized.count() == pruned.count();
+  if (!ok) {
+    QTextStream(stderr) << "the pruned chain of the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words breaks the limits it was pruned to" << '\n';
+  }
+  return ok;
+}
+
+
+// Walks `drawCount` steps through the order-1 chain, starting over at a
+// random node where there is no successor, and returns the nodes visited.
+QVector<MarkovVocabulary::TokenId> walk(const MarkovChain &chain, int drawCount)
+{
+  QVector<MarkovVocabulary::TokenId> visited;
+  visited.reserve(drawCount);
+  std::mt19937 rng(2);
+  std::uniform_int_distribution<int> nodeDist(0, chain.count() - 1);
+  std::uniform_real_distribution<qreal> pDist(0.0, 1.0);
+  const MarkovNode *node = Q_NULLPTR;
+  for (int i = 0; i < drawCount; ++i) {
+    if (node == Q_NULLPTR) {
+      node = chain.node(MarkovVocabulary::TokenId(nodeDist(rng)));
+    }
+    visited.append(node->id());
+    node = chain.selectSuccessor(node, pDist(rng));
+  }
+  return visited;
+}
+
+
+// Walks the snapshot paged in with budgets of a fraction of its size and
+// compares the walks and the transitions with those of the mapped file.
+// Then adds text to both and checks that the paged chain stays paged.
+bool checkPaged(const Corpus &corpus, const QString &filename)
+{
+  const int drawCount = 1000000;
+  MarkovChain mapped;
+  if (!mapped.readFromSnapshot(filename))
+    return false;
+  const QVector<MarkovVocabulary::TokenId> &expectedWalk = walk(mapped, drawCount);
+  const QHash<QByteArray, quint32> &expectedCounts = transitionCounts(mapped);
+  const qint64 fileSize = QFileInfo(filename).size();
+  static const int Percentages[] = { 1, 10, 100 };
+  bool same = true;
+  for (size_t i = 0; i < sizeof(Percentages) / sizeof(Percentages[0]); ++i) {
+    MarkovChain paged;
+    if (!paged.readFromSnapshot(filename, qMax(qint64(1), fileSize * Percentages[i] / 100))) {
+      same = false;
+      continue;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    const QVector<MarkovVocabulary::TokenId> &pagedWalk = walk(paged, drawCount);
+    report("selectSuccessorPaged", corpus, QString("budget%1").arg(Percentages[i]), drawCount, timer.nsecsElapsed());
+    same = same && pagedWalk == expectedWalk && transitionCounts(paged) == expectedCounts;
+  }
+  MarkovChain paged;
+  if (!paged.readFromSnapshot(filename, qMax(qint64(1), fileSize / 10)))
+    return false;
+  const QString &text = QString::fromUtf8(corpus.text.left(64 * 1024));
+  paged.addText(text);
+  paged.postProcess();
+  mapped.addText(text);
+  mapped.postProcess();
+  same = same && paged.frozen().isPaged() && transitionCounts(paged) == transitionCounts(mapped);
+  if (!same) {
+    QTextStream(stderr) << "the paged snapshot of the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words differs from the mapped one" << '\n';
+  }
+  return same;
+}
+
+
+// Generates many short texts walk by walk and in lockstep, and compares
+// them.
+bool checkLockstep(const Corpus &corpus, const MarkovChain &chain, const QString &variant)
+{
+  const int textCount = 4096;
+  const int wordCount = 32;
+  QVector<std::mt19937> rngs;
+  for (int i = 0; i < textCount; ++i) {
+    rngs.append(MarkovGenerator::rngFor(3, i));
+  }
+  QVector<std::mt19937> scalarRngs = rngs;
+  QStringList expected;
+  QElapsedTimer timer;
+  timer.start();
+  for (int i = 0; i < textCount; ++i) {
+    QString text;
+    MarkovWalker(&chain, scalarRngs[i]).next(text, wordCount);
+    expected.append(text);
+  }
+  report("walk", corpus, variant + "-scalar", qint64(textCount) * wordCount, timer.nsecsElapsed());
+  QStringList texts;
+  for (int i = 0; i < textCount; ++i) {
+    texts.append(QString());
+  }
+  timer.start();
+  MarkovBatchWalker(&chain, rngs).next(texts, wordCount);
+  report("walk", corpus, variant + "-lockstep", qint64(textCount) * wordCount, timer.nsecsElapsed());
+  if (texts != expected) {
+    QTextStream(stderr) << "lockstep walks through the " << corpus.distribution << " corpus with "
+                        << corpus.vocabulary << " words differ from single walks (" << variant << ")" << '\n';
+    return false;
+  }
+  return true;
+}
+
+
+bool run(const Corpus &corpus, const QString &tempPath)
+{
+  bool ok = true;
+  QElapsedTimer timer;
+
+  MarkovTokenizer tokenizer;
+  MarkovTokenizer::TokenList tokens;
+  timer.start();
+  tokenizer.tokenize(corpus.text, tokens);
+  report("tokenize", corpus, QString(), tokens.size(), timer.nsecsElapsed());
+
+  MarkovVocabulary vocabulary;
+  QVector<MarkovVocabulary::TokenId> ids;
+  ids.reserve(tokens.size());
+  foreach (const MarkovTokenizer::Token &token, tokens) {
+    ids.append(vocabulary.intern(token.data, token.size));
+  }
+  benchmarkAddSuccessor(corpus, ids, vocabulary.count(), "linear", addLinear);
+  benchmarkAddSuccessor(corpus, ids, vocabulary.count(), "insertion", addInsertion);
+
+  for (int order = 1; order <= 2; ++order) {
+    const QString variant = QString("order%1").arg(order);
+    MarkovChain chain;
+    chain.setModelOrder(order);
+    timer.start();
+    chain.addText(QString::fromUtf8(corpus.text));
+    report("add", corpus, variant, tokens.size(), timer.nsecsElapsed());
+
+    timer.start();
+    chain.postProcess();
+    report("postProcess", corpus, variant, chain.count(), timer.nsecsElapsed());
+
+    // small additions like a text dropped onto the window
+    const int snippetCount = 100;
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> snippetDist(0, qMax(0, corpus.text.size() - 1000));
+    qint64 ns = 0;
+    for (int i = 0; i < snippetCount; ++i) {
+      const int begin = corpus.text.indexOf(' ', snippetDist(rng)) + 1;
+      chain.addText(QString::fromUtf8(corpus.text.mid(begin, 1000)));
+      timer.start();
+      chain.postProcess();
+      ns += timer.nsecsElapsed();
+    }
+    report("postProcess", corpus, variant + "-incremental", snippetCount, ns);
+
+    const int drawCount = 1000000;
+    std::uniform_int_distribution<int> nodeDist(0, chain.count() - 1);
+    std::uniform_real_distribution<qreal> pDist(0.0, 1.0);
+    QVector<MarkovVocabulary::TokenId> history;
+    for (int mode = MarkovFrozenChain::CumulativeSampling; mode <= MarkovFrozenChain::AliasSampling; ++mode) {
+      chain.setSamplingMode(MarkovFrozenChain::SamplingMode(mode));
+      rng.seed(2);
+      timer.start();
+      const MarkovNode *node = Q_NULLPTR;
+      for (int i = 0; i < drawCount; ++i) {
+        if (node == Q_NULLPTR) {
+          node = chain.node(MarkovVocabulary::TokenId(nodeDist(rng)));
+          history.clear();
+        }
+        history.append(node->id());
+        if (history.size() > order) {
+          history.remove(0);
+        }
+        node = chain.selectSuccessor(history, pDist(rng));
+      }
+      const qint64 elapsed = timer.nsecsElapsed();
+      const QString modeVariant = variant + (mode == MarkovFrozenChain::AliasSampling ? "-alias" : "-cumulative");
+      report("selectSuccessor", corpus, modeVariant, drawCount, elapsed);
+      ok = checkLockstep(corpus, chain, modeVariant) && ok;
+    }
+
+    if (order > 1)
+      continue;
+    static const QStringList Suffixes = { ".markov", ".markovz", MarkovChain::SnapshotSuffix };
+    const QHash<QByteArray, quint32> &counts = transitionCounts(chain);
+    foreach (QString suffix, Suffixes) {
+      const QString filename = QString("%1/%2-%3%4").arg(tempPath).arg(corpus.distribution).arg(corpus.vocabulary).arg(suffix);
+      timer.start();
+      if (!chain.save(filename)) {
+        QTextStream(stderr) << "cannot save " << filename << '\n';
+        ok = false;
+        continue;
+      }
+      const qint64 saveTime = timer.nsecsElapsed();
+      const qint64 fileSize = QFileInfo(filename).size();
+      report("save", corpus, suffix.mid(1), fileSize, saveTime);
+      MarkovChain loaded;
+      timer.start();
+      const bool read = loaded.readFromMarkovFile(filename);
+      const qint64 readTime = timer.nsecsElapsed();
+      if (!read || loaded.count() != chain.count() || transitionCounts(loaded) != counts) {
+        QTextStream(stderr) << filename << (read ? " differs from the chain it was saved from" : " cannot be read") << '\n';
+        ok = false;
+        continue;
+      }
+      report("readFromMarkovFile", corpus, suffix.mid(1), fileSize, readTime);
+      if (suffix == MarkovChain::SnapshotSuffix) {
+        ok = checkPaged(corpus, filename) && ok;
+      }
+    }
+  }
+  return ok;
+}
+
+}
+
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication a(argc, argv);
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Benchmarks of the Markov core, one JSON object per line");
+  parser.addHelpOption();
+  const QCommandLineOption tokensOption("tokens", "Generate corpora of <n> tokens.", "n", "1000000");
+  const QCommandLineOption vocabulariesOption("vocabularies", "Comma-separated vocabulary sizes.", "sizes", "1000,10000,100000");
+  const QCommandLineOption corpusOption("corpus", "Also check the tokenizer on the text in <file>.", "file");
+  parser.addOption(tokensOption);
+  parser.addOption(vocabulariesOption);
+  parser.addOption(corpusOption);
+  parser.process(a);
+
+  QTemporaryDir tempDir;
+  if (!tempDir.isValid())
+    return EXIT_FAILURE;
+  const int tokenCount = parser.value(tokensOption).toInt();
+  bool ok = checkTokenizerSamples();
+  if (parser.isSet(corpusOption)) {
+    QFile file(parser.value(corpusOption));
+    if (!file.open(QIODevice::ReadOnly)) {
+      QTextStream(stderr) << "cannot open " << file.fileName() << ": " << file.errorString() << '\n';
+      return EXIT_FAILURE;
+    }
+    ok = checkTokenizer(file.readAll(), file.fileName()) && ok;
+  }
+  foreach (QString size, parser.value(vocabulariesOption).split(',', QString::SkipEmptyParts)) {
+    for (int zipf = 0; zipf <= 1; ++zipf) {
+      const Corpus &corpus = makeCorpus(size.toInt(), zipf != 0, tokenCount, 42);
+      ok = checkTokenizer(corpus.text, QString("the %1 corpus with %2 words").arg(corpus.distribution).arg(corpus.vocabulary)) && ok;
+      ok = run(corpus, tempDir.path()) && ok;
+      for (int order = 1; order <= 2; ++order) {
+        ok = checkConcurrentAdd(corpus, order) && ok;
+        ok = checkSeeded(corpus, order) && ok;
+      }
+      ok = checkOnline(corpus) && ok;
+      ok = checkMerge(corpus, tempDir.path()) && ok;
+      ok = checkPrune(corpus, tempDir.path()) && ok;
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,11 +7,18 @@
 #include <QApplication>
 #include <QDebug>
 #include "mainwindow.h"
+#include "markovbatch.h"
 #include "globals.h"
 
 
 int main(int argc, char *argv[])
 {
+  if (MarkovBatch::isRequested(argc, argv)) {
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setOrganizationName(AppCompanyName);
+    QCoreApplication::setApplicationName(AppName);
+    return MarkovBatch().run(a.arguments());
+  }
   QApplication a(argc, argv);
   QCoreApplication::setOrganizationName(AppCompanyName);
   QCoreApplication::setApplicationName(AppName);
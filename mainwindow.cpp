@@ -12,26 +12,38 @@
 #include <QSettings>
 #include <QString>
 #include <QDateTime>
+#include <QFile>
 #include <QFileDialog>
 #include <QFileInfo>
 #include <QJsonDocument>
 #include <QMessageBox>
+#include <QDialog>
+#include <QDialogButtonBox>
+#include <QFormLayout>
+#include <QSpinBox>
+#include <QCheckBox>
 #include <QMimeData>
 #include <QElapsedTimer>
+#include <QTextCursor>
+#include <QMutex>
+#include <QMutexLocker>
 
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "globals.h"
 #include "markovnode.h"
-#include "markovnode.h"
 #include "markovchain.h"
+#include "markovgenerator.h"
 
 
 class MainWindowPrivate {
 public:
   MainWindowPrivate(void)
     : markovChain(new MarkovChain)
-    , pDist(0.0, 1.0)
+    , loadingChain(Q_NULLPTR)
+    , readingChain(Q_NULLPTR)
+    , loadCancelled(false)
+    , generation(0)
     , textFilesLoaded(0)
   {
     rng.seed(QDateTime::currentDateTimeUtc().toTime_t());
@@ -41,18 +53,35 @@ public:
     if (markovChain != Q_NULLPTR) {
       delete markovChain;
     }
+    if (loadingChain != Q_NULLPTR) {
+      delete loadingChain;
+    }
   }
 
   MarkovChain *markovChain;
   std::mt19937 rng;
-  std::uniform_real_distribution<qreal> pDist;
   QSettings settings;
   QString lastSaveMarkovDirectory;
   QString lastLoadMarkovDirectory;
   QString lastLoadTextDirectory;
   QFuture<void> loadTextFuture;
+  QFuture<void> loadMarkovFuture;
+  // the chain a model is loaded into, which replaces markovChain when done
+  MarkovChain *loadingChain;
+  // the chain being read from a file, guarded by loadMutex so that it can
+  // be cancelled without being deleted under the cancelling thread's feet
+  MarkovChain *readingChain;
+  bool loadCancelled;
+  QMutex loadMutex;
+  // text is generated on a worker thread, see generateTextThread()
+  QFuture<void> generateFuture;
+  QAtomicInt generateCancelled;
+  // the number of the current generation run, whose pieces are shown
+  int generation;
   int textFilesLoaded;
+  // times the whole import; importStart holds the counters from before it
   QElapsedTimer stopwatch;
+  MarkovMetrics importStart;
 };
 
 
@@ -66,17 +95,24 @@ MainWindow::MainWindow(QWidget *parent)
   ui->tokensProgressBar->hide();
   ui->filesProgressBar->hide();
 
-  QObject::connect(this, SIGNAL(loadingTextFile(QString)), this, SLOT(onTextFilesLoading(QString)));
+  connectMarkovChain(d_ptr->markovChain);
   QObject::connect(this, SIGNAL(textFilesLoadFinished()), this, SLOT(onTextFilesLoaded()));
-  QObject::connect(d_ptr->markovChain, SIGNAL(progressValueChanged(int)), ui->tokensProgressBar, SLOT(setValue(int)));
-  QObject::connect(d_ptr->markovChain, SIGNAL(progressRangeChanged(int, int)), ui->tokensProgressBar, SLOT(setRange(int,int)));
+  QObject::connect(this, SIGNAL(textFilesLoadCanceled()), this, SLOT(onTextFilesLoadCanceled()));
+  QObject::connect(this, SIGNAL(markovChainLoadFinished(bool)), this, SLOT(onMarkovChainLoaded(bool)));
+  QObject::connect(this, SIGNAL(readingMarkovFile(QString)), this, SLOT(onTextFilesLoading(QString)));
+  QObject::connect(this, SIGNAL(textGenerated(QString, int)), this, SLOT(onTextGenerated(QString, int)));
+  QObject::connect(this, SIGNAL(textGenerationFinished(int)), this, SLOT(onTextGenerationFinished(int)));
 
   QObject::connect(ui->actionExit, SIGNAL(triggered(bool)), SLOT(close()));
   QObject::connect(ui->actionLoadTextFiles, SIGNAL(triggered(bool)), SLOT(onLoadTextFiles()));
   QObject::connect(ui->actionSaveMarkovChain, SIGNAL(triggered(bool)), SLOT(onSaveMarkovChain()));
   QObject::connect(ui->actionLoadMarkovChain, SIGNAL(triggered(bool)), SLOT(onLoadMarkovChain()));
+  QObject::connect(ui->actionCancel, SIGNAL(triggered(bool)), SLOT(onCancel()));
   QObject::connect(ui->actionResetMarkovChain, SIGNAL(triggered(bool)), SLOT(onResetMarkovChain()));
+  QObject::connect(ui->actionPruneMarkovChain, SIGNAL(triggered(bool)), SLOT(onPruneMarkovChain()));
+  QObject::connect(ui->actionSaveMetrics, SIGNAL(triggered(bool)), SLOT(onSaveMetrics()));
   QObject::connect(ui->generatePushButton, SIGNAL(clicked(bool)), SLOT(onGenerateText()));
+  QObject::connect(ui->orderSpinBox, SIGNAL(valueChanged(int)), SLOT(onModelOrderChanged(int)));
   QObject::connect(ui->actionAbout, SIGNAL(triggered(bool)), SLOT(about()));
   QObject::connect(ui->actionAboutQt, SIGNAL(triggered(bool)), SLOT(aboutQt()));
 
@@ -96,9 +132,11 @@ MainWindow::~MainWindow()
 void MainWindow::closeEvent(QCloseEvent *e)
 {
   Q_D(MainWindow);
-  if (d->loadTextFuture.isRunning()) {
-    d->markovChain->cancel();
+  stopGenerating();
+  if (isLoading()) {
+    onCancel();
     d->loadTextFuture.waitForFinished();
+    d->loadMarkovFuture.waitForFinished();
   }
   saveSettings();
   e->accept();
@@ -139,6 +177,9 @@ void MainWindow::dragLeaveEvent(QDragLeaveEvent *)
 void MainWindow::dropEvent(QDropEvent *e)
 {
   Q_D(MainWindow);
+  if (isLoading())
+    return;
+  stopGenerating();
   if (e->keyboardModifiers() & Qt::ShiftModifier) {
     d->markovChain->clear();
   }
@@ -153,7 +194,12 @@ void MainWindow::dropEvent(QDropEvent *e)
     loadTextFiles(textFileNames);
   }
   else if (e->mimeData()->hasText()) {
+    if (d->markovChain->isQuantized()) {
+      ui->statusbar->showMessage(tr("No text can be added to a Markov chain stored in 16 bits."), 3000);
+      return;
+    }
     d->stopwatch.start();
+    d->importStart = d->markovChain->metrics();
     d->markovChain->addText(e->mimeData()->text());
     d->markovChain->postProcess();
     onTextFilesLoaded();
@@ -161,6 +207,31 @@ void MainWindow::dropEvent(QDropEvent *e)
 }
 
 
+// The chain reports the progress of reading files to the progress bars.
+// Signals from worker threads are queued to the GUI thread.
+void MainWindow::connectMarkovChain(MarkovChain *chain)
+{
+  QObject::connect(chain, SIGNAL(readingTextFile(QString)), this, SLOT(onTextFilesLoading(QString)), Qt::UniqueConnection);
+  QObject::connect(chain, SIGNAL(progressValueChanged(int)), ui->tokensProgressBar, SLOT(setValue(int)), Qt::UniqueConnection);
+  QObject::connect(chain, SIGNAL(progressRangeChanged(int, int)), ui->tokensProgressBar, SLOT(setRange(int,int)), Qt::UniqueConnection);
+}
+
+
+bool MainWindow::isLoading(void) const
+{
+  Q_D(const MainWindow);
+  return d->loadTextFuture.isRunning() || d->loadMarkovFuture.isRunning();
+}
+
+
+// The Cancel action stops whatever runs in the background.
+void MainWindow::updateCancelAction(void)
+{
+  Q_D(MainWindow);
+  ui->actionCancel->setEnabled(isLoading() || d->generateFuture.isRunning());
+}
+
+
 void MainWindow::saveSettings(void)
 {
   Q_D(MainWindow);
@@ -170,6 +241,8 @@ void MainWindow::saveSettings(void)
   d->settings.setValue("options/lastLoadMarkovDirectory", d->lastLoadMarkovDirectory);
   d->settings.setValue("options/lastLoadTextDirectory", d->lastLoadTextDirectory);
   d->settings.setValue("options/wordCount", ui->wordCountSpinBox->value());
+  d->settings.setValue("options/samplingMode", int(d->markovChain->samplingMode()));
+  d->settings.setValue("options/modelOrder", ui->orderSpinBox->value());
   d->settings.sync();
 }
 
@@ -183,73 +256,148 @@ void MainWindow::restoreSettings(void)
   d->lastLoadMarkovDirectory = d->settings.value("options/lastLoadMarkovDirectory").toString();
   d->lastLoadTextDirectory = d->settings.value("options/lastLoadTextDirectory").toString();
   ui->wordCountSpinBox->setValue(d->settings.value("options/wordCount", 500).toInt());
+  d->markovChain->setSamplingMode(MarkovFrozenChain::SamplingMode(d->settings.value("options/samplingMode", MarkovFrozenChain::AliasSampling).toInt()));
+  ui->orderSpinBox->setValue(d->settings.value("options/modelOrder", 1).toInt());
+  d->markovChain->setModelOrder(ui->orderSpinBox->value());
 }
 
 
-QString MainWindow::generateText_Simple(void)
+// Runs on a worker thread and hands the text to the window in pieces of
+// MarkovGenerator::ChunkWords words, so that the window stays responsive
+// and shows the text as it grows. The pieces are tagged with `run`, so
+// those of a run that was stopped can be told apart.
+void MainWindow::generateTextThread(int wordCount, quint32 seed, int run)
 {
   Q_D(MainWindow);
-  std::uniform_int_distribution<int> nDist(0, d->markovChain->count() - 1);
-  MarkovNode *node = Q_NULLPTR;
-  QString lastToken;
-  QString result;
-  int N = ui->wordCountSpinBox->value();
-  while (N-- > 0) {
-    if (node == Q_NULLPTR) {
-      node = d->markovChain->at(nDist(d->rng));
-      int nTries = d->markovChain->count() / 2;
-      do {
-        node = d->markovChain->at(nDist(d->rng));
-      } while (!node->token().at(0).isUpper() && nTries-- > 0);
-      if (!result.isEmpty()) {
-        result += " \\\n";
-      }
-    }
-    static const QStringList StopTokens = { ".", ",", ":", ";", "?", "!", ")", "«", "_" };
-    const QString &token = node->token();
-    if (!lastToken.isEmpty() && !StopTokens.contains(token)) {
-      result += " ";
-    }
-    result += token;
-    lastToken = token;
-    node = node->selectSuccessor(d->pDist(d->rng));
+  QElapsedTimer timer;
+  timer.start();
+  std::mt19937 rng(seed);
+  MarkovWalker walker(d->markovChain, rng);
+  while (walker.wordCount() < wordCount && !d->generateCancelled.load()) {
+    QString text;
+    if (walker.next(text, int(qMin(qint64(MarkovGenerator::ChunkWords), wordCount - walker.wordCount()))) == 0)
+      break;
+    emit textGenerated(text, run);
   }
-  return result;
+  d->markovChain->addGenerated(walker.wordCount(), timer.nsecsElapsed());
+  emit textGenerationFinished(run);
+}
+
+
+// Generation walks the chain, which must not be changed meanwhile. The
+// pieces of the stopped run that are still queued are dropped.
+void MainWindow::stopGenerating(void)
+{
+  Q_D(MainWindow);
+  d->generateCancelled.store(1);
+  d->generateFuture.waitForFinished();
+  ++d->generation;
+  updateCancelAction();
 }
 
 
 void MainWindow::onGenerateText(void)
 {
-  QString generatedText;
+  Q_D(MainWindow);
+  stopGenerating();
+  ui->plainTextEdit->clear();
   if (ui->algorithmComboBox->currentText() == tr("Simple")) {
-    generatedText = generateText_Simple();
+    d->generateCancelled.store(0);
+    d->generateFuture = QtConcurrent::run(this, &MainWindow::generateTextThread, ui->wordCountSpinBox->value(), quint32(d->rng()), ++d->generation);
   }
-  ui->plainTextEdit->setPlainText(generatedText);
+  updateCancelAction();
+}
+
+
+void MainWindow::onTextGenerated(const QString &text, int run)
+{
+  Q_D(MainWindow);
+  if (run != d->generation)
+    return;
+  QTextCursor cursor(ui->plainTextEdit->document());
+  cursor.movePosition(QTextCursor::End);
+  cursor.insertText(text);
+}
+
+
+void MainWindow::onTextGenerationFinished(int run)
+{
+  Q_D(MainWindow);
+  if (run != d->generation)
+    return;
+  // the signal is emitted right before the thread returns
+  d->generateFuture.waitForFinished();
+  updateCancelAction();
+}
+
+
+void MainWindow::onModelOrderChanged(int order)
+{
+  Q_D(MainWindow);
+  stopGenerating();
+  d->markovChain->setModelOrder(order);
 }
 
 
 void MainWindow::onTextFilesLoadCanceled(void)
 {
+  Q_D(MainWindow);
+  // the signal is emitted right before the thread returns
+  d->loadTextFuture.waitForFinished();
   ui->statusbar->showMessage(tr("Cancelled."), 3000);
   ui->tokensProgressBar->hide();
   ui->filesProgressBar->hide();
+  updateCancelAction();
   setCursor(Qt::ArrowCursor);
+  stopGenerating();
+  d->markovChain->setOnline(false);
+  ui->orderSpinBox->setEnabled(true);
+}
+
+
+void MainWindow::onCancel(void)
+{
+  Q_D(MainWindow);
+  d->generateCancelled.store(1);
+  if (d->loadTextFuture.isRunning()) {
+    d->markovChain->cancel();
+  }
+  QMutexLocker locker(&d->loadMutex);
+  d->loadCancelled = true;
+  if (d->readingChain != Q_NULLPTR) {
+    d->readingChain->cancel();
+  }
 }
 
 
 void MainWindow::onTextFilesLoaded(void)
 {
   Q_D(MainWindow);
-  const qint64 elapsed = d->stopwatch.elapsed() / 1000;
-  ui->statusbar->showMessage(tr("Loaded in %1 %2.")
-                             .arg(elapsed == 0 ? tr("<1") : QString::number(elapsed))
-                             .arg(elapsed < 2 ? tr("second") : tr("seconds"))
+  d->loadTextFuture.waitForFinished();
+  const qreal elapsed = qreal(d->stopwatch.nsecsElapsed()) / 1e9;
+  const MarkovMetrics &metrics = d->markovChain->metrics();
+  const qint64 tokens = metrics.tokens - d->importStart.tokens;
+  // the phases add up the time of every thread
+  const auto phaseSeconds = [&metrics, d](MarkovMetrics::Phase phase) {
+    return qreal(metrics.phaseTime[phase] - d->importStart.phaseTime[phase]) / 1e9;
+  };
+  ui->statusbar->showMessage(tr("Loaded in %1 seconds, %2 tokens/s, %3 nodes, %4 edges, %5 MB "
+                                "(threads spent %6 s reading, %7 s tokenizing, %8 s inserting).")
+                             .arg(elapsed, 0, 'f', 3)
+                             .arg(elapsed > 0 ? qreal(tokens) / elapsed : 0, 0, 'f', 0)
+                             .arg(metrics.nodes)
+                             .arg(metrics.edges)
+                             .arg(qreal(metrics.memoryUsage()) / (1024 * 1024), 0, 'f', 1)
+                             .arg(phaseSeconds(MarkovMetrics::ReadPhase), 0, 'f', 3)
+                             .arg(phaseSeconds(MarkovMetrics::TokenizePhase), 0, 'f', 3)
+                             .arg(phaseSeconds(MarkovMetrics::InsertPhase), 0, 'f', 3)
                              , 3000);
   ui->tokensProgressBar->hide();
   ui->filesProgressBar->hide();
   setCursor(Qt::ArrowCursor);
-  ui->generatePushButton->setEnabled(true);
-  ui->plainTextEdit->setEnabled(true);
+  stopGenerating();
+  d->markovChain->setOnline(false);
+  ui->orderSpinBox->setEnabled(true);
   onGenerateText();
 }
 
@@ -259,39 +407,48 @@ void MainWindow::onTextFilesLoading(const QString &filename)
   Q_D(MainWindow);
   ++d->textFilesLoaded;
   ui->filesProgressBar->setValue(d->textFilesLoaded);
-  ui->statusbar->showMessage(tr("Loading %1 ...").arg(filename));
+  ui->statusbar->showMessage(tr("Loading %1 ...").arg(QFileInfo(filename).fileName()));
 }
 
 
 void MainWindow::loadTextFilesThread(const QStringList &textFileNames)
 {
   Q_D(MainWindow);
-  foreach (QString textFilename, textFileNames) {
-    if (!d->markovChain->isCancelled()) {
-      emit loadingTextFile(QFileInfo(textFilename).fileName());
-      d->markovChain->readFromTextFile(textFilename);
-    }
-  }
+  const bool ok = d->markovChain->readFromTextFiles(textFileNames);
+  // what was read before a cancel is kept, and frozen before it is walked
   d->markovChain->postProcess();
-  emit textFilesLoadFinished();
+  if (ok) {
+    emit textFilesLoadFinished();
+  }
+  else {
+    emit textFilesLoadCanceled();
+  }
 }
 
 
 void MainWindow::loadTextFiles(QStringList textFilenames)
 {
   Q_D(MainWindow);
-  if (textFilenames.count() > 0) {
+  if (textFilenames.count() > 0 && !isLoading()) {
+    if (d->markovChain->isQuantized()) {
+      ui->statusbar->showMessage(tr("No text can be added to a Markov chain stored in 16 bits."), 3000);
+      return;
+    }
+    // text can be generated from what has been read so far while the files are read
+    stopGenerating();
+    d->markovChain->setOnline(true);
     d->stopwatch.start();
+    d->importStart = d->markovChain->metrics();
     d->textFilesLoaded = 0;
     ui->filesProgressBar->setRange(0, textFilenames.count());
     ui->filesProgressBar->setValue(0);
-    setCursor(Qt::WaitCursor);
-    ui->generatePushButton->setEnabled(false);
-    ui->plainTextEdit->setEnabled(false);
+    setCursor(Qt::BusyCursor);
+    ui->orderSpinBox->setEnabled(false);
     d->lastLoadTextDirectory = QFileInfo(textFilenames.first()).absolutePath();
     ui->tokensProgressBar->show();
     ui->filesProgressBar->show();
     d->loadTextFuture = QtConcurrent::run(this, &MainWindow::loadTextFilesThread, textFilenames);
+    updateCancelAction();
   }
 }
 
@@ -311,40 +468,147 @@ void MainWindow::onLoadTextFiles(void)
 void MainWindow::onSaveMarkovChain(void)
 {
   Q_D(MainWindow);
+  if (isLoading())
+    return;
   QString markovFilename = QFileDialog::getSaveFileName(
         this,
         tr("Save Markov chain to ..."),
         d->lastSaveMarkovDirectory,
-        tr("Markov files (*.markov *.markovz)"));
+        tr("Markov files (*.markov *.markovz *.markovs)"));
   if (!markovFilename.isEmpty()) {
     d->lastSaveMarkovDirectory = QFileInfo(markovFilename).absolutePath();
-    d->markovChain->save(markovFilename);
+    stopGenerating();
+    if (!d->markovChain->save(markovFilename)) {
+      ui->statusbar->showMessage(tr("Cannot save Markov chain."), 3000);
+    }
+  }
+}
+
+
+// Runs on a worker thread and reads the model files into loadingChain,
+// which the GUI thread has not handed out to anyone else. Several models
+// are read one by one and summed into the chain in one pass.
+void MainWindow::loadMarkovChainThread(const QStringList &markovFilenames)
+{
+  Q_D(MainWindow);
+  bool ok = true;
+  if (markovFilenames.size() == 1) {
+    ok = readMarkovFile(d->loadingChain, markovFilenames.first());
+  }
+  else {
+    QList<const MarkovChain*> models;
+    foreach (QString markovFilename, markovFilenames) {
+      MarkovChain *model = new MarkovChain;
+      models.append(model);
+      if (!readMarkovFile(model, markovFilename)) {
+        ok = false;
+        break;
+      }
+    }
+    if (ok) {
+      QMutexLocker locker(&d->loadMutex);
+      ok = !d->loadCancelled;
+    }
+    if (ok) {
+      d->loadingChain->merge(models);
+    }
+    qDeleteAll(models);
+  }
+  emit markovChainLoadFinished(ok);
+}
+
+
+// Reads one model file into `chain` on a worker thread, with the chain
+// published as readingChain meanwhile, so that onCancel() can
+// stop it. readFromMarkovFile() resets the chain's cancel flag when it
+// starts, so a cancel that comes in just before that is caught by
+// loadCancelled afterwards.
+bool MainWindow::readMarkovFile(MarkovChain *chain, const QString &markovFilename)
+{
+  Q_D(MainWindow);
+  {
+    QMutexLocker locker(&d->loadMutex);
+    if (d->loadCancelled)
+      return false;
+    d->readingChain = chain;
   }
+  emit readingMarkovFile(markovFilename);
+  connectMarkovChain(chain);
+  const bool ok = chain->readFromMarkovFile(markovFilename);
+  QMutexLocker locker(&d->loadMutex);
+  d->readingChain = Q_NULLPTR;
+  return ok && !d->loadCancelled;
 }
 
 
 void MainWindow::onLoadMarkovChain(void)
 {
   Q_D(MainWindow);
-  QString markovFilename = QFileDialog::getOpenFileName(
+  if (isLoading())
+    return;
+  QStringList markovFilenames = QFileDialog::getOpenFileNames(
         this,
         tr("Load Markov chain from ..."),
         d->lastLoadMarkovDirectory,
-        tr("Markov files (*.markov *.markovz)"));
-  if (!markovFilename.isEmpty()) {
-    d->lastLoadMarkovDirectory = QFileInfo(markovFilename).absolutePath();
+        tr("Markov files (*.markov *.markovz *.markovs)"));
+  if (!markovFilenames.isEmpty()) {
+    d->lastLoadMarkovDirectory = QFileInfo(markovFilenames.first()).absolutePath();
     d->stopwatch.start();
-    bool ok = d->markovChain->readFromMarkovFile(markovFilename);
-    if (ok) {
-      onTextFilesLoaded();
-    }
+    d->importStart = MarkovMetrics();
+    d->textFilesLoaded = 0;
+    d->loadCancelled = false;
+    // the current chain keeps generating text until the new one is ready
+    d->loadingChain = new MarkovChain;
+    d->loadingChain->setSamplingMode(d->markovChain->samplingMode());
+    d->loadingChain->setModelOrder(ui->orderSpinBox->value());
+    ui->filesProgressBar->setRange(0, markovFilenames.count());
+    ui->filesProgressBar->setValue(0);
+    ui->tokensProgressBar->setValue(0);
+    ui->tokensProgressBar->show();
+    ui->filesProgressBar->show();
+    setCursor(Qt::BusyCursor);
+    d->loadMarkovFuture = QtConcurrent::run(this, &MainWindow::loadMarkovChainThread, markovFilenames);
+    updateCancelAction();
   }
 }
 
 
+// Swaps the loaded chain in for the current one, or drops it if loading
+// failed or was cancelled, which leaves the current chain as it was.
+void MainWindow::onMarkovChainLoaded(bool ok)
+{
+  Q_D(MainWindow);
+  // the signal is emitted right before the thread returns
+  d->loadMarkovFuture.waitForFinished();
+  MarkovChain *loadedChain = d->loadingChain;
+  d->loadingChain = Q_NULLPTR;
+  if (!ok) {
+    // the current chain was never touched, so it keeps generating as it did
+    delete loadedChain;
+    ui->statusbar->showMessage(d->loadCancelled ? tr("Cancelled.") : tr("Cannot load Markov chain."), 3000);
+    ui->tokensProgressBar->hide();
+    ui->filesProgressBar->hide();
+    updateCancelAction();
+    setCursor(Qt::ArrowCursor);
+    return;
+  }
+  loadedChain->setSamplingMode(d->markovChain->samplingMode());
+  loadedChain->setModelOrder(ui->orderSpinBox->value());
+  connectMarkovChain(loadedChain);
+  stopGenerating();
+  MarkovChain *previousChain = d->markovChain;
+  d->markovChain = loadedChain;
+  delete previousChain;
+  onTextFilesLoaded();
+}
+
+
 void MainWindow::onResetMarkovChain(void)
 {
   Q_D(MainWindow);
+  if (isLoading())
+    return;
+  stopGenerating();
   // TODO: QMessageBox::question() should ask user if she really wants to reset the Markov chain
   d->markovChain->clear();
   ui->plainTextEdit->clear();
@@ -352,6 +616,64 @@ void MainWindow::onResetMarkovChain(void)
 }
 
 
+void MainWindow::onPruneMarkovChain(void)
+{
+  Q_D(MainWindow);
+  if (isLoading())
+    return;
+  QDialog dialog(this);
+  dialog.setWindowTitle(tr("Prune Markov chain"));
+  QSpinBox *minCountSpinBox = new QSpinBox;
+  minCountSpinBox->setRange(1, 1000000);
+  minCountSpinBox->setValue(2);
+  QSpinBox *topKSpinBox = new QSpinBox;
+  topKSpinBox->setRange(0, 1000000);
+  topKSpinBox->setSpecialValueText(tr("all"));
+  QCheckBox *quantizeCheckBox = new QCheckBox(tr("Store counts in 16 bits"));
+  QDialogButtonBox *buttonBox = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+  QObject::connect(buttonBox, SIGNAL(accepted()), &dialog, SLOT(accept()));
+  QObject::connect(buttonBox, SIGNAL(rejected()), &dialog, SLOT(reject()));
+  QFormLayout *layout = new QFormLayout(&dialog);
+  layout->addRow(tr("Drop edges counted fewer times than"), minCountSpinBox);
+  layout->addRow(tr("Keep most frequent successors"), topKSpinBox);
+  layout->addRow(quantizeCheckBox);
+  layout->addRow(buttonBox);
+  if (dialog.exec() != QDialog::Accepted)
+    return;
+  stopGenerating();
+  MarkovChain::PruneOptions options;
+  options.minCount = minCountSpinBox->value();
+  options.topK = topKSpinBox->value();
+  options.quantize = quantizeCheckBox->isChecked();
+  const MarkovChain::PruneReport &report = d->markovChain->prune(options);
+  ui->statusbar->showMessage(tr("Pruned %1 nodes and %2 edges, %3% of the mass lost, %4% moved by quantization, %5 MB saved.")
+                             .arg(report.nodesRemoved)
+                             .arg(report.edgesRemoved)
+                             .arg(100 * report.prunedMass, 0, 'f', 1)
+                             .arg(100 * report.quantizationError, 0, 'f', 2)
+                             .arg(qreal(report.memoryBefore - report.memoryAfter) / (1024 * 1024), 0, 'f', 1));
+}
+
+
+void MainWindow::onSaveMetrics(void)
+{
+  Q_D(MainWindow);
+  if (isLoading())
+    return;
+  QString metricsFilename = QFileDialog::getSaveFileName(
+        this,
+        tr("Save metrics to ..."),
+        d->lastSaveMarkovDirectory,
+        tr("JSON files (*.json)"));
+  if (!metricsFilename.isEmpty()) {
+    QFile metricsFile(metricsFilename);
+    if (metricsFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+      metricsFile.write(QJsonDocument(d->markovChain->metrics().toJson()).toJson());
+    }
+  }
+}
+
+
 void MainWindow::about(void)
 {
   QMessageBox::about(
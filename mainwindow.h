@@ -22,6 +22,7 @@ class MainWindow;
 }
 
 class MainWindowPrivate;
+class MarkovChain;
 
 class MainWindow : public QMainWindow
 {
@@ -33,7 +34,11 @@ public:
 
 signals:
   void textFilesLoadFinished(void);
-  void loadingTextFile(QString);
+  void textFilesLoadCanceled(void);
+  void markovChainLoadFinished(bool);
+  void readingMarkovFile(const QString &);
+  void textGenerated(const QString &, int);
+  void textGenerationFinished(int);
   void postProcessingTextFiles(void);
 
 protected:
@@ -47,11 +52,18 @@ private slots:
   void onLoadTextFiles(void);
   void onSaveMarkovChain(void);
   void onLoadMarkovChain(void);
+  void onMarkovChainLoaded(bool);
+  void onCancel(void);
   void onResetMarkovChain(void);
+  void onPruneMarkovChain(void);
+  void onSaveMetrics(void);
   void onTextFilesLoadCanceled(void);
   void onTextFilesLoaded(void);
   void onTextFilesLoading(const QString &);
   void onGenerateText(void);
+  void onTextGenerated(const QString &, int);
+  void onTextGenerationFinished(int);
+  void onModelOrderChanged(int);
   void about(void);
   void aboutQt(void);
 
@@ -67,7 +79,13 @@ private:
   void restoreSettings(void);
   void loadTextFilesThread(const QStringList &textFileNames);
   void loadTextFiles(QStringList textFilenames);
-  QString generateText_Simple(void);
+  void loadMarkovChainThread(const QStringList &markovFilenames);
+  bool readMarkovFile(MarkovChain *chain, const QString &markovFilename);
+  void connectMarkovChain(MarkovChain *chain);
+  bool isLoading(void) const;
+  void generateTextThread(int wordCount, quint32 seed, int run);
+  void stopGenerating(void);
+  void updateCancelAction(void);
 
 };
 
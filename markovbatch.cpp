@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovbatch.h"
+#include "markovgenerator.h"
+#include "markovmerger.h"
+#include "globals.h"
+
+#include <QCommandLineParser>
+#include <QCommandLineOption>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QThread>
+
+#include <cstdlib>
+#include <cstring>
+
+const int MarkovBatch::StreamWords;
+
+
+MarkovBatch::MarkovBatch(void)
+  : mErr(stderr)
+{
+  /* ... */
+}
+
+
+bool MarkovBatch::isRequested(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--batch") == 0)
+      return true;
+  }
+  return false;
+}
+
+
+int MarkovBatch::run(const QStringList &arguments)
+{
+  QCommandLineParser parser;
+  parser.setApplicationDescription(QString("%1 %2 batch mode").arg(AppName).arg(AppVersion));
+  parser.addHelpOption();
+  const QCommandLineOption batchOption("batch", "Run without a window.");
+  const QCommandLineOption corpusOption("corpus", "Read all .txt files in <directory> and its subdirectories.", "directory");
+  const QCommandLineOption modelOption("model", "Read the model in <file> (.markov, .markovz or .markovs).", "file");
+  const QCommandLineOption orderOption("order", "Collect contexts of up to <k> tokens from the corpus.", "k", "1");
+  const QCommandLineOption saveOption("save", "Save the model to <file> (.markov, .markovz or .markovs).", "file");
+  const QCommandLineOption textsOption("texts", "Generate <n> texts.", "n", "0");
+  const QCommandLineOption wordsOption("words", "Generate <m> words per text.", "m", "500");
+  const QCommandLineOption seedOption("seed", "Seed the random number generator with <seed>.", "seed");
+  const QCommandLineOption outputOption("output", "Write the texts to <directory> instead of stdout.", "directory");
+  const QCommandLineOption mergeOption("merge", "Merge model <file> into the --save file without loading it; may be repeated.", "file");
+  const QCommandLineOption minCountOption("min-count", "Prune edges counted fewer than <n> times.", "n");
+  const QCommandLineOption topKOption("top-k", "Prune all but the <k> most frequent successors of every token.", "k");
+  const QCommandLineOption quantizeOption("quantize", "Store the counts in 16 bits, after pruning if requested.");
+  const QCommandLineOption pageBudgetOption("page-budget", "Page a .markovs --model in from disk, keeping up to <MB> of successor lists in memory.", "MB");
+  const QCommandLineOption metricsOption("metrics", "Write the metrics as JSON to <file>.", "file");
+  parser.addOption(batchOption);
+  parser.addOption(corpusOption);
+  parser.addOption(modelOption);
+  parser.addOption(orderOption);
+  parser.addOption(saveOption);
+  parser.addOption(textsOption);
+  parser.addOption(wordsOption);
+  parser.addOption(seedOption);
+  parser.addOption(outputOption);
+  parser.addOption(mergeOption);
+  parser.addOption(minCountOption);
+  parser.addOption(topKOption);
+  parser.addOption(quantizeOption);
+  parser.addOption(pageBudgetOption);
+  parser.addOption(metricsOption);
+  parser.process(arguments);
+
+  if (parser.isSet(mergeOption)) {
+    if (!parser.isSet(saveOption)) {
+      mErr << "--merge needs --save." << endl;
+      return EXIT_FAILURE;
+    }
+    return mergeModels(parser.values(mergeOption), parser.value(saveOption)) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (!parser.isSet(corpusOption) && !parser.isSet(modelOption)) {
+    mErr << "Neither --corpus nor --model given." << endl;
+    return EXIT_FAILURE;
+  }
+  mChain.setModelOrder(parser.value(orderOption).toInt());
+  const qint64 pageBudget = parser.isSet(pageBudgetOption) ? parser.value(pageBudgetOption).toLongLong() * 1024 * 1024 : 0;
+  if (parser.isSet(modelOption) && !loadModel(parser.value(modelOption), pageBudget))
+    return EXIT_FAILURE;
+  if (parser.isSet(corpusOption) && !buildFromCorpus(parser.value(corpusOption)))
+    return EXIT_FAILURE;
+  if (parser.isSet(minCountOption) || parser.isSet(topKOption) || parser.isSet(quantizeOption)) {
+    MarkovChain::PruneOptions options;
+    options.minCount = parser.isSet(minCountOption) ? parser.value(minCountOption).toInt() : 1;
+    options.topK = parser.isSet(topKOption) ? parser.value(topKOption).toInt() : 0;
+    options.quantize = parser.isSet(quantizeOption);
+    prune(options);
+  }
+  if (parser.isSet(saveOption) && !saveModel(parser.value(saveOption)))
+    return EXIT_FAILURE;
+  const int textCount = parser.value(textsOption).toInt();
+  if (textCount > 0) {
+    const quint32 seed = parser.isSet(seedOption)
+        ? parser.value(seedOption).toUInt()
+        : QDateTime::currentDateTimeUtc().toTime_t();
+    if (!generate(textCount, parser.value(wordsOption).toInt(), seed, parser.value(outputOption)))
+      return EXIT_FAILURE;
+  }
+  if (parser.isSet(metricsOption) && !saveMetrics(parser.value(metricsOption)))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+
+bool MarkovBatch::buildFromCorpus(const QString &directory)
+{
+  QStringList filenames;
+  qint64 totalSize = 0;
+  QDirIterator it(directory, QStringList() << "*.txt", QDir::Files | QDir::Readable, QDirIterator::Subdirectories);
+  while (it.hasNext()) {
+    filenames.append(it.next());
+    totalSize += it.fileInfo().size();
+  }
+  if (filenames.isEmpty()) {
+    mErr << "No .txt files in " << directory << endl;
+    return false;
+  }
+  if (mChain.isQuantized()) {
+    mErr << "Cannot add text to a model stored in 16 bits" << endl;
+    return false;
+  }
+  QElapsedTimer stopwatch;
+  stopwatch.start();
+  mChain.readFromTextFiles(filenames);
+  const qint64 readTime = stopwatch.elapsed();
+  report("ingest", readTime, QString("%1 files").arg(filenames.size()), qreal(totalSize) / (1024 * 1024), "MB");
+  stopwatch.restart();
+  mChain.postProcess();
+  report("postprocess", stopwatch.elapsed(), QString(), mChain.count(), "nodes");
+  return true;
+}
+
+
+bool MarkovBatch::loadModel(const QString &filename, qint64 pageBudget)
+{
+  QElapsedTimer stopwatch;
+  stopwatch.start();
+  const bool paged = pageBudget > 0 && MarkovSnapshot::isSnapshot(filename);
+  if (paged ? !mChain.readFromSnapshot(filename, pageBudget) : !mChain.readFromMarkovFile(filename)) {
+    mErr << "Cannot read model " << filename << endl;
+    return false;
+  }
+  report("load", stopwatch.elapsed(), QFileInfo(filename).fileName(), mChain.count(), "nodes");
+  return true;
+}
+
+
+bool MarkovBatch::mergeModels(const QStringList &filenames, const QString &output)
+{
+  QElapsedTimer stopwatch;
+  stopwatch.start();
+  MarkovMerger merger;
+  if (!merger.merge(filenames, output)) {
+    mErr << "Cannot merge: " << merger.errorString() << endl;
+    return false;
+  }
+  report("merge", stopwatch.elapsed(), QString("%1 files, %2 edges").arg(filenames.size()).arg(merger.edgeCount()), merger.lineCount(), "nodes");
+  return true;
+}
+
+
+// Writes e.g. "prune: 1204 nodes, 90211 edges removed, 3.1% of the mass
+// lost, 0.02% moved by quantization, 41.0 MB saved" after the timing.
+void MarkovBatch::prune(const MarkovChain::PruneOptions &options)
+{
+  QElapsedTimer stopwatch;
+  stopwatch.start();
+  const MarkovChain::PruneReport &result = mChain.prune(options);
+  report("prune", stopwatch.elapsed(), QString(), mChain.count(), "nodes");
+  mErr << "prune: " << result.nodesRemoved << " nodes, " << result.edgesRemoved << " edges removed, "
+       << QString::number(100 * result.prunedMass, 'f', 1) << "% of the mass lost, "
+       << QString::number(100 * result.quantizationError, 'f', 2) << "% moved by quantization, "
+       << QString::number(qreal(result.memoryBefore - result.memoryAfter) / (1024 * 1024), 'f', 1) << " MB saved" << endl;
+}
+
+
+bool MarkovBatch::saveModel(const QString &filename)
+{
+  QElapsedTimer stopwatch;
+  stopwatch.start();
+  if (!mChain.save(filename)) {
+    mErr << "Cannot save model to " << filename << endl;
+    return false;
+  }
+  const QFileInfo fi(filename);
+  report("save", stopwatch.elapsed(), fi.fileName(), qreal(fi.size()) / (1024 * 1024), "MB");
+  return true;
+}
+
+
+// Texts are generated in batches on all cores and written in order
+// before the next batch is started, so memory stays bounded. Texts of
+// more than StreamWords words are written one by one while they are
+// walked, so that memory does not grow with their length either.
+bool MarkovBatch::generate(int textCount, int wordCount, quint32 seed, const QString &outputDirectory)
+{
+  if (!outputDirectory.isEmpty() && !QDir().mkpath(outputDirectory)) {
+    mErr << "Cannot create " << outputDirectory << endl;
+    return false;
+  }
+  QTextStream out(stdout);
+  out.setCodec("UTF-8");
+  const MarkovGenerator generator(&mChain);
+  const int digits = QString::number(textCount - 1).size();
+  const bool streaming = wordCount > StreamWords;
+  const int batchSize = streaming ? 1 : 64 * QThread::idealThreadCount();
+  QElapsedTimer stopwatch;
+  stopwatch.start();
+  for (int batchBegin = 0; batchBegin < textCount; batchBegin += batchSize) {
+    const int count = qMin(batchSize, textCount - batchBegin);
+    QStringList texts;
+    if (!streaming) {
+      texts = generator.generate(batchBegin, count, wordCount, seed);
+    }
+    for (int i = 0; i < count; ++i) {
+      const int text = batchBegin + i;
+      QFile outFile;
+      QTextStream fileOut(&outFile);
+      if (outputDirectory.isEmpty()) {
+        if (text > 0) {
+          out << '\n';
+        }
+      }
+      else {
+        outFile.setFileName(QDir(outputDirectory).filePath(QString("text-%1.txt").arg(text, digits, 10, QChar('0'))));
+        if (!outFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+          mErr << "Cannot write " << outFile.fileName() << endl;
+          return false;
+        }
+        fileOut.setCodec("UTF-8");
+      }
+      QTextStream &textOut = outputDirectory.isEmpty() ? out : fileOut;
+      if (streaming) {
+        std::mt19937 rng = MarkovGenerator::rngFor(seed, text);
+        generator.generate(qint64(wordCount), rng, textOut);
+      }
+      else {
+        textOut << texts.at(i);
+      }
+      textOut << '\n';
+    }
+  }
+  out.flush();
+  report("generate", stopwatch.elapsed(), QString("%1 texts").arg(textCount), qreal(textCount) * wordCount, "words");
+  return true;
+}
+
+
+bool MarkovBatch::saveMetrics(const QString &filename)
+{
+  QFile metricsFile(filename);
+  if (!metricsFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    mErr << "Cannot write " << filename << endl;
+    return false;
+  }
+  metricsFile.write(QJsonDocument(mChain.metrics().toJson()).toJson());
+  return true;
+}
+
+
+// Writes e.g. "ingest: 12 files, 310.2 MB in 4.210 s (73.7 MB/s)".
+void MarkovBatch::report(const QString &phase, qint64 elapsed, const QString &amount, qreal units, const QString &unit)
+{
+  const qreal seconds = qreal(elapsed) / 1000;
+  mErr << phase << ": ";
+  if (!amount.isEmpty()) {
+    mErr << amount << ", ";
+  }
+  mErr << QString::number(units, 'f', unit == "MB" ? 1 : 0) << " " << unit
+       << " in " << QString::number(seconds, 'f', 3) << " s";
+  if (seconds > 0) {
+    mErr << " (" << QString::number(units / seconds, 'f', 1) << " " << unit << "/s)";
+  }
+  mErr << endl;
+}
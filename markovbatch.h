@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVBATCH_H_
+#define __MARKOVBATCH_H_
+
+#include <QElapsedTimer>
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+
+#include "markovchain.h"
+
+
+// Runs the program without widgets, e.g.
+//   Belletristiq --batch --corpus texts/ --order 2 --save model.markovs
+//   Belletristiq --batch --model model.markovz --save model.markovs
+//   Belletristiq --batch --model model.markovs --texts 100 --words 500 --output out/
+//   Belletristiq --batch --model model.markovs --min-count 2 --quantize --save small.markovs
+//   Belletristiq --batch --merge en.markovz --merge de.markovz --save all.markovz
+//   Belletristiq --batch --model huge.markovs --page-budget 512 --texts 100
+// A model read with --model is extended with the --corpus files, pruned
+// if --min-count, --top-k or --quantize is given, saved
+// with --save in the format its suffix stands for, and finally used to
+// generate texts, to stdout or to one file per text in the --output
+// directory. A .markovs model given with --page-budget is not mapped but
+// paged in from disk as texts are generated. Wall time and throughput of
+// every phase go to stderr, and with --metrics the chain's metrics() are
+// written to a JSON file.
+// Models given with --merge are merged into the --save file by
+// MarkovMerger, streaming, and nothing else is done.
+class MarkovBatch {
+public:
+  MarkovBatch(void);
+
+  static bool isRequested(int argc, char *argv[]);
+  int run(const QStringList &arguments);
+
+private:
+  // longer texts are written while they are walked, see generate()
+  static const int StreamWords = 65536;
+
+  bool buildFromCorpus(const QString &directory);
+  bool loadModel(const QString &filename, qint64 pageBudget);
+  bool mergeModels(const QStringList &filenames, const QString &output);
+  void prune(const MarkovChain::PruneOptions &options);
+  bool saveModel(const QString &filename);
+  bool generate(int textCount, int wordCount, quint32 seed, const QString &outputDirectory);
+  bool saveMetrics(const QString &filename);
+  void report(const QString &phase, qint64 elapsed, const QString &amount, qreal units, const QString &unit);
+
+  MarkovChain mChain;
+  QTextStream mErr;
+};
+
+
+#endif // __MARKOVBATCH_H_
@@ -7,217 +7,1447 @@
 #include "markovchain.h"
 #include "markovedge.h"
 
-#include <QRegExp>
 #include <QFile>
 #include <QFileInfo>
+#include <QSaveFile>
+#include <QBitArray>
 #include <QCoreApplication>
+#include <QAtomicInteger>
+#include <QMutexLocker>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QHash>
+#include <QThread>
+#include <QtConcurrent>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
 
 const QByteArray MarkovChain::FileHeader("MRKV", 4);
+const QByteArray MarkovChain::ChunkedFileHeader("MRKC", 4);
+const QStringList MarkovChain::SentenceTerminators = { ".", "!", "?" };
+const qint64 MarkovChain::ChunkSize = 1024 * 1024;
+const QString MarkovChain::SnapshotSuffix = ".markovs";
+
+// components of a snapshot, see MarkovSnapshot::tag()
+enum SnapshotComponent {
+  VocabularyComponent = 1,
+  FrozenChainComponent,
+  ContextModelComponent
+};
+
+
+// nanoseconds since `timer` was started, restarting it
+static qint64 lap(QElapsedTimer &timer)
+{
+  const qint64 ns = timer.nsecsElapsed();
+  timer.start();
+  return ns;
+}
 
 
 MarkovChain::MarkovChain(void)
-  : mCancelled(false)
+  : mOnlineEnabled(false)
+  , mCancelled(0)
+  , mFullFreeze(false)
+  , mWordsGenerated(0)
+  , mGenerateTime(0)
 {
-  /* ... */
+  mOnline.setBase(&mFrozen);
 }
 
 
+MarkovChain::~MarkovChain()
+{
+  clear();
+}
+
+
+// Freezes the nodes added to since the last postProcess(). Only they are
+// repacked if they are few compared to the model; the frozen chain is
+// rebuilt if they are many, if it is mapped from a snapshot or quantized,
+// or if the edges left behind by repacked nodes make up more than half of
+// it. A paged chain that is not quantized is always repacked in place, so
+// that its other nodes stay on disk. A cancelled read is frozen, too, and
+// a cancel that comes in meanwhile is dropped.
 void MarkovChain::postProcess(void)
 {
-  if (!mCancelled) {
-    foreach (MarkovNode *node, mNodeMap) {
-      node->calcProbabilities();
+  // online walks read the frozen chain of the nodes not added to
+  QWriteLocker onlineLocker(mOnlineEnabled ? mOnline.lock() : Q_NULLPTR);
+  QElapsedTimer timer;
+  timer.start();
+  const int changed = mDirty.size() + mNodes.size() - mFrozen.nodeCount();
+  // a paged chain is added to in place, so that it stays paged
+  const bool inPlace = mFrozen.isPaged() && !mFrozen.isQuantized();
+  if (mFullFreeze || (!inPlace && (mFrozen.isMapped() || mFrozen.isQuantized() || 2 * changed > mNodes.size() || 2 * mFrozen.garbageCount() > mFrozen.edgeCount()))) {
+    freeze();
+  }
+  else {
+    freezeDirty();
+  }
+  mMetrics.phaseTime[MarkovMetrics::FinalizePhase] += timer.nsecsElapsed();
+  mCancelled.store(0);
+}
+
+
+void MarkovChain::freeze(void)
+{
+  QVector<MarkovVocabulary::TokenId> order(mNodes.size());
+  for (int i = 0; i < order.size(); ++i) {
+    order[i] = MarkovVocabulary::TokenId(i);
+  }
+  const MarkovVocabulary &vocabulary = mVocabulary;
+  std::sort(order.begin(), order.end(), [&vocabulary](MarkovVocabulary::TokenId a, MarkovVocabulary::TokenId b) {
+    return vocabulary.lessThan(a, b);
+  });
+  QVector<quint32> rank(order.size());
+  for (int i = 0; i < order.size(); ++i) {
+    rank[int(order.at(i))] = quint32(i);
+  }
+  MarkovFrozenChain frozen;
+  foreach (MarkovNode *node, mNodes) {
+    if (node->isFrozen()) {
+      frozen.appendNode(mFrozen, node->id());
+    }
+    else {
+      node->freeze(frozen, rank, mEdgePool);
+    }
+  }
+  frozen.setOrder(order);
+  frozen.buildSentenceStarts(sentenceTerminatorIds(), mVocabulary);
+  mFrozen.swap(frozen);
+  mContexts.freeze(rank);
+  mDirty.clear();
+  mFullFreeze = false;
+  mPagedSnapshot.clear();
+}
+
+
+// Drops the edges counted fewer than options.minCount times and those
+// beyond a node's options.topK most frequent ones, then the nodes that can
+// no longer be reached from a sentence terminator or no longer lead to
+// one, and rebuilds the chain
+// with the remaining tokens renumbered. The contexts of higher orders lose
+// the same tokens and are pruned alike. Optionally the counts are quantized to
+// 16 bits afterwards, see MarkovFrozenChain::quantize().
+MarkovChain::PruneReport MarkovChain::prune(const PruneOptions &options)
+{
+  typedef MarkovVocabulary::TokenId TokenId;
+  QElapsedTimer timer;
+  timer.start();
+  freeze();
+  PruneReport report;
+  report.memoryBefore = metrics().memoryUsage();
+  const int nodeCount = mFrozen.nodeCount();
+  const int edgeCount = mFrozen.edgeCount();
+  const quint32 minCount = quint32(qMax(1, options.minCount));
+  const MarkovFrozenChain &frozen = mFrozen;
+  QBitArray keep(edgeCount);
+  QVector<int> edges;
+  quint64 totalCount = 0;
+  for (int i = 0; i < nodeCount; ++i) {
+    edges.resize(0);
+    for (int edge = frozen.begin(TokenId(i)); edge < frozen.end(TokenId(i)); ++edge) {
+      totalCount += frozen.count(edge);
+      if (frozen.count(edge) >= minCount) {
+        edges.append(edge);
+      }
+    }
+    if (options.topK > 0 && edges.size() > options.topK) {
+      std::nth_element(edges.begin(), edges.begin() + options.topK, edges.end(), [&frozen](int a, int b) {
+        return frozen.count(a) > frozen.count(b) || (frozen.count(a) == frozen.count(b) && a < b);
+      });
+      edges.resize(options.topK);
+    }
+    foreach (int edge, edges) {
+      keep.setBit(edge);
+    }
+  }
+
+  // generation starts after a terminator, or anywhere if there are none
+  QBitArray reachable(nodeCount);
+  QVector<TokenId> terminators;
+  foreach (TokenId id, sentenceTerminatorIds()) {
+    if (id != MarkovVocabulary::InvalidId) {
+      terminators.append(id);
+    }
+  }
+  if (terminators.isEmpty()) {
+    reachable.fill(true);
+  }
+  QVector<TokenId> pending = terminators;
+  while (!pending.isEmpty()) {
+    const TokenId id = pending.takeLast();
+    if (reachable.testBit(int(id)))
+      continue;
+    reachable.setBit(int(id));
+    for (int edge = frozen.begin(id); edge < frozen.end(id); ++edge) {
+      if (keep.testBit(edge) && !reachable.testBit(int(frozen.target(edge)))) {
+        pending.append(frozen.target(edge));
+      }
+    }
+  }
+  // and a sentence should be able to end from every node, so the kept
+  // edges are followed backwards from the terminators, too
+  if (!terminators.isEmpty()) {
+    QVector<int> firstSource(nodeCount + 1, 0);
+    for (int edge = 0; edge < edgeCount; ++edge) {
+      if (keep.testBit(edge)) {
+        ++firstSource[int(frozen.target(edge)) + 1];
+      }
+    }
+    for (int i = 0; i < nodeCount; ++i) {
+      firstSource[i + 1] += firstSource.at(i);
+    }
+    QVector<TokenId> sources(firstSource.last());
+    QVector<int> next = firstSource;
+    for (int i = 0; i < nodeCount; ++i) {
+      for (int edge = frozen.begin(TokenId(i)); edge < frozen.end(TokenId(i)); ++edge) {
+        if (keep.testBit(edge)) {
+          sources[next[int(frozen.target(edge))]++] = TokenId(i);
+        }
+      }
+    }
+    QBitArray leading(nodeCount);
+    pending = terminators;
+    while (!pending.isEmpty()) {
+      const TokenId id = pending.takeLast();
+      if (leading.testBit(int(id)))
+        continue;
+      leading.setBit(int(id));
+      for (int s = firstSource.at(int(id)); s < firstSource.at(int(id) + 1); ++s) {
+        if (!leading.testBit(int(sources.at(s)))) {
+          pending.append(sources.at(s));
+        }
+      }
+    }
+    // a path from a terminator to a node that leads to one only passes such nodes
+    reachable &= leading;
+  }
+
+  MarkovVocabulary vocabulary;
+  QVector<TokenId> tokenMap(nodeCount, MarkovVocabulary::InvalidId);
+  for (int i = 0; i < nodeCount; ++i) {
+    if (reachable.testBit(i)) {
+      tokenMap[i] = vocabulary.intern(mVocabulary.data(TokenId(i)), mVocabulary.size(TokenId(i)));
+    }
+  }
+  MarkovFrozenChain pruned;
+  quint64 keptCount = 0;
+  int keptEdges = 0;
+  for (int i = 0; i < nodeCount; ++i) {
+    if (!reachable.testBit(i))
+      continue;
+    for (int edge = frozen.begin(TokenId(i)); edge < frozen.end(TokenId(i)); ++edge) {
+      if (keep.testBit(edge) && tokenMap.at(int(frozen.target(edge))) != MarkovVocabulary::InvalidId) {
+        pruned.addEdge(tokenMap.at(int(frozen.target(edge))), frozen.count(edge));
+        keptCount += frozen.count(edge);
+        ++keptEdges;
+      }
+    }
+    pruned.closeNode();
+  }
+  QVector<TokenId> order;
+  order.reserve(vocabulary.count());
+  QVector<quint32> rank(vocabulary.count());
+  for (int i = 0; i < frozen.orderCount(); ++i) {
+    const TokenId id = tokenMap.at(int(frozen.order()[i]));
+    if (id != MarkovVocabulary::InvalidId) {
+      rank[int(id)] = quint32(order.size());
+      order.append(id);
+    }
+  }
+  pruned.setOrder(order);
+  mContexts.prune(tokenMap, minCount, options.topK);
+  mContexts.freeze(rank);
+  if (options.quantize) {
+    report.quantizationError = keptCount > 0 ? pruned.quantize() / qreal(keptCount) : 0;
+    mContexts.quantize();
+  }
+
+  replaceFrozen(vocabulary, pruned);
+
+  report.nodesRemoved = nodeCount - mVocabulary.count();
+  report.edgesRemoved = edgeCount - keptEdges;
+  report.prunedMass = totalCount > 0 ? 1 - qreal(keptCount) / qreal(totalCount) : 0;
+  report.memoryAfter = metrics().memoryUsage();
+  mMetrics.phaseTime[MarkovMetrics::FinalizePhase] += timer.nsecsElapsed();
+  return report;
+}
+
+
+// A quantized chain has lost its raw counts, so no text is added to it.
+bool MarkovChain::isQuantized(void) const
+{
+  return mFrozen.isQuantized();
+}
+
+
+// Swaps in `vocabulary` and `frozen`, whose sentence starts are built
+// here, and creates nodes for all tokens. The current nodes must all be
+// frozen, so that they hold no memory of their own.
+void MarkovChain::replaceFrozen(MarkovVocabulary &vocabulary, MarkovFrozenChain &frozen)
+{
+  mNodes.clear();
+  mNodePool.clear();
+  mEdgePool.clear();
+  mVocabulary.swap(vocabulary);
+  mNodes.reserve(mVocabulary.count());
+  for (int i = 0; i < mVocabulary.count(); ++i) {
+    mNodes.append(mNodePool.create(this, MarkovVocabulary::TokenId(i), true));
+  }
+  frozen.buildSentenceStarts(sentenceTerminatorIds(), mVocabulary);
+  mFrozen.swap(frozen);
+  mDirty.clear();
+  mFullFreeze = false;
+  mPagedSnapshot.clear();
+}
+
+
+// Appends new edge blocks for the thawed nodes and the new ones, leaving
+// the token order of the frozen chain to the nodes present at the last
+// freeze(). The sentence starts are only rebuilt if a terminator changed.
+void MarkovChain::freezeDirty(void)
+{
+  const QVector<MarkovVocabulary::TokenId> &terminators = sentenceTerminatorIds();
+  bool startsChanged = false;
+  foreach (MarkovVocabulary::TokenId id, terminators) {
+    if (id != MarkovVocabulary::InvalidId && !mNodes.at(int(id))->isFrozen()) {
+      startsChanged = true;
     }
   }
+  foreach (MarkovNode *node, mDirty) {
+    mFrozen.reopenNode(node->id());
+    node->freeze(mFrozen, mVocabulary, mEdgePool);
+  }
+  for (int i = mFrozen.nodeCount(), n = mNodes.size(); i < n; ++i) {
+    mNodes.at(i)->freeze(mFrozen, mVocabulary, mEdgePool);
+  }
+  if (startsChanged) {
+    mFrozen.buildSentenceStarts(terminators, mVocabulary);
+  }
+  mContexts.freezeDirty(mVocabulary);
+  mDirty.clear();
 }
 
 
+QVector<MarkovVocabulary::TokenId> MarkovChain::sentenceTerminatorIds(void) const
+{
+  QVector<MarkovVocabulary::TokenId> terminators;
+  foreach (QString token, SentenceTerminators) {
+    terminators.append(mVocabulary.find(token));
+  }
+  return terminators;
+}
+
+
+void MarkovChain::thaw(MarkovNode *node)
+{
+  node->thaw(mFrozen, mEdgePool);
+  mDirty.append(node);
+}
+
+
+// Frees the nodes and edges in O(number of pool blocks): only the nodes
+// that are not frozen hold memory of their own, their successor lists.
 void MarkovChain::clear(void)
 {
-  mNodeMap.clear();
+  if (mFullFreeze) {
+    foreach (MarkovNode *node, mNodes) {
+      if (!node->isFrozen()) {
+        mNodePool.destroy(node);
+      }
+    }
+  }
+  else {
+    foreach (MarkovNode *node, mDirty) {
+      mNodePool.destroy(node);
+    }
+    for (int i = mFrozen.nodeCount(); i < mNodes.size(); ++i) {
+      mNodePool.destroy(mNodes.at(i));
+    }
+  }
+  mNodes.clear();
+  mNodePool.clear();
+  mEdgePool.clear();
+  mFrozen.clear();
+  mContexts.clear();
+  mOnline.clear();
+  mVocabulary.clear();
+  mDirty.clear();
+  mFullFreeze = false;
+  mPagedSnapshot.clear();
 }
 
 
 bool MarkovChain::isCancelled(void) const
 {
-  return mCancelled;
+  return mCancelled.load() != 0;
 }
 
 
 void MarkovChain::cancel(void)
 {
-  mCancelled = true;
+  mCancelled.store(1);
+}
+
+
+// Returns the counters since the last resetMetrics() together with the
+// size of the model, which takes a pass over the nodes added to since
+// the last postProcess().
+MarkovMetrics MarkovChain::metrics(void) const
+{
+  MarkovMetrics metrics = mMetrics;
+  metrics.wordsGenerated = mWordsGenerated.load();
+  metrics.phaseTime[MarkovMetrics::GeneratePhase] = mGenerateTime.load();
+  // edges of thawed nodes are held by the nodes, not by their block in the frozen chain
+  qint64 heapEdges = 0;
+  qint64 staleEdges = 0;
+  const int frozenCount = mFrozen.nodeCount();
+  const auto countEdges = [this, &heapEdges, &staleEdges, frozenCount](const MarkovNode *node) {
+    if (node->isFrozen())
+      return;
+    heapEdges += node->successors().size();
+    if (int(node->id()) < frozenCount) {
+      staleEdges += mFrozen.end(node->id()) - mFrozen.begin(node->id());
+    }
+  };
+  if (mFullFreeze) {
+    foreach (const MarkovNode *node, mNodes) {
+      countEdges(node);
+    }
+  }
+  else {
+    foreach (const MarkovNode *node, mDirty) {
+      countEdges(node);
+    }
+    for (int i = frozenCount; i < mNodes.size(); ++i) {
+      countEdges(mNodes.at(i));
+    }
+  }
+  metrics.nodes = mNodes.size();
+  metrics.edges = mFrozen.edgeCount() - mFrozen.garbageCount() - staleEdges + heapEdges;
+  metrics.nodeMemory = qint64(sizeof(MarkovNode*)) * mNodes.capacity() + mNodePool.memoryUsage();
+  metrics.edgeMemory = mFrozen.memoryUsage() + mEdgePool.memoryUsage() + qint64(sizeof(MarkovEdge*)) * heapEdges;
+  metrics.stringMemory = mVocabulary.memoryUsage();
+  metrics.contextMemory = mContexts.memoryUsage();
+  if (mOnlineEnabled) {
+    metrics.edgeMemory += mOnline.memoryUsage();
+  }
+  if (!mPagedSnapshot.isNull()) {
+    metrics.edgeMemory += mPagedSnapshot->pageMemory();
+    metrics.pageHits = mPagedSnapshot->pageHits();
+    metrics.pageMisses = mPagedSnapshot->pageMisses();
+  }
+  return metrics;
+}
+
+
+void MarkovChain::resetMetrics(void)
+{
+  mMetrics = MarkovMetrics();
+  mWordsGenerated.store(0);
+  mGenerateTime.store(0);
+}
+
+
+// Counts the words of generated text and the time it took, see MarkovGenerator.
+void MarkovChain::addGenerated(qint64 words, qint64 ns) const
+{
+  mWordsGenerated.fetchAndAddRelaxed(words);
+  mGenerateTime.fetchAndAddRelaxed(ns);
 }
 
 
 int MarkovChain::count(void) const
 {
-  return mNodeMap.count();
+  return mNodes.count();
 }
 
 
 MarkovNode *MarkovChain::at(int idx)
 {
-  MarkovNodeMap::iterator node = mNodeMap.begin() + idx;
-  return *node;
+  return mNodes.at(idx);
+}
+
+
+MarkovNode *MarkovChain::node(MarkovVocabulary::TokenId id) const
+{
+  return mNodes.at(int(id));
+}
+
+
+MarkovNode *MarkovChain::selectSuccessor(const MarkovNode *node, qreal p) const
+{
+  const MarkovVocabulary::TokenId id = mFrozen.selectSuccessor(node->id(), p);
+  return id != MarkovVocabulary::InvalidId ? mNodes.at(int(id)) : Q_NULLPTR;
+}
+
+
+MarkovNode *MarkovChain::selectSuccessor(const QVector<MarkovVocabulary::TokenId> &history, qreal p) const
+{
+  if (history.isEmpty())
+    return Q_NULLPTR;
+  MarkovVocabulary::TokenId id = mContexts.selectSuccessor(history.constData(), history.size(), p);
+  if (id == MarkovVocabulary::InvalidId) {
+    id = mFrozen.selectSuccessor(history.last(), p);
+  }
+  return id != MarkovVocabulary::InvalidId ? mNodes.at(int(id)) : Q_NULLPTR;
+}
+
+
+MarkovNode *MarkovChain::selectSentenceStart(qreal p) const
+{
+  const MarkovVocabulary::TokenId id = mFrozen.selectSentenceStart(p);
+  return id != MarkovVocabulary::InvalidId ? mNodes.at(int(id)) : Q_NULLPTR;
 }
 
 
-void MarkovChain::parseText(const QString &line, QStringList &tokens, int &totalSize)
+void MarkovChain::setSamplingMode(MarkovFrozenChain::SamplingMode mode)
 {
-  static const QRegExp reTokens("(\\b[^\\sˇ]+\\b)([\\.,;!:\\?\\(\\)»«\"'_])?", Qt::CaseSensitive, QRegExp::RegExp);
-  int pos = 0;
-  while ((pos = reTokens.indexIn(line, pos)) != -1) {
-    const QString &t1 = reTokens.cap(1);
-    if (reTokens.captureCount() > 0 && !t1.isEmpty()) {
-      tokens << t1;
+  mFrozen.setSamplingMode(mode);
+  mContexts.setSamplingMode(mode);
+}
+
+
+MarkovFrozenChain::SamplingMode MarkovChain::samplingMode(void) const
+{
+  return mFrozen.samplingMode();
+}
+
+
+// Successors are selected from contexts of up to `order` tokens, which are
+// collected from text added from now on. Contexts of a higher order that
+// were collected before are kept.
+void MarkovChain::setModelOrder(int order)
+{
+  mContexts.setOrder(order);
+}
+
+
+int MarkovChain::modelOrder(void) const
+{
+  return mContexts.order();
+}
+
+
+const MarkovContextModel &MarkovChain::contexts(void) const
+{
+  return mContexts;
+}
+
+
+// In online mode add() also counts the transitions into online(), which
+// can be drawn from while text is being added, e.g. by a MarkovWalker. A
+// node is copied into it when it is first added to; the others are drawn
+// from the frozen chain. Turning it off frees it. The online model only
+// learns from add(), addText() and readFromTextFile(s)(), and only of
+// order 1. It must not be switched while text is being added or walked.
+void MarkovChain::setOnline(bool online)
+{
+  QMutexLocker foldLocker(&mFoldMutex);
+  mOnline.clear();
+  mOnlineEnabled = online;
+  if (!online)
+    return;
+  // nodes added to since the last postProcess() differ from the frozen chain
+  if (mFullFreeze) {
+    foreach (MarkovNode *node, mNodes) {
+      copyToOnline(node);
     }
-    const QString &t2 = reTokens.cap(2);
-    if (reTokens.captureCount() > 1 && !t2.isEmpty()) {
-      tokens << t2;
+  }
+  else {
+    foreach (MarkovNode *node, mDirty) {
+      copyToOnline(node);
     }
-    totalSize += t1.length() + t2.length();
-    pos += reTokens.matchedLength();
+    for (int i = mFrozen.nodeCount(); i < mNodes.size(); ++i) {
+      copyToOnline(mNodes.at(i));
+    }
+  }
+}
+
+
+// Counts the successors of the node into the online model, unless they
+// are there already.
+void MarkovChain::copyToOnline(MarkovNode *node)
+{
+  if (mOnline.contains(node->id()))
+    return;
+  QHash<quint64, int> transitions;
+  const quint64 source = quint64(node->id()) << 32;
+  if (node->isFrozen()) {
+    const MarkovFrozenChain::Edges &edges = mFrozen.edges(node->id());
+    for (int i = 0; i < edges.degree; ++i) {
+      transitions.insert(source | edges.target(i), int(edges.count(i)));
+    }
+  }
+  else {
+    foreach (const MarkovEdge *edge, node->successors()) {
+      transitions.insert(source | edge->target(), edge->count());
+    }
+  }
+  if (!transitions.isEmpty()) {
+    mOnline.add(transitions, sentenceTerminatorIds());
   }
 }
 
 
+bool MarkovChain::isOnline(void) const
+{
+  return mOnlineEnabled;
+}
+
+
+const MarkovOnlineModel &MarkovChain::online(void) const
+{
+  return mOnline;
+}
+
+
+// May be called while add() runs, unlike node().
+QString MarkovChain::token(MarkovVocabulary::TokenId id) const
+{
+  QReadLocker locker(&mNodesLock);
+  return mVocabulary.token(id);
+}
+
+
+MarkovNode *MarkovChain::nodeFor(const QString &token)
+{
+  const QByteArray &utf8 = token.toUtf8();
+  return nodeFor(utf8.constData(), utf8.size());
+}
+
+
+MarkovNode *MarkovChain::nodeFor(const char *data, int size)
+{
+  const MarkovVocabulary::TokenId id = mVocabulary.intern(data, size);
+  if (int(id) == mNodes.size()) {
+    mNodes.append(mNodePool.create(this, id));
+  }
+  return mNodes.at(int(id));
+}
+
+
+// May be called on several threads at once, as may add().
 void MarkovChain::addText(const QString &text)
 {
-  QStringList tokens;
-  int totalSize = 0;
-  parseText(text, tokens, totalSize);
-  add(tokens);
+  QElapsedTimer wallTimer;
+  wallTimer.start();
+  QElapsedTimer timer;
+  timer.start();
+  MarkovMetrics metrics;
+  const QByteArray &utf8 = text.toUtf8();
+  MarkovTokenizer tokenizer;
+  MarkovTokenizer::TokenList tokens;
+  tokenizer.tokenize(utf8, tokens);
+  metrics.phaseTime[MarkovMetrics::TokenizePhase] += lap(timer);
+  metrics.bytesRead += utf8.size();
+  IngestCursor cursor;
+  add(tokens, cursor, metrics);
+  addImportTime(wallTimer.nsecsElapsed());
+}
+
+
+// Calls of addText() on several threads at once add up their times.
+void MarkovChain::addImportTime(qint64 ns)
+{
+  QMutexLocker foldLocker(&mFoldMutex);
+  mMetrics.importTime += ns;
+}
+
+
+MarkovChain::MarkovFileShard::MarkovFileShard(void)
+{
+  firstEdges.append(0);
+}
+
+
+void MarkovChain::MarkovFileShard::parse(const char *begin, const char *end, const QAtomicInt &cancelled)
+{
+  const char *p = begin;
+  while (p < end && !cancelled.load()) {
+    const char *lineEnd = static_cast<const char*>(memchr(p, '\n', size_t(end - p)));
+    if (lineEnd == Q_NULLPTR) {
+      lineEnd = end;
+    }
+    // fields are separated by one or more blanks: token (count successor)*
+    const char *field[2];
+    int fieldSize[2];
+    int fieldCount = 0;
+    while (p < lineEnd) {
+      while (p < lineEnd && *p == ' ') {
+        ++p;
+      }
+      const char *fieldBegin = p;
+      while (p < lineEnd && *p != ' ') {
+        ++p;
+      }
+      if (p == fieldBegin)
+        break;
+      if (fieldCount == 0) {
+        sources.append(vocabulary.intern(fieldBegin, int(p - fieldBegin)));
+        fieldCount = 1;
+        continue;
+      }
+      field[fieldCount - 1] = fieldBegin;
+      fieldSize[fieldCount - 1] = int(p - fieldBegin);
+      if (++fieldCount == 3) {
+        bool ok = false;
+        const int count = QByteArray::fromRawData(field[0], fieldSize[0]).toInt(&ok);
+        if (ok) {
+          targets.append(vocabulary.intern(field[1], fieldSize[1]));
+          counts.append(count);
+        }
+        fieldCount = 1;
+      }
+    }
+    if (fieldCount > 0) {
+      firstEdges.append(targets.size());
+    }
+    p = lineEnd + 1;
+  }
 }
 
 
 bool MarkovChain::readFromTextFile(const QString &filename)
 {
-  mCancelled = false;
+  if (isQuantized())
+    return false;
+  QElapsedTimer timer;
+  timer.start();
+  mCancelled.store(0);
   mSignalTimer.start();
+  const bool ok = streamTextFile(filename, true);
+  addImportTime(timer.nsecsElapsed());
+  // the cancel is handled, so that add() works again
+  return !mCancelled.fetchAndStoreOrdered(0) && ok;
+}
+
+
+// Reads the files on the global thread pool, every worker adding the
+// tokens of its file to this chain directly. The counts are the same as
+// if the files had been read one after another.
+bool MarkovChain::readFromTextFiles(const QStringList &filenames)
+{
+  if (isQuantized())
+    return false;
+  QElapsedTimer timer;
+  timer.start();
+  mCancelled.store(0);
+  qint64 totalSize = 0;
+  foreach (QString filename, filenames) {
+    totalSize += QFileInfo(filename).size();
+  }
+  emit progressRangeChanged(0, int(totalSize / 1024));
+  QAtomicInteger<qint64> bytesRead(0);
+  QStringList files = filenames;
+  QtConcurrent::blockingMap(files, [this, &bytesRead](const QString &filename) {
+    if (mCancelled.load())
+      return;
+    emit readingTextFile(filename);
+    streamTextFile(filename, false);
+    const qint64 fileSize = QFileInfo(filename).size();
+    emit progressValueChanged(int((bytesRead.fetchAndAddOrdered(fileSize) + fileSize) / 1024));
+  });
+  addImportTime(timer.nsecsElapsed());
+  return !mCancelled.fetchAndStoreOrdered(0);
+}
+
+
+// Reads the file in chunks of ChunkSize bytes and adds the tokens of
+// each chunk right away, so memory does not grow with the file size.
+// Only complete lines are tokenized; the rest of a chunk, which may end
+// in the middle of a token or a UTF-8 sequence, is kept for the next one.
+// Progress is only reported if `reportProgress` is set, because
+// mSignalTimer must not be shared by several threads.
+bool MarkovChain::streamTextFile(const QString &filename, bool reportProgress)
+{
   QFileInfo fi(filename);
-  if (fi.isReadable() && fi.isFile()) {
-    QFile inFile(filename);
-    if (inFile.open(QIODevice::ReadOnly)) {
-      int totalSize = 0;
-      QStringList tokens;
-      while (!inFile.atEnd()) {
-        parseText(QString::fromUtf8(inFile.readLine()), tokens, totalSize);
+  if (!fi.isReadable() || !fi.isFile())
+    return false;
+  QFile inFile(filename);
+  if (!inFile.open(QIODevice::ReadOnly))
+    return false;
+  if (reportProgress) {
+    emit progressRangeChanged(0, int(fi.size() / 1024));
+  }
+  IngestCursor cursor;
+  QByteArray buffer;
+  MarkovTokenizer tokenizer;
+  MarkovTokenizer::TokenList tokens;
+  QElapsedTimer timer;
+  while (!inFile.atEnd() && !mCancelled.load()) {
+    MarkovMetrics metrics;
+    timer.start();
+    const int oldSize = buffer.size();
+    buffer.append(inFile.read(ChunkSize));
+    metrics.bytesRead += buffer.size() - oldSize;
+    metrics.phaseTime[MarkovMetrics::ReadPhase] += lap(timer);
+    const int linesEnd = inFile.atEnd() ? buffer.size() : buffer.lastIndexOf('\n') + 1;
+    tokens.resize(0);
+    tokenizer.tokenize(buffer.constData(), linesEnd, tokens);
+    metrics.phaseTime[MarkovMetrics::TokenizePhase] += lap(timer);
+    add(tokens, cursor, metrics);
+    buffer.remove(0, linesEnd);
+    if (reportProgress && mSignalTimer.elapsed() > 1000 / 30) {
+      emit progressValueChanged(int(inFile.pos() / 1024));
+      mSignalTimer.restart();
+    }
+  }
+  inFile.close();
+  return !mCancelled.load();
+}
+
+
+// Adds the counts of all nodes and contexts of `other` to this chain.
+void MarkovChain::merge(const MarkovChain &other)
+{
+  const MarkovVocabulary &vocabulary = other.vocabulary();
+  QVector<MarkovVocabulary::TokenId> tokenMap(vocabulary.count());
+  for (int i = 0; i < tokenMap.size(); ++i) {
+    const MarkovVocabulary::TokenId id = MarkovVocabulary::TokenId(i);
+    tokenMap[i] = nodeFor(vocabulary.data(id), vocabulary.size(id))->id();
+  }
+  const MarkovFrozenChain &frozen = other.frozen();
+  foreach (MarkovNode *otherNode, other.mNodes) {
+    MarkovNode *node = mNodes.at(int(tokenMap.at(int(otherNode->id()))));
+    if (otherNode->isFrozen()) {
+      if (frozen.begin(otherNode->id()) == frozen.end(otherNode->id()))
+        continue;
+      if (node->isFrozen()) {
+        thaw(node);
+      }
+      const MarkovFrozenChain::Edges &edges = frozen.edges(otherNode->id());
+      for (int i = 0; i < edges.degree; ++i) {
+        node->mergeSuccessor(tokenMap.at(int(edges.target(i))), int(edges.count(i)), mEdgePool);
+      }
+    }
+    else {
+      if (otherNode->successors().isEmpty())
+        continue;
+      if (node->isFrozen()) {
+        thaw(node);
+      }
+      foreach (MarkovEdge *edge, otherNode->successors()) {
+        node->mergeSuccessor(tokenMap.at(int(edge->target())), edge->count(), mEdgePool);
       }
-      inFile.close();
-      emit progressRangeChanged(0, totalSize);
-      add(tokens);
     }
   }
-  return false;
+  mContexts.merge(other.mContexts, tokenMap);
 }
 
 
+// Sums the counts of `chains` into this chain in one pass. The nodes of
+// all chains, this one included, are visited side by side in token order,
+// so tokens get their new IDs in token order. Frozen nodes keep their
+// successors ordered by token, too, so the successor lists of a token are
+// merged like sorted runs and go straight into a new frozen chain. Unlike
+// merge(const MarkovChain &), which suits adding a small model to a large
+// one, this rebuilds the whole chain.
+void MarkovChain::merge(const QList<const MarkovChain*> &chains)
+{
+  typedef MarkovVocabulary::TokenId TokenId;
+  typedef QPair<TokenId, quint32> Edge;
+  QElapsedTimer timer;
+  timer.start();
+  freeze();
+  QList<const MarkovChain*> sources = chains;
+  sources.prepend(this);
+  const int sourceCount = sources.size();
+  QVector<MarkovNodeList> sorted(sourceCount);
+  QVector<QVector<TokenId> > tokenMaps(sourceCount);
+  QVector<int> next(sourceCount, 0);
+  std::vector<int> heap;
+  for (int s = 0; s < sourceCount; ++s) {
+    sorted[s] = sources.at(s)->nodes();
+    tokenMaps[s].fill(MarkovVocabulary::InvalidId, sources.at(s)->mVocabulary.count());
+    if (!sorted.at(s).isEmpty()) {
+      heap.push_back(s);
+    }
+  }
+  // a min-heap of sources by their next token
+  const auto tokenGreater = [&sources, &sorted, &next](int a, int b) {
+    const MarkovVocabulary &va = sources.at(a)->mVocabulary;
+    const MarkovVocabulary &vb = sources.at(b)->mVocabulary;
+    const TokenId ia = sorted.at(a).at(next.at(a))->id();
+    const TokenId ib = sorted.at(b).at(next.at(b))->id();
+    return MarkovVocabulary::lessThan(vb.data(ib), vb.size(ib), va.data(ia), va.size(ia));
+  };
+  std::make_heap(heap.begin(), heap.end(), tokenGreater);
+  MarkovVocabulary vocabulary;
+  // the nodes of all sources with their merged token ID, grouped by it
+  QVector<QPair<int, const MarkovNode*> > members;
+  QVector<TokenId> memberIds;
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), tokenGreater);
+    const int s = heap.back();
+    heap.pop_back();
+    const MarkovNode *node = sorted.at(s).at(next.at(s)++);
+    const MarkovVocabulary &v = sources.at(s)->mVocabulary;
+    const TokenId id = vocabulary.intern(v.data(node->id()), v.size(node->id()));
+    tokenMaps[s][int(node->id())] = id;
+    members.append(qMakePair(s, node));
+    memberIds.append(id);
+    if (next.at(s) < sorted.at(s).size()) {
+      heap.push_back(s);
+      std::push_heap(heap.begin(), heap.end(), tokenGreater);
+    }
+  }
+
+  MarkovFrozenChain frozen;
+  QVector<QVector<Edge> > runs;
+  QVector<int> heads;
+  std::vector<int> runHeap;
+  const auto targetGreater = [&runs, &heads](int a, int b) {
+    return runs.at(a).at(heads.at(a)).first > runs.at(b).at(heads.at(b)).first;
+  };
+  for (int m = 0; m < members.size(); ) {
+    const TokenId id = memberIds.at(m);
+    runs.resize(0);
+    for (; m < members.size() && memberIds.at(m) == id; ++m) {
+      const MarkovChain *chain = sources.at(members.at(m).first);
+      const MarkovNode *node = members.at(m).second;
+      const QVector<TokenId> &tokenMap = tokenMaps.at(members.at(m).first);
+      QVector<Edge> run;
+      if (node->isFrozen()) {
+        const MarkovFrozenChain::Edges &edges = chain->mFrozen.edges(node->id());
+        for (int i = 0; i < edges.degree; ++i) {
+          run.append(Edge(tokenMap.at(int(edges.target(i))), edges.count(i)));
+        }
+      }
+      else {
+        // successors of nodes that are not frozen are kept in ID order
+        foreach (MarkovEdge *edge, node->successors()) {
+          run.append(Edge(tokenMap.at(int(edge->target())), quint32(edge->count())));
+        }
+        std::sort(run.begin(), run.end());
+      }
+      if (!run.isEmpty()) {
+        runs.append(run);
+      }
+    }
+    heads.fill(0, runs.size());
+    runHeap.clear();
+    for (int r = 0; r < runs.size(); ++r) {
+      runHeap.push_back(r);
+    }
+    std::make_heap(runHeap.begin(), runHeap.end(), targetGreater);
+    Edge merged(MarkovVocabulary::InvalidId, 0);
+    while (!runHeap.empty()) {
+      std::pop_heap(runHeap.begin(), runHeap.end(), targetGreater);
+      const int r = runHeap.back();
+      runHeap.pop_back();
+      const Edge &edge = runs.at(r).at(heads[r]++);
+      if (edge.first == merged.first) {
+        merged.second += edge.second;
+      }
+      else {
+        if (merged.first != MarkovVocabulary::InvalidId) {
+          frozen.addEdge(merged.first, merged.second);
+        }
+        merged = edge;
+      }
+      if (heads.at(r) < runs.at(r).size()) {
+        runHeap.push_back(r);
+        std::push_heap(runHeap.begin(), runHeap.end(), targetGreater);
+      }
+    }
+    if (merged.first != MarkovVocabulary::InvalidId) {
+      frozen.addEdge(merged.first, merged.second);
+    }
+    frozen.closeNode();
+  }
+
+  // new IDs follow the token order
+  QVector<TokenId> order(vocabulary.count());
+  QVector<quint32> rank(vocabulary.count());
+  for (int i = 0; i < order.size(); ++i) {
+    order[i] = TokenId(i);
+    rank[i] = quint32(i);
+  }
+  frozen.setOrder(order);
+  mContexts.prune(tokenMaps.at(0), 1);
+  for (int s = 1; s < sourceCount; ++s) {
+    mContexts.merge(sources.at(s)->mContexts, tokenMaps.at(s));
+  }
+  mContexts.freeze(rank);
+  for (int s = 1; s < sourceCount; ++s) {
+    mMetrics.add(sources.at(s)->mMetrics);
+  }
+  replaceFrozen(vocabulary, frozen);
+  mMetrics.phaseTime[MarkovMetrics::InsertPhase] += timer.nsecsElapsed();
+}
+
+
+// Reads a .markov or .markovz file in one pass. The input is cut into
+// pieces of complete lines: one range per core of an uncompressed or
+// single-block compressed file, or the chunks written by save(). The
+// pieces are decompressed if need be and parsed on the global thread
+// pool into per-thread shards, each with a private vocabulary and flat
+// lists of lines and edges. Then the private vocabularies are mapped to
+// ours, creating nodes on first reference, and finally the edges go to
+// their nodes in parallel, every worker handling a stripe of node IDs.
 bool MarkovChain::readFromMarkovFile(const QString &filename)
 {
-  qDebug() << "MarkovChain::readFromMarkovFile(" << filename << ")";
-  bool ok = false;
-  mCancelled = false;
+  mCancelled.store(0);
   mSignalTimer.start();
+  QElapsedTimer timer;
+  timer.start();
+  mMetrics.bytesRead += QFileInfo(filename).size();
+  if (MarkovSnapshot::isSnapshot(filename)) {
+    if (mNodes.isEmpty()) {
+      const bool ok = readFromSnapshot(filename);
+      mMetrics.phaseTime[MarkovMetrics::ReadPhase] += timer.nsecsElapsed();
+      return ok;
+    }
+    MarkovChain other;
+    if (!other.readFromSnapshot(filename))
+      return false;
+    merge(other);
+    mMetrics.phaseTime[MarkovMetrics::ReadPhase] += timer.nsecsElapsed();
+    postProcess();
+    return true;
+  }
   QFile inFile(filename);
-  if (inFile.open(QIODevice::ReadOnly)) {
-    QByteArray header(4, '\0');
-    inFile.read(header.data(), 4);
-    bool compressed = (header == FileHeader);
-    if (!compressed) {
-      inFile.seek(0);
-    }
-    QString data = compressed ? qUncompress(inFile.readAll()) : inFile.readAll();
-    inFile.close();
-    QStringList lines = data.split('\n');
-    // 1st pass: add nodes without successors
-    foreach (QString line, lines) {
-      QStringList m = line.split(' ');
-      MarkovNode *newNode = Q_NULLPTR;
-      if (!m.isEmpty()) {
-        newNode = new MarkovNode(m.first());
-        mNodeMap.insert(newNode->token(), newNode);
-      }
-    }
-    // 2nd pass: add successors to nodes
-    foreach (QString line, lines) {
-      QStringList strEdge = line.split(' ', QString::SkipEmptyParts);
-      if (!strEdge.isEmpty()) {
-        const QString &token = strEdge.first();
-        Q_ASSERT(mNodeMap.keys().contains(token));
-        MarkovNode *node = mNodeMap[token];
-        for (int i = 1; i < strEdge.size(); i += 2) {
-          const int count = strEdge.at(i).toInt(&ok);
-          if (ok) {
-            const QString &token = strEdge.at(i + 1);
-            MarkovNode *refNode = mNodeMap[token];
-            MarkovEdge *edge = new MarkovEdge(refNode, count);
-            node->addSuccessor(edge);
+  if (!inFile.open(QIODevice::ReadOnly))
+    return false;
+  QByteArray data;
+  const char *begin = Q_NULLPTR;
+  const char *end = Q_NULLPTR;
+  if (inFile.size() > 0) {
+    const uchar *mapped = inFile.map(0, inFile.size());
+    if (mapped == Q_NULLPTR) {
+      data = inFile.readAll();
+      begin = data.constData();
+      end = begin + data.size();
+    }
+    else {
+      begin = reinterpret_cast<const char*>(mapped);
+      end = begin + inFile.size();
+    }
+  }
+  const QByteArray header(begin, int(qMin(qint64(end - begin), qint64(FileHeader.size()))));
+  QVector<MarkovFilePiece> pieces;
+  if (header == ChunkedFileHeader) {
+    const char *p = begin + ChunkedFileHeader.size();
+    while (end - p >= qint64(sizeof(quint32))) {
+      const quint32 chunkSize = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(p));
+      p += sizeof(quint32);
+      if (qint64(chunkSize) > end - p)
+        return false;
+      pieces.append(MarkovFilePiece(p, p + chunkSize, true));
+      p += chunkSize;
+    }
+  }
+  else {
+    if (header == FileHeader) {
+      data = qUncompress(reinterpret_cast<const uchar*>(begin) + FileHeader.size(), int(end - begin) - FileHeader.size());
+      begin = data.constData();
+      end = begin + data.size();
+    }
+    const qint64 size = qint64(end - begin);
+    const int rangeCount = qMax(1, qMin(QThread::idealThreadCount(), int(size / (64 * 1024)) + 1));
+    const char *rangeBegin = begin;
+    for (int i = 0; i < rangeCount; ++i) {
+      const char *rangeEnd = (i == rangeCount - 1) ? end : qMax(rangeBegin, begin + size * (i + 1) / rangeCount);
+      while (rangeEnd < end && rangeEnd > begin && rangeEnd[-1] != '\n') {
+        ++rangeEnd;
+      }
+      pieces.append(MarkovFilePiece(rangeBegin, rangeEnd, false));
+      rangeBegin = rangeEnd;
+    }
+  }
+  qint64 totalSize = 0;
+  foreach (const MarkovFilePiece &piece, pieces) {
+    totalSize += qint64(piece.end - piece.begin);
+  }
+  emit progressRangeChanged(0, int(totalSize / 1024));
+
+  QList<MarkovFileShard*> shards;
+  QList<MarkovFileShard*> idleShards;
+  QMutex shardMutex;
+  QAtomicInteger<qint64> bytesParsed(0);
+  QtConcurrent::blockingMap(pieces, [this, &shards, &idleShards, &shardMutex, &bytesParsed](const MarkovFilePiece &piece) {
+    if (mCancelled.load())
+      return;
+    MarkovFileShard *shard = Q_NULLPTR;
+    {
+      QMutexLocker locker(&shardMutex);
+      if (idleShards.isEmpty()) {
+        shard = new MarkovFileShard;
+        shards.append(shard);
+      }
+      else {
+        shard = idleShards.takeLast();
+      }
+    }
+    if (piece.compressed) {
+      const QByteArray &text = qUncompress(reinterpret_cast<const uchar*>(piece.begin), int(piece.end - piece.begin));
+      shard->parse(text.constData(), text.constData() + text.size(), mCancelled);
+    }
+    else {
+      shard->parse(piece.begin, piece.end, mCancelled);
+    }
+    const qint64 n = qint64(piece.end - piece.begin);
+    emit progressValueChanged(int((bytesParsed.fetchAndAddOrdered(n) + n) / 1024));
+    QMutexLocker locker(&shardMutex);
+    idleShards.append(shard);
+  });
+  inFile.close();
+  data.clear();
+  if (mCancelled.fetchAndStoreOrdered(0)) {
+    qDeleteAll(shards);
+    return false;
+  }
+
+  foreach (MarkovFileShard *shard, shards) {
+    shard->tokenMap.resize(shard->vocabulary.count());
+    for (int id = 0; id < shard->tokenMap.size(); ++id) {
+      const MarkovVocabulary::TokenId localId = MarkovVocabulary::TokenId(id);
+      shard->tokenMap[id] = nodeFor(shard->vocabulary.data(localId), shard->vocabulary.size(localId))->id();
+    }
+    shard->vocabulary.clear();
+  }
+
+  QVector<int> stripes(QThread::idealThreadCount());
+  for (int i = 0; i < stripes.size(); ++i) {
+    stripes[i] = i;
+  }
+  const int stripeCount = stripes.size();
+  // nodes are thawed concurrently below, without being listed in mDirty
+  mFullFreeze = true;
+  QMutex edgePoolMutex;
+  QtConcurrent::blockingMap(stripes, [this, &shards, &edgePoolMutex, stripeCount](int stripe) {
+    // the edges of this stripe, handed over to mEdgePool when done
+    MarkovEdgePool edges;
+    QVector<MarkovNode::Successor> successors;
+    foreach (const MarkovFileShard *shard, shards) {
+      if (mCancelled.load())
+        break;
+      for (int line = 0; line < shard->sources.size() && !mCancelled.load(); ++line) {
+        const MarkovVocabulary::TokenId id = shard->tokenMap.at(int(shard->sources.at(line)));
+        if (int(id % quint32(stripeCount)) != stripe)
+          continue;
+        successors.clear();
+        for (int edge = shard->firstEdges.at(line); edge < shard->firstEdges.at(line + 1); ++edge) {
+          successors.append(MarkovNode::Successor(shard->tokenMap.at(int(shard->targets.at(edge))), shard->counts.at(edge)));
+        }
+        std::sort(successors.begin(), successors.end());
+        // a token listed twice in a line counts with the sum of its counts
+        int n = 0;
+        for (int i = 0; i < successors.size(); ++i) {
+          if (n > 0 && successors.at(n - 1).first == successors.at(i).first) {
+            successors[n - 1].second += successors.at(i).second;
+          }
+          else {
+            successors[n++] = successors.at(i);
           }
         }
+        successors.resize(n);
+        MarkovNode *node = mNodes.at(int(id));
+        if (node->isFrozen()) {
+          node->thaw(mFrozen, edges);
+        }
+        node->mergeSuccessors(successors, edges);
       }
     }
-    postProcess();
+    QMutexLocker locker(&edgePoolMutex);
+    mEdgePool.adopt(edges);
+  });
+  qDeleteAll(shards);
+  mMetrics.phaseTime[MarkovMetrics::ReadPhase] += timer.nsecsElapsed();
+  // a cancelled chain is half merged and gets thrown away, so it isn't
+  // worth freezing; mFullFreeze has it rebuilt if it is used after all
+  if (mCancelled.fetchAndStoreOrdered(0))
+    return false;
+  postProcess();
+  return true;
+}
+
+
+// Writes the nodes in chunks of about ChunkSize bytes of complete lines.
+// A batch of chunks is rendered, and compressed for .markovz files, on
+// the global thread pool, then written in order before the next batch
+// is started, so memory stays bounded by the batch. Compressed files
+// start with ChunkedFileHeader, followed by each chunk as its size
+// (32 bits, little endian) and its qCompress()ed lines, which lets
+// readFromMarkovFile() decompress the chunks concurrently. Returns false
+// if the file could not be written completely, in which case a previous
+// file of that name is left as it was.
+bool MarkovChain::save(const QString &filename)
+{
+  if (filename.endsWith(SnapshotSuffix))
+    return saveSnapshot(filename);
+  QElapsedTimer timer;
+  timer.start();
+  QSaveFile outFile(filename);
+  if (!outFile.open(QIODevice::WriteOnly))
+    return false;
+  const bool compressed = filename.endsWith('z');
+  if (compressed) {
+    outFile.write(ChunkedFileHeader);
+  }
+  const MarkovNodeList &sorted = nodes();
+  // cut chunks by the number of edges, which is what the line lengths mostly depend on
+  const int edgesPerChunk = int(ChunkSize / 16);
+  QVector<QPair<int, int> > chunks;
+  int chunkBegin = 0;
+  int chunkEdges = 0;
+  for (int i = 0; i < sorted.size(); ++i) {
+    const MarkovNode *node = sorted.at(i);
+    chunkEdges += 1 + (node->isFrozen() ? mFrozen.end(node->id()) - mFrozen.begin(node->id()) : node->successors().size());
+    if (chunkEdges >= edgesPerChunk || i == sorted.size() - 1) {
+      chunks.append(qMakePair(chunkBegin, i + 1));
+      chunkBegin = i + 1;
+      chunkEdges = 0;
+    }
+  }
+  const int batchSize = 2 * QThread::idealThreadCount();
+  for (int batchBegin = 0; batchBegin < chunks.size(); batchBegin += batchSize) {
+    const QVector<QPair<int, int> > &batch = chunks.mid(batchBegin, batchSize);
+    const QList<QByteArray> &rendered = QtConcurrent::blockingMapped<QList<QByteArray> >(batch, [&sorted, compressed](const QPair<int, int> &chunk) {
+      QByteArray lines;
+      for (int i = chunk.first; i < chunk.second; ++i) {
+        sorted.at(i)->appendTo(lines);
+        lines.append('\n');
+      }
+      return compressed ? qCompress(lines, 9) : lines;
+    });
+    foreach (const QByteArray &data, rendered) {
+      if (compressed) {
+        uchar size[sizeof(quint32)];
+        qToLittleEndian<quint32>(quint32(data.size()), size);
+        outFile.write(reinterpret_cast<const char*>(size), sizeof(size));
+      }
+      outFile.write(data);
+    }
   }
+  const bool ok = outFile.commit();
+  mMetrics.phaseTime[MarkovMetrics::SerializePhase] += timer.nsecsElapsed();
   return ok;
 }
 
 
-void MarkovChain::save(const QString &filename)
+// May be called on several threads at once, as may addText().
+void MarkovChain::add(const QStringList &tokenList)
 {
-  QFile outFile(filename);
-  if (outFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
-    QByteArray data = toString().toUtf8();
-    if (filename.endsWith('z')) {
-      outFile.write(FileHeader);
-      data = qCompress(data, 9);
+  if (isQuantized())
+    return;
+  MarkovMetrics metrics;
+  QElapsedTimer timer;
+  timer.start();
+  MarkovNodeList nodes;
+  nodes.reserve(tokenList.size());
+  foreach (QString token, tokenList) {
+    if (mCancelled.load())
+      break;
+    const QByteArray &utf8 = token.toUtf8();
+    nodes.append(sharedNodeFor(utf8.constData(), utf8.size()));
+  }
+  metrics.phaseTime[MarkovMetrics::InsertPhase] += timer.nsecsElapsed();
+  IngestCursor cursor;
+  add(nodes, cursor, metrics);
+}
+
+
+void MarkovChain::add(const MarkovTokenizer::TokenList &tokens, IngestCursor &cursor, MarkovMetrics &metrics)
+{
+  if (isQuantized())
+    return;
+  QElapsedTimer timer;
+  timer.start();
+  MarkovNodeList nodes;
+  nodes.reserve(tokens.size());
+  foreach (const MarkovTokenizer::Token &token, tokens) {
+    if (mCancelled.load())
+      break;
+    if (token.wellFormed) {
+      nodes.append(sharedNodeFor(token.data, token.size));
+    }
+    else {
+      // intern the same replacement characters as QString::fromUtf8() would
+      const QByteArray &utf8 = QString::fromUtf8(token.data, token.size).toUtf8();
+      nodes.append(sharedNodeFor(utf8.constData(), utf8.size()));
     }
-    outFile.write(data);
-    outFile.close();
   }
+  metrics.phaseTime[MarkovMetrics::InsertPhase] += timer.nsecsElapsed();
+  add(nodes, cursor, metrics);
 }
 
 
-void MarkovChain::add(const QStringList &tokenList)
+// Counts the transitions between `nodes` privately, then folds the counts
+// into the chain in one go, so concurrent callers only wait for each other
+// while folding. The successor lists and the contexts are thus changed by
+// one thread at a time, and the vocabulary is not copied per thread.
+void MarkovChain::add(const MarkovNodeList &nodes, IngestCursor &cursor, MarkovMetrics &metrics)
 {
-  if (!tokenList.isEmpty()) {
-    MarkovNode *prev = Q_NULLPTR;
-    int bytesProcessed = 0;
-    foreach (QString token, tokenList) {
-      if (mCancelled)
-        break;
-      MarkovNode *curr = mNodeMap.value(token, Q_NULLPTR);
-      if (curr == Q_NULLPTR) {
-        curr = new MarkovNode(token);
-        mNodeMap.insert(curr->token(), curr);
+  QElapsedTimer timer;
+  timer.start();
+  const int order = mContexts.collectedOrder();
+  // (source << 32 | target) -> count
+  QHash<quint64, int> transitions;
+  MarkovContextModel contexts;
+  contexts.setOrder(order);
+  foreach (MarkovNode *curr, nodes) {
+    if (cursor.prev != Q_NULLPTR) {
+      ++transitions[(quint64(cursor.prev->id()) << 32) | curr->id()];
+      if (order > 1) {
+        contexts.addTransition(cursor.history, cursor.historyLength, curr->id());
       }
-      if (prev != Q_NULLPTR) {
-        prev->addSuccessor(curr);
+    }
+    if (cursor.historyLength == order) {
+      std::copy(cursor.history + 1, cursor.history + cursor.historyLength, cursor.history);
+      --cursor.historyLength;
+    }
+    cursor.history[cursor.historyLength++] = curr->id();
+    cursor.prev = curr;
+  }
+  metrics.tokens += nodes.size();
+  QMutexLocker foldLocker(&mFoldMutex);
+  {
+    QReadLocker nodesLocker(&mNodesLock);
+    if (mOnlineEnabled) {
+      // before the nodes are added to, so that their counts so far are copied
+      for (QHash<quint64, int>::const_iterator i = transitions.constBegin(); i != transitions.constEnd(); ++i) {
+        copyToOnline(mNodes.at(int(i.key() >> 32)));
       }
-      prev = curr;
-      bytesProcessed += token.length();
-      if (mSignalTimer.elapsed() > 1000 / 30) {
-        emit progressValueChanged(int(bytesProcessed));
-        mSignalTimer.restart();
+    }
+    for (QHash<quint64, int>::const_iterator i = transitions.constBegin(); i != transitions.constEnd(); ++i) {
+      MarkovNode *node = mNodes.at(int(i.key() >> 32));
+      if (node->isFrozen()) {
+        thaw(node);
       }
+      node->mergeSuccessor(MarkovVocabulary::TokenId(quint32(i.key())), i.value(), mEdgePool);
+    }
+    if (order > 1) {
+      mContexts.merge(contexts, QVector<MarkovVocabulary::TokenId>());
     }
+    if (mOnlineEnabled) {
+      mOnline.add(transitions, sentenceTerminatorIds());
+    }
+  }
+  metrics.phaseTime[MarkovMetrics::InsertPhase] += timer.nsecsElapsed();
+  mMetrics.add(metrics);
+}
+
+
+// Looks the token up under the shared lock and only takes the exclusive
+// one to add it, which is rare once the vocabulary has settled.
+MarkovNode *MarkovChain::sharedNodeFor(const char *data, int size)
+{
+  {
+    QReadLocker locker(&mNodesLock);
+    const MarkovVocabulary::TokenId id = mVocabulary.find(data, size);
+    if (id != MarkovVocabulary::InvalidId)
+      return mNodes.at(int(id));
   }
+  QWriteLocker locker(&mNodesLock);
+  return nodeFor(data, size);
+}
+
+
+// Writes the vocabulary, the frozen chain and the contexts as a binary
+// snapshot, rebuilding the frozen chain if nodes were added to or only
+// repacked since the last freeze(), or if it is paged.
+bool MarkovChain::saveSnapshot(const QString &filename)
+{
+  if (mFullFreeze || !mDirty.isEmpty() || mFrozen.nodeCount() < mNodes.size() || mFrozen.orderCount() < mNodes.size()
+      || !mFrozen.isCompact() || !mContexts.isCompact() || !mPagedSnapshot.isNull()) {
+    freeze();
+  }
+  QElapsedTimer timer;
+  timer.start();
+  MarkovSnapshot snapshot;
+  mVocabulary.writeTo(snapshot, VocabularyComponent);
+  mFrozen.writeTo(snapshot, FrozenChainComponent);
+  mContexts.writeTo(snapshot, ContextModelComponent);
+  const bool ok = snapshot.write(filename);
+  mMetrics.phaseTime[MarkovMetrics::SerializePhase] += timer.nsecsElapsed();
+  return ok;
+}
+
+
+// Replaces the chain with the one in the snapshot. The vocabulary and the
+// frozen chains are used right from the mapped file; only the nodes, which
+// hold nothing but their ID until they are added to, are created.
+//
+// With a positive `pageBudget` the file is not mapped, for models larger
+// than memory: the vocabulary, the node offsets and the context tables
+// are read, and the successors of a node are read when a walk first gets
+// there, keeping those used most recently within `pageBudget` bytes.
+bool MarkovChain::readFromSnapshot(const QString &filename, qint64 pageBudget)
+{
+  QSharedPointer<MarkovSnapshot> snapshot(new MarkovSnapshot);
+  if (pageBudget > 0 ? !snapshot->open(filename, pageBudget) : !snapshot->map(filename)) {
+    qWarning() << "MarkovChain::readFromSnapshot(" << filename << "):" << snapshot->errorString();
+    return false;
+  }
+  clear();
+  if (!mVocabulary.attach(snapshot, VocabularyComponent)
+      || !mFrozen.attach(snapshot, FrozenChainComponent, mVocabulary.count())
+      || !mContexts.attach(snapshot, ContextModelComponent, mVocabulary.count())
+      || mFrozen.nodeCount() != mVocabulary.count()) {
+    qWarning() << "MarkovChain::readFromSnapshot(" << filename << "): inconsistent snapshot";
+    clear();
+    return false;
+  }
+  mNodes.reserve(mVocabulary.count());
+  for (int i = 0; i < mVocabulary.count(); ++i) {
+    mNodes.append(mNodePool.create(this, MarkovVocabulary::TokenId(i), true));
+  }
+  if (snapshot->isPaged()) {
+    mPagedSnapshot = snapshot;
+  }
+  return true;
 }
 
 
 QString MarkovChain::toString(void) const
 {
   QString result;
-  foreach (MarkovNode *node, mNodeMap) {
+  foreach (MarkovNode *node, nodes()) {
     result.append(node->toString()).append('\n');
   }
   return result;
 }
 
 
-const MarkovChain::MarkovNodeMap &MarkovChain::nodes(void) const
+MarkovChain::MarkovNodeList MarkovChain::nodes(void) const
+{
+  // ordered by token like the former QMap<QString, MarkovNode*>
+  const MarkovVocabulary &vocabulary = mVocabulary;
+  const auto lessThan = [&vocabulary](MarkovNode *a, MarkovNode *b) {
+    return vocabulary.lessThan(a->id(), b->id());
+  };
+  MarkovNodeList sorted;
+  sorted.reserve(mNodes.size());
+  const MarkovVocabulary::TokenId *order = mFrozen.order();
+  for (int i = 0; i < mFrozen.orderCount(); ++i) {
+    sorted.append(mNodes.at(int(order[i])));
+  }
+  // nodes created since the last freeze() are not in the order yet
+  const int ordered = sorted.size();
+  for (int i = ordered; i < mNodes.size(); ++i) {
+    sorted.append(mNodes.at(i));
+  }
+  std::sort(sorted.begin() + ordered, sorted.end(), lessThan);
+  std::inplace_merge(sorted.begin(), sorted.begin() + ordered, sorted.end(), lessThan);
+  return sorted;
+}
+
+
+const MarkovVocabulary &MarkovChain::vocabulary(void) const
+{
+  return mVocabulary;
+}
+
+
+const MarkovFrozenChain &MarkovChain::frozen(void) const
 {
-  return mNodeMap;
+  return mFrozen;
 }
 
 
@@ -11,51 +11,189 @@
 #include <QObject>
 #include <QByteArray>
 #include <QString>
-#include <QMap>
+#include <QStringList>
+#include <QVector>
 #include <QElapsedTimer>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QList>
+#include <QAtomicInteger>
+#include <QSharedPointer>
 
 #include "markovnode.h"
+#include "markovedge.h"
+#include "markovpool.h"
+#include "markovvocabulary.h"
+#include "markovfrozenchain.h"
+#include "markovcontextmodel.h"
+#include "markovonlinemodel.h"
+#include "markovtokenizer.h"
+#include "markovmetrics.h"
 
 
 class MarkovChain : public QObject {
   Q_OBJECT
 
 public:
-  typedef QMap<QString, MarkovNode*> MarkovNodeMap;
+  typedef QVector<MarkovNode*> MarkovNodeList;
+
+  // what prune() drops, and whether it quantizes the counts
+  struct PruneOptions {
+    PruneOptions(void) : minCount(1), topK(0), quantize(false) { /* ... */ }
+    // edges counted fewer times are dropped
+    int minCount;
+    // if positive, only a node's topK most frequent successors are kept
+    int topK;
+    bool quantize;
+  };
+
+  // what prune() saved and lost
+  struct PruneReport {
+    PruneReport(void)
+      : nodesRemoved(0), edgesRemoved(0), memoryBefore(0), memoryAfter(0), prunedMass(0), quantizationError(0) { /* ... */ }
+    int nodesRemoved;
+    int edgesRemoved;
+    qint64 memoryBefore;
+    qint64 memoryAfter;
+    // share of all transitions that were dropped
+    qreal prunedMass;
+    // share of the remaining transitions moved to other successors by quantization
+    qreal quantizationError;
+  };
 
   MarkovChain(void);
+  ~MarkovChain();
 
   void add(const QStringList &tokenList);
-  const MarkovNodeMap &nodes(void) const;
+  MarkovNodeList nodes(void) const;
+  const MarkovVocabulary &vocabulary(void) const;
+  const MarkovFrozenChain &frozen(void) const;
+  MarkovNode *node(MarkovVocabulary::TokenId id) const;
+  MarkovNode *selectSuccessor(const MarkovNode *node, qreal p) const;
+  MarkovNode *selectSuccessor(const QVector<MarkovVocabulary::TokenId> &history, qreal p) const;
+  MarkovNode *selectSentenceStart(qreal p) const;
+  void setSamplingMode(MarkovFrozenChain::SamplingMode mode);
+  MarkovFrozenChain::SamplingMode samplingMode(void) const;
+  void setModelOrder(int order);
+  int modelOrder(void) const;
+  const MarkovContextModel &contexts(void) const;
+  void setOnline(bool online);
+  bool isOnline(void) const;
+  const MarkovOnlineModel &online(void) const;
+  QString token(MarkovVocabulary::TokenId id) const;
   void postProcess(void);
+  PruneReport prune(const PruneOptions &options);
+  bool isQuantized(void) const;
   void clear(void);
   bool isCancelled(void) const;
   void cancel(void);
+  MarkovMetrics metrics(void) const;
+  void resetMetrics(void);
+  void addGenerated(qint64 words, qint64 ns) const;
 
   int count(void) const;
   MarkovNode *at(int);
 
   bool readFromTextFile(const QString &filename);
+  bool readFromTextFiles(const QStringList &filenames);
+  void merge(const MarkovChain &other);
+  void merge(const QList<const MarkovChain*> &chains);
   bool readFromMarkovFile(const QString &filename);
-  void save(const QString &filename);
+  bool save(const QString &filename);
+  bool readFromSnapshot(const QString &filename, qint64 pageBudget = 0);
+  bool saveSnapshot(const QString &filename);
 
   QString toString(void) const;
 
   static const QByteArray FileHeader;
+  static const QByteArray ChunkedFileHeader;
+  static const QStringList SentenceTerminators;
+  static const qint64 ChunkSize;
+  static const QString SnapshotSuffix;
 
   void addText(const QString &text);
 
 signals:
   void progressRangeChanged(int, int);
   void progressValueChanged(int);
+  void readingTextFile(QString);
 
 private:
-  MarkovNodeMap mNodeMap;
-  volatile bool mCancelled;
+  MarkovVocabulary mVocabulary;
+  // indexed by token ID
+  MarkovNodeList mNodes;
+  // hold the nodes and the successor lists of nodes that are not frozen
+  MarkovPool<MarkovNode> mNodePool;
+  MarkovEdgePool mEdgePool;
+  MarkovFrozenChain mFrozen;
+  MarkovContextModel mContexts;
+  // counted by add() as well if mOnlineEnabled, see setOnline()
+  MarkovOnlineModel mOnline;
+  bool mOnlineEnabled;
+  QAtomicInt mCancelled;
   QElapsedTimer mSignalTimer;
+  // guards mVocabulary and mNodes while add() runs on several threads
+  mutable QReadWriteLock mNodesLock;
+  // held while the counts of one add() are folded into the chain
+  QMutex mFoldMutex;
+  // nodes thawed since the last postProcess(), see freezeDirty()
+  MarkovNodeList mDirty;
+  // nodes were thawed without being listed in mDirty
+  bool mFullFreeze;
+  MarkovMetrics mMetrics;
+  // the snapshot the chain is paged in from, for the page statistics in metrics()
+  QSharedPointer<MarkovSnapshot> mPagedSnapshot;
+  // generation only reads from the chain, possibly on many threads
+  mutable QAtomicInteger<qint64> mWordsGenerated;
+  mutable QAtomicInteger<qint64> mGenerateTime;
 
 private:
-  void parseText(const QString &line, QStringList &tokens, int &totalSize);
+  // state of a walk through added tokens, carried across chunks of input
+  struct IngestCursor {
+    IngestCursor(void) : prev(Q_NULLPTR), historyLength(0) { /* ... */ }
+    MarkovNode *prev;
+    // the most recent tokens, newest last
+    MarkovVocabulary::TokenId history[MarkovContextModel::MaxOrder];
+    int historyLength;
+  };
+
+  // complete lines of a .markov file, possibly a compressed chunk of them
+  struct MarkovFilePiece {
+    MarkovFilePiece(void) : begin(Q_NULLPTR), end(Q_NULLPTR), compressed(false) { /* ... */ }
+    MarkovFilePiece(const char *begin, const char *end, bool compressed)
+      : begin(begin), end(end), compressed(compressed) { /* ... */ }
+    const char *begin;
+    const char *end;
+    bool compressed;
+  };
+
+  // lines of a .markov file parsed by one thread of readFromMarkovFile()
+  struct MarkovFileShard {
+    MarkovFileShard(void);
+    void parse(const char *begin, const char *end, const QAtomicInt &cancelled);
+    MarkovVocabulary vocabulary;
+    // per line: the node's token, and its edges in firstEdges[line] .. firstEdges[line + 1]
+    QVector<MarkovVocabulary::TokenId> sources;
+    QVector<int> firstEdges;
+    QVector<MarkovVocabulary::TokenId> targets;
+    QVector<int> counts;
+    // private token ID -> ID in this chain
+    QVector<MarkovVocabulary::TokenId> tokenMap;
+  };
+
+  bool streamTextFile(const QString &filename, bool reportProgress);
+  void add(const MarkovTokenizer::TokenList &tokens, IngestCursor &cursor, MarkovMetrics &metrics);
+  void add(const MarkovNodeList &nodes, IngestCursor &cursor, MarkovMetrics &metrics);
+  void addImportTime(qint64 ns);
+  MarkovNode *sharedNodeFor(const char *data, int size);
+  MarkovNode *nodeFor(const QString &token);
+  MarkovNode *nodeFor(const char *data, int size);
+  void thaw(MarkovNode *node);
+  void copyToOnline(MarkovNode *node);
+  void replaceFrozen(MarkovVocabulary &vocabulary, MarkovFrozenChain &frozen);
+  QVector<MarkovVocabulary::TokenId> sentenceTerminatorIds(void) const;
+  void freeze(void);
+  void freezeDirty(void);
 };
 
 
@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovcontextmodel.h"
+
+#include <QPair>
+
+#include <algorithm>
+
+const MarkovContextModel::ContextId MarkovContextModel::InvalidContext;
+const int MarkovContextModel::MaxOrder;
+const quint64 MarkovContextModel::EmptyKey;
+
+static const int InitialTableSize = 1024;
+
+
+MarkovContextModel::Level::Level(void)
+  : contextCount(0)
+  , edgeCount(0)
+  , dirtyOverflow(false)
+{
+  contextKeys.fill(EmptyKey, InitialTableSize);
+  contextIds.resize(InitialTableSize);
+  edgeKeys.fill(EmptyKey, InitialTableSize);
+  edgeCounts.resize(InitialTableSize);
+}
+
+
+MarkovContextModel::MarkovContextModel(void)
+  : mOrder(1)
+  , mSamplingMode(MarkovFrozenChain::AliasSampling)
+{
+  /* ... */
+}
+
+
+void MarkovContextModel::setOrder(int order)
+{
+  mOrder = qBound(1, order, MaxOrder);
+  addLevels(mOrder);
+}
+
+
+int MarkovContextModel::order(void) const
+{
+  return mOrder;
+}
+
+
+// The highest order of the contexts kept, which may exceed order().
+int MarkovContextModel::collectedOrder(void) const
+{
+  return mLevels.size() + 1;
+}
+
+
+void MarkovContextModel::addLevels(int order)
+{
+  const int oldSize = mLevels.size();
+  if (order - 1 <= oldSize)
+    return;
+  mLevels.resize(order - 1);
+  for (int i = oldSize; i < mLevels.size(); ++i) {
+    mLevels[i].frozen.setSamplingMode(mSamplingMode);
+  }
+}
+
+
+void MarkovContextModel::clear(void)
+{
+  mLevels.clear();
+  setOrder(mOrder);
+}
+
+
+quint64 MarkovContextModel::makeKey(quint32 hi, quint32 lo)
+{
+  return (quint64(hi) << 32) | quint64(lo);
+}
+
+
+int MarkovContextModel::probe(const QVector<quint64> &keys, quint64 key)
+{
+  const int mask = keys.size() - 1;
+  int slot = int((key * Q_UINT64_C(0x9e3779b97f4a7c15)) >> 32) & mask;
+  while (keys.at(slot) != EmptyKey && keys.at(slot) != key) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+
+template <typename T>
+void MarkovContextModel::grow(QVector<quint64> &keys, QVector<T> &values)
+{
+  QVector<quint64> oldKeys(2 * keys.size(), EmptyKey);
+  QVector<T> oldValues(2 * values.size());
+  oldKeys.swap(keys);
+  oldValues.swap(values);
+  for (int i = 0; i < oldKeys.size(); ++i) {
+    if (oldKeys.at(i) != EmptyKey) {
+      const int slot = probe(keys, oldKeys.at(i));
+      keys[slot] = oldKeys.at(i);
+      values[slot] = oldValues.at(i);
+    }
+  }
+}
+
+
+MarkovContextModel::ContextId MarkovContextModel::internContext(Level &level, ContextId parent, TokenId token)
+{
+  const quint64 key = makeKey(parent, token);
+  const int slot = probe(level.contextKeys, key);
+  if (level.contextKeys.at(slot) == key)
+    return level.contextIds.at(slot);
+  const ContextId id = ContextId(level.contextCount++);
+  level.contextKeys[slot] = key;
+  level.contextIds[slot] = id;
+  // keep the load factor below 1/2
+  if (2 * level.contextCount > level.contextKeys.size()) {
+    grow(level.contextKeys, level.contextIds);
+  }
+  return id;
+}
+
+
+void MarkovContextModel::addTransition(const TokenId *history, int length, TokenId successor)
+{
+  // history[length - 1] is the most recent token, i.e. the order-1 context
+  ContextId context = history[length - 1];
+  for (int order = 2; order <= collectedOrder() && order <= length; ++order) {
+    Level &level = mLevels[order - 2];
+    context = internContext(level, context, history[length - order]);
+    addEdge(level, context, successor, 1);
+  }
+}
+
+
+void MarkovContextModel::addEdge(Level &level, ContextId context, TokenId successor, quint32 count)
+{
+  const quint64 key = makeKey(context, successor);
+  const int slot = probe(level.edgeKeys, key);
+  if (level.edgeKeys.at(slot) == key) {
+    level.edgeCounts[slot] += count;
+    markDirty(level, key, false);
+  }
+  else {
+    level.edgeKeys[slot] = key;
+    level.edgeCounts[slot] = count;
+    ++level.edgeCount;
+    if (2 * level.edgeCount > level.edgeKeys.size()) {
+      grow(level.edgeKeys, level.edgeCounts);
+    }
+    markDirty(level, key, true);
+  }
+}
+
+
+// Remembers what freezeDirty() has to repack, unless that is most of the level.
+void MarkovContextModel::markDirty(Level &level, quint64 edgeKey, bool newEdge)
+{
+  if (level.dirtyOverflow)
+    return;
+  if (newEdge) {
+    level.newEdges.append(edgeKey);
+  }
+  else {
+    level.dirtyContexts.append(ContextId(edgeKey >> 32));
+  }
+  if (2 * (level.dirtyContexts.size() + level.newEdges.size()) > qMax(InitialTableSize, level.frozen.edgeCount())) {
+    level.dirtyContexts = QVector<ContextId>();
+    level.newEdges = QVector<quint64>();
+    level.dirtyOverflow = true;
+  }
+}
+
+
+// Adds the counts of `other`, whose token IDs map to ours through
+// `tokenMap`, or are ours if it is empty.
+void MarkovContextModel::merge(const MarkovContextModel &other, const QVector<TokenId> &tokenMap)
+{
+  addLevels(other.collectedOrder());
+  const bool identity = tokenMap.isEmpty();
+  // the other's contexts of the previous order -> ours
+  QVector<ContextId> parentMap = tokenMap;
+  for (int i = 0; i < other.mLevels.size(); ++i) {
+    const Level &src = other.mLevels.at(i);
+    Level &dst = mLevels[i];
+    QVector<ContextId> contextMap(src.contextCount);
+    for (int slot = 0; slot < src.contextKeys.size(); ++slot) {
+      const quint64 key = src.contextKeys.at(slot);
+      if (key != EmptyKey) {
+        const ContextId parent = (identity && i == 0) ? ContextId(key >> 32) : parentMap.at(int(key >> 32));
+        const TokenId token = identity ? TokenId(quint32(key)) : tokenMap.at(int(quint32(key)));
+        contextMap[int(src.contextIds.at(slot))] = internContext(dst, parent, token);
+      }
+    }
+    for (int slot = 0; slot < src.edgeKeys.size(); ++slot) {
+      const quint64 key = src.edgeKeys.at(slot);
+      if (key != EmptyKey) {
+        const TokenId token = identity ? TokenId(quint32(key)) : tokenMap.at(int(quint32(key)));
+        addEdge(dst, contextMap.at(int(key >> 32)), token, src.edgeCounts.at(slot));
+      }
+    }
+    parentMap.swap(contextMap);
+  }
+}
+
+
+// Keeps the contexts and edges of tokens `tokenMap` keeps, dropping edges
+// rarer than `minCount` and beyond the `topK` most frequent per context.
+// The levels must be frozen, and freeze() must follow.
+void MarkovContextModel::prune(const QVector<TokenId> &tokenMap, quint32 minCount, int topK)
+{
+  QVector<Level> levels(mLevels.size());
+  QVector<ContextId> parentMap = tokenMap;
+  for (int i = 0; i < mLevels.size(); ++i) {
+    const Level &src = mLevels.at(i);
+    Level &dst = levels[i];
+    dst.frozen.setSamplingMode(mSamplingMode);
+    QVector<ContextId> contextMap(src.contextCount, InvalidContext);
+    for (int slot = 0; slot < src.contextKeys.size(); ++slot) {
+      const quint64 key = src.contextKeys.at(slot);
+      if (key == EmptyKey)
+        continue;
+      const ContextId parent = parentMap.at(int(key >> 32));
+      const TokenId token = tokenMap.at(int(quint32(key)));
+      if (parent != InvalidContext && token != MarkovVocabulary::InvalidId) {
+        contextMap[int(src.contextIds.at(slot))] = internContext(dst, parent, token);
+      }
+    }
+    QVector<int> kept;
+    for (int context = 0; context < src.frozen.nodeCount(); ++context) {
+      if (contextMap.at(context) == InvalidContext)
+        continue;
+      const MarkovFrozenChain::Edges &edges = src.frozen.edges(ContextId(context));
+      kept.resize(0);
+      for (int i = 0; i < edges.degree; ++i) {
+        if (edges.count(i) >= minCount && tokenMap.at(int(edges.target(i))) != MarkovVocabulary::InvalidId) {
+          kept.append(i);
+        }
+      }
+      // ties go to the earlier successor, like in MarkovChain::prune()
+      if (topK > 0 && kept.size() > topK) {
+        std::nth_element(kept.begin(), kept.begin() + topK, kept.end(), [&edges](int a, int b) {
+          return edges.count(a) > edges.count(b) || (edges.count(a) == edges.count(b) && a < b);
+        });
+        kept.resize(topK);
+      }
+      foreach (int i, kept) {
+        addEdge(dst, contextMap.at(context), tokenMap.at(int(edges.target(i))), edges.count(i));
+      }
+    }
+    parentMap.swap(contextMap);
+  }
+  mLevels.swap(levels);
+}
+
+
+void MarkovContextModel::quantize(void)
+{
+  for (int i = 0; i < mLevels.size(); ++i) {
+    mLevels[i].frozen.quantize();
+  }
+}
+
+
+void MarkovContextModel::freeze(const QVector<quint32> &rank)
+{
+  for (int i = 0; i < mLevels.size(); ++i) {
+    freezeLevel(mLevels[i], [&rank](TokenId a, TokenId b) {
+      return rank.at(int(a)) < rank.at(int(b));
+    });
+  }
+}
+
+
+// Repacks the contexts added to since the last freeze, or whole levels
+// where that is cheaper or the frozen chain cannot be reopened.
+void MarkovContextModel::freezeDirty(const MarkovVocabulary &vocabulary)
+{
+  for (int i = 0; i < mLevels.size(); ++i) {
+    Level &level = mLevels[i];
+    if (!level.dirtyOverflow && level.dirtyContexts.isEmpty() && level.newEdges.isEmpty())
+      continue;
+    const bool inPlace = level.frozen.isPaged() && !level.frozen.isQuantized();
+    if (level.dirtyOverflow || (!inPlace && (level.frozen.isMapped() || level.frozen.isQuantized() || 2 * level.frozen.garbageCount() > level.frozen.edgeCount()))) {
+      freezeLevel(level, [&vocabulary](TokenId a, TokenId b) {
+        return vocabulary.lessThan(a, b);
+      });
+    }
+    else {
+      freezeDirtyLevel(level, vocabulary);
+    }
+  }
+}
+
+
+bool MarkovContextModel::isCompact(void) const
+{
+  foreach (const Level &level, mLevels) {
+    if (level.dirtyOverflow || !level.dirtyContexts.isEmpty() || !level.newEdges.isEmpty() || !level.frozen.isCompact())
+      return false;
+  }
+  return true;
+}
+
+
+template <typename LessThan>
+void MarkovContextModel::freezeLevel(Level &level, LessThan tokenLessThan)
+{
+  typedef QPair<quint64, quint32> Edge;
+  QVector<Edge> edges;
+  edges.reserve(level.edgeCount);
+  for (int slot = 0; slot < level.edgeKeys.size(); ++slot) {
+    if (level.edgeKeys.at(slot) != EmptyKey) {
+      edges.append(Edge(level.edgeKeys.at(slot), level.edgeCounts.at(slot)));
+    }
+  }
+  // group by context, order successors by token like the first-order chain
+  std::sort(edges.begin(), edges.end(), [&tokenLessThan](const Edge &a, const Edge &b) {
+    const quint32 ca = quint32(a.first >> 32);
+    const quint32 cb = quint32(b.first >> 32);
+    if (ca != cb)
+      return ca < cb;
+    return tokenLessThan(TokenId(a.first), TokenId(b.first));
+  });
+  MarkovFrozenChain frozen;
+  int e = 0;
+  for (ContextId context = 0; context < ContextId(level.contextCount); ++context) {
+    while (e < edges.size() && quint32(edges.at(e).first >> 32) == context) {
+      frozen.addEdge(TokenId(edges.at(e).first), edges.at(e).second);
+      ++e;
+    }
+    frozen.closeNode();
+  }
+  level.frozen.swap(frozen);
+  level.dirtyContexts.clear();
+  level.newEdges.clear();
+  level.dirtyOverflow = false;
+}
+
+
+void MarkovContextModel::freezeDirtyLevel(Level &level, const MarkovVocabulary &vocabulary)
+{
+  QVector<ContextId> contexts = level.dirtyContexts;
+  foreach (quint64 key, level.newEdges) {
+    contexts.append(ContextId(key >> 32));
+  }
+  std::sort(contexts.begin(), contexts.end());
+  contexts.erase(std::unique(contexts.begin(), contexts.end()), contexts.end());
+  std::sort(level.newEdges.begin(), level.newEdges.end());
+  const ContextId frozenCount = ContextId(level.frozen.nodeCount());
+  const auto tokenLessThan = [&vocabulary](TokenId a, TokenId b) {
+    return vocabulary.lessThan(a, b);
+  };
+  QVector<TokenId> successors;
+  int e = 0;
+  foreach (ContextId context, contexts) {
+    successors.clear();
+    if (context < frozenCount) {
+      const MarkovFrozenChain::Edges &edges = level.frozen.edges(context);
+      for (int i = 0; i < edges.degree; ++i) {
+        successors.append(edges.target(i));
+      }
+    }
+    const int oldCount = successors.size();
+    while (e < level.newEdges.size() && ContextId(level.newEdges.at(e) >> 32) == context) {
+      successors.append(TokenId(level.newEdges.at(e++)));
+    }
+    std::sort(successors.begin() + oldCount, successors.end(), tokenLessThan);
+    std::inplace_merge(successors.begin(), successors.begin() + oldCount, successors.end(), tokenLessThan);
+    if (context < frozenCount) {
+      level.frozen.reopenNode(context);
+    }
+    else {
+      while (ContextId(level.frozen.nodeCount()) < context) {
+        level.frozen.closeNode();
+      }
+    }
+    foreach (TokenId successor, successors) {
+      const int slot = probe(level.edgeKeys, makeKey(context, successor));
+      level.frozen.addEdge(successor, level.edgeCounts.at(slot));
+    }
+    level.frozen.closeNode();
+  }
+  while (level.frozen.nodeCount() < level.contextCount) {
+    level.frozen.closeNode();
+  }
+  level.dirtyContexts.clear();
+  level.newEdges.clear();
+}
+
+
+void MarkovContextModel::setSamplingMode(MarkovFrozenChain::SamplingMode mode)
+{
+  mSamplingMode = mode;
+  for (int i = 0; i < mLevels.size(); ++i) {
+    mLevels[i].frozen.setSamplingMode(mode);
+  }
+}
+
+
+MarkovContextModel::ContextId MarkovContextModel::findContext(int order, ContextId parent, TokenId token) const
+{
+  const Level &level = mLevels.at(order - 2);
+  const quint64 key = makeKey(parent, token);
+  const int slot = probe(level.contextKeys, key);
+  return level.contextKeys.at(slot) == key ? level.contextIds.at(slot) : InvalidContext;
+}
+
+
+MarkovContextModel::TokenId MarkovContextModel::selectSuccessor(const TokenId *history, int length, qreal p) const
+{
+  if (length < 2 || mOrder < 2)
+    return MarkovVocabulary::InvalidId;
+  ContextId contexts[MaxOrder + 1];
+  int depth = 1;
+  ContextId context = history[length - 1];
+  for (int order = 2; order <= mOrder && order <= length; ++order) {
+    context = findContext(order, context, history[length - order]);
+    if (context == InvalidContext)
+      break;
+    contexts[order] = context;
+    depth = order;
+  }
+  // back off to shorter contexts until one has been frozen with successors
+  for (int order = depth; order >= 2; --order) {
+    const TokenId successor = mLevels.at(order - 2).frozen.selectSuccessor(contexts[order], p);
+    if (successor != MarkovVocabulary::InvalidId)
+      return successor;
+  }
+  return MarkovVocabulary::InvalidId;
+}
+
+
+int MarkovContextModel::contextCount(int order) const
+{
+  return order >= 2 && order <= collectedOrder() ? mLevels.at(order - 2).contextCount : 0;
+}
+
+
+int MarkovContextModel::ngramCount(int order) const
+{
+  return order >= 2 && order <= collectedOrder() ? mLevels.at(order - 2).edgeCount : 0;
+}
+
+
+qint64 MarkovContextModel::memoryUsage(void) const
+{
+  qint64 bytes = 0;
+  foreach (const Level &level, mLevels) {
+    bytes += qint64(sizeof(quint64) + sizeof(ContextId)) * level.contextKeys.size();
+    bytes += qint64(sizeof(quint64) + sizeof(quint32)) * level.edgeKeys.size();
+    bytes += qint64(sizeof(ContextId)) * level.dirtyContexts.size() + qint64(sizeof(quint64)) * level.newEdges.size();
+    bytes += level.frozen.memoryUsage();
+  }
+  return bytes;
+}
+
+
+// `component` holds the order, then every level takes two.
+void MarkovContextModel::writeTo(MarkovSnapshot &snapshot, quint32 component) const
+{
+  snapshot.addSection(MarkovSnapshot::tag(component, OrderField), &mOrder, 1);
+  for (int i = 0; i < mLevels.size(); ++i) {
+    const Level &level = mLevels.at(i);
+    const quint32 tables = component + 1 + 2 * quint32(i);
+    snapshot.addSection(MarkovSnapshot::tag(tables, ContextCountField), &level.contextCount, 1);
+    snapshot.addSection(MarkovSnapshot::tag(tables, EdgeCountField), &level.edgeCount, 1);
+    snapshot.addSection(MarkovSnapshot::tag(tables, ContextKeysField), level.contextKeys);
+    snapshot.addSection(MarkovSnapshot::tag(tables, ContextIdsField), level.contextIds);
+    snapshot.addSection(MarkovSnapshot::tag(tables, EdgeKeysField), level.edgeKeys);
+    snapshot.addSection(MarkovSnapshot::tag(tables, EdgeCountsField), level.edgeCounts);
+    level.frozen.writeTo(snapshot, tables + 1);
+  }
+}
+
+
+template <typename T>
+bool MarkovContextModel::copySection(const MarkovSnapshot &snapshot, quint32 tag, QVector<T> &values)
+{
+  // read, not mapped, so that a paged snapshot does not keep a copy, too
+  const int count = snapshot.elementCount(tag, int(sizeof(T)));
+  if (count <= 0 || (count & (count - 1)) != 0)
+    return false;
+  values.resize(count);
+  return snapshot.read(tag, int(sizeof(T)), 0, count, values.data());
+}
+
+
+// The frozen chains are used in place, the hash tables are copied.
+bool MarkovContextModel::attach(const QSharedPointer<MarkovSnapshot> &snapshot, quint32 component, int tokenCount)
+{
+  const int *order = snapshot->section<int>(MarkovSnapshot::tag(component, OrderField));
+  if (order == Q_NULLPTR || *order < 1 || *order > MaxOrder)
+    return false;
+  // levels above the order are stored as well
+  int levelCount = 0;
+  while (levelCount < MaxOrder - 1 && snapshot->contains(MarkovSnapshot::tag(component + 1 + 2 * quint32(levelCount), ContextCountField))) {
+    ++levelCount;
+  }
+  if (levelCount < *order - 1)
+    return false;
+  QVector<Level> levels(levelCount);
+  for (int i = 0; i < levels.size(); ++i) {
+    Level &level = levels[i];
+    const quint32 tables = component + 1 + 2 * quint32(i);
+    const int *contextCount = snapshot->section<int>(MarkovSnapshot::tag(tables, ContextCountField));
+    const int *edgeCount = snapshot->section<int>(MarkovSnapshot::tag(tables, EdgeCountField));
+    if (contextCount == Q_NULLPTR || edgeCount == Q_NULLPTR
+        || !copySection(*snapshot, MarkovSnapshot::tag(tables, ContextKeysField), level.contextKeys)
+        || !copySection(*snapshot, MarkovSnapshot::tag(tables, ContextIdsField), level.contextIds)
+        || !copySection(*snapshot, MarkovSnapshot::tag(tables, EdgeKeysField), level.edgeKeys)
+        || !copySection(*snapshot, MarkovSnapshot::tag(tables, EdgeCountsField), level.edgeCounts)
+        || level.contextIds.size() != level.contextKeys.size()
+        || level.edgeCounts.size() != level.edgeKeys.size()
+        || !level.frozen.attach(snapshot, tables + 1, tokenCount))
+      return false;
+    level.contextCount = *contextCount;
+    level.edgeCount = *edgeCount;
+    level.frozen.setSamplingMode(mSamplingMode);
+  }
+  mOrder = *order;
+  mLevels.swap(levels);
+  return true;
+}
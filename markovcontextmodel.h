@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVCONTEXTMODEL_H_
+#define __MARKOVCONTEXTMODEL_H_
+
+#include <QtGlobal>
+#include <QVector>
+
+#include "markovvocabulary.h"
+#include "markovfrozenchain.h"
+
+
+// Successor counts for contexts of two and more tokens. An order-j
+// context is its order-(j-1) parent and the token before it, so backing
+// off means taking the parent. Contexts above the order are kept.
+class MarkovContextModel {
+public:
+  typedef MarkovVocabulary::TokenId TokenId;
+  typedef quint32 ContextId;
+  static const ContextId InvalidContext = 0xffffffffU;
+  static const int MaxOrder = 5;
+
+  MarkovContextModel(void);
+
+  void setOrder(int order);
+  int order(void) const;
+  int collectedOrder(void) const;
+  void clear(void);
+
+  void addTransition(const TokenId *history, int length, TokenId successor);
+  void merge(const MarkovContextModel &other, const QVector<TokenId> &tokenMap);
+  void prune(const QVector<TokenId> &tokenMap, quint32 minCount, int topK = 0);
+  void freeze(const QVector<quint32> &rank);
+  void quantize(void);
+  void freezeDirty(const MarkovVocabulary &vocabulary);
+  bool isCompact(void) const;
+  void setSamplingMode(MarkovFrozenChain::SamplingMode mode);
+
+  ContextId findContext(int order, ContextId parent, TokenId token) const;
+  TokenId selectSuccessor(const TokenId *history, int length, qreal p) const;
+
+  int contextCount(int order) const;
+  int ngramCount(int order) const;
+  qint64 memoryUsage(void) const;
+
+  void writeTo(MarkovSnapshot &snapshot, quint32 component) const;
+  bool attach(const QSharedPointer<MarkovSnapshot> &snapshot, quint32 component, int tokenCount);
+
+private:
+  enum SnapshotField {
+    OrderField,
+    ContextKeysField,
+    ContextIdsField,
+    EdgeKeysField,
+    EdgeCountsField,
+    ContextCountField,
+    EdgeCountField
+  };
+
+  struct Level {
+    Level(void);
+    // (parent context << 32 | preceding token) -> context ID
+    QVector<quint64> contextKeys;
+    QVector<ContextId> contextIds;
+    int contextCount;
+    // (context << 32 | successor token) -> count
+    QVector<quint64> edgeKeys;
+    QVector<quint32> edgeCounts;
+    int edgeCount;
+    MarkovFrozenChain frozen;
+    // what freezeDirty() repacks, unless too much to track
+    QVector<ContextId> dirtyContexts;
+    QVector<quint64> newEdges;
+    bool dirtyOverflow;
+  };
+
+  static const quint64 EmptyKey = Q_UINT64_C(0xffffffffffffffff);
+  static quint64 makeKey(quint32 hi, quint32 lo);
+  static int probe(const QVector<quint64> &keys, quint64 key);
+  template <typename T>
+  static void grow(QVector<quint64> &keys, QVector<T> &values);
+  template <typename T>
+  static bool copySection(const MarkovSnapshot &snapshot, quint32 tag, QVector<T> &values);
+
+  template <typename LessThan>
+  static void freezeLevel(Level &level, LessThan tokenLessThan);
+  static void freezeDirtyLevel(Level &level, const MarkovVocabulary &vocabulary);
+  static void markDirty(Level &level, quint64 edgeKey, bool newEdge);
+
+  void addLevels(int order);
+  ContextId internContext(Level &level, ContextId parent, TokenId token);
+  void addEdge(Level &level, ContextId context, TokenId successor, quint32 count);
+
+  int mOrder;
+  MarkovFrozenChain::SamplingMode mSamplingMode;
+  // mLevels[j - 2] holds the order-j contexts
+  QVector<Level> mLevels;
+};
+
+
+#endif // __MARKOVCONTEXTMODEL_H_
@@ -6,20 +6,18 @@
 
 
 #include "markovedge.h"
-#include "markovnode.h"
 
-MarkovEdge::MarkovEdge(MarkovNode *node, int count)
-  : mNode(node)
+MarkovEdge::MarkovEdge(MarkovVocabulary::TokenId target, int count)
+  : mTarget(target)
   , mCount(count)
-  , mProbability(1.0)
 {
   /* ... */
 }
 
 
-MarkovNode *MarkovEdge::node(void)
+MarkovVocabulary::TokenId MarkovEdge::target(void) const
 {
-  return mNode;
+  return mTarget;
 }
 
 
@@ -35,25 +33,8 @@ void MarkovEdge::setCount(int count)
 }
 
 
-qreal MarkovEdge::p(void) const
-{
-  return mProbability;
-}
-
-
-void MarkovEdge::setProbability(qreal p)
-{
-  mProbability = p;
-}
-
-
 void MarkovEdge::increaseCount(void)
 {
   ++mCount;
 }
 
-
-QString MarkovEdge::toString(void) const
-{
-  return QString("%1 %2").arg(mCount).arg(mNode->token());
-}
@@ -9,29 +9,27 @@
 #define __MARKOVEDGE_H_
 
 #include <QtGlobal>
-#include <QString>
 
-class MarkovNode;
+#include "markovvocabulary.h"
+#include "markovpool.h"
 
 class MarkovEdge {
 public:
-  explicit MarkovEdge(MarkovNode*, int count = 1);
+  explicit MarkovEdge(MarkovVocabulary::TokenId target, int count = 1);
 
-  MarkovNode *node(void);
+  MarkovVocabulary::TokenId target(void) const;
   int count(void) const;
   void setCount(int);
-  qreal p(void) const;
-  void setProbability(qreal p);
   void increaseCount(void);
 
-  QString toString(void) const;
-
 private:
-  MarkovNode *mNode;
+  MarkovVocabulary::TokenId mTarget;
   int mCount;
-  qreal mProbability;
 };
 
 
+typedef MarkovPool<MarkovEdge> MarkovEdgePool;
+
+
 #endif // __MARKOVEDGE_H_
 
@@ -0,0 +1,846 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovfrozenchain.h"
+
+#include <QMap>
+
+#include <algorithm>
+
+const quint32 MarkovFrozenChain::MaxQuantizedTotal;
+const int MarkovFrozenChain::LockstepWidth;
+
+
+// index of the edge in [first, last) that the draw `p` falls on
+template <typename Count>
+static int drawCumulative(const Count *cumulative, int first, int last, qreal p)
+{
+  const quint32 total = cumulative[last - 1];
+  const quint32 r = qMin(quint32(p * total), total - 1);
+  return int(std::upper_bound(cumulative + first, cumulative + last, r) - cumulative);
+}
+
+
+static inline void prefetch(const void *address)
+{
+#if defined(Q_CC_GNU) || defined(Q_CC_CLANG)
+  __builtin_prefetch(address);
+#else
+  Q_UNUSED(address);
+#endif
+}
+
+
+// Whether the targets and aliases of a node stay within the chain.
+static bool isValidNode(const MarkovFrozenChain::TokenId *targets, const quint32 *alias, int degree, int tokenCount)
+{
+  for (int i = 0; i < degree; ++i) {
+    if (targets[i] >= quint32(tokenCount) || alias[i] >= quint32(degree))
+      return false;
+  }
+  return true;
+}
+
+
+// drawCumulative() for n draws at once, as interleaved branchless searches.
+template <typename Count>
+static void drawCumulative(const Count *cumulative, const int *first, const int *degree, const qreal *p, int *edge, int n)
+{
+  quint32 r[MarkovFrozenChain::LockstepWidth];
+  int length[MarkovFrozenChain::LockstepWidth];
+  bool searching = false;
+  for (int i = 0; i < n; ++i) {
+    edge[i] = first[i];
+    length[i] = degree[i];
+    if (degree[i] == 0)
+      continue;
+    const quint32 total = cumulative[first[i] + degree[i] - 1];
+    r[i] = qMin(quint32(p[i] * total), total - 1);
+    prefetch(cumulative + first[i] + degree[i] / 2);
+    searching = searching || length[i] > 1;
+  }
+  while (searching) {
+    searching = false;
+    for (int i = 0; i < n; ++i) {
+      if (length[i] <= 1)
+        continue;
+      const int half = length[i] / 2;
+      edge[i] = (cumulative[edge[i] + half] <= r[i]) ? edge[i] + half : edge[i];
+      length[i] -= half;
+      prefetch(cumulative + edge[i] + length[i] / 2);
+      searching = searching || length[i] > 1;
+    }
+  }
+  // the first edge whose cumulative count exceeds r, like upper_bound()
+  for (int i = 0; i < n; ++i) {
+    if (degree[i] > 0 && cumulative[edge[i]] <= r[i]) {
+      ++edge[i];
+    }
+  }
+}
+
+
+MarkovFrozenChain::MarkovFrozenChain(void)
+  : mSamplingMode(AliasSampling)
+  , mQuantized(false)
+  , mReopened(MarkovVocabulary::InvalidId)
+  , mGarbage(0)
+  , mReopenCount(0)
+  , mPagedOffsets(Q_NULLPTR)
+  , mPagedNodeCount(0)
+  , mEdgeBase(0)
+  , mPagedTokenCount(0)
+{
+  clear();
+}
+
+
+void MarkovFrozenChain::clear(void)
+{
+  mOffsets.clear();
+  mOffsets.append(0);
+  mEnds.clear();
+  mTargets.clear();
+  mCounts.clear();
+  mCumulative.clear();
+  mQuantizedCounts.clear();
+  mQuantizedCumulative.clear();
+  mAliasProbability.clear();
+  mAlias.clear();
+  mStartTargets.clear();
+  mStartAliasProbability.clear();
+  mStartAlias.clear();
+  mOrder.clear();
+  mSnapshot.clear();
+  mQuantized = false;
+  mReopened = MarkovVocabulary::InvalidId;
+  mGarbage = 0;
+  mReopenCount = 0;
+  mPagedOffsets = Q_NULLPTR;
+  mPagedNodeCount = 0;
+  mEdgeBase = 0;
+  mPagedTokenCount = 0;
+  mArrays.paged = false;
+  updateArrays();
+}
+
+
+void MarkovFrozenChain::swap(MarkovFrozenChain &other)
+{
+  mOffsets.swap(other.mOffsets);
+  mEnds.swap(other.mEnds);
+  mTargets.swap(other.mTargets);
+  mCounts.swap(other.mCounts);
+  mCumulative.swap(other.mCumulative);
+  mQuantizedCounts.swap(other.mQuantizedCounts);
+  mQuantizedCumulative.swap(other.mQuantizedCumulative);
+  mAliasProbability.swap(other.mAliasProbability);
+  mAlias.swap(other.mAlias);
+  mStartTargets.swap(other.mStartTargets);
+  mStartAliasProbability.swap(other.mStartAliasProbability);
+  mStartAlias.swap(other.mStartAlias);
+  mOrder.swap(other.mOrder);
+  mSnapshot.swap(other.mSnapshot);
+  qSwap(mQuantized, other.mQuantized);
+  qSwap(mReopened, other.mReopened);
+  qSwap(mGarbage, other.mGarbage);
+  qSwap(mReopenCount, other.mReopenCount);
+  qSwap(mArrays, other.mArrays);
+  qSwap(mPagedOffsets, other.mPagedOffsets);
+  qSwap(mPagedNodeCount, other.mPagedNodeCount);
+  qSwap(mEdgeBase, other.mEdgeBase);
+  qSwap(mPagedTokenCount, other.mPagedTokenCount);
+}
+
+
+void MarkovFrozenChain::updateArrays(void)
+{
+  const bool paged = mArrays.paged;
+  mArrays.offsets = mOffsets.constData();
+  mArrays.ends = mEnds.constData();
+  mArrays.targets = mTargets.constData();
+  mArrays.counts = mCounts.constData();
+  mArrays.cumulative = mCumulative.constData();
+  mArrays.quantizedCounts = mQuantizedCounts.constData();
+  mArrays.quantizedCumulative = mQuantizedCumulative.constData();
+  mArrays.aliasProbability = mAliasProbability.constData();
+  mArrays.alias = mAlias.constData();
+  mArrays.startTargets = mStartTargets.constData();
+  mArrays.startAliasProbability = mStartAliasProbability.constData();
+  mArrays.startAlias = mStartAlias.constData();
+  mArrays.order = mOrder.constData();
+  mArrays.nodeCount = mOffsets.size() - 1;
+  mArrays.edgeCount = mEdgeBase + mTargets.size();
+  mArrays.startCount = mStartTargets.size();
+  mArrays.orderCount = mOrder.size();
+  mArrays.quantized = mQuantized;
+  mArrays.paged = paged;
+  if (!paged) {
+    mArrays.pageKey = 0;
+  }
+}
+
+
+// Copies the node arrays of a paged chain into the vectors, so that nodes
+// can be added. The edges from mEdgeBase on go into the vectors.
+void MarkovFrozenChain::detachPaged(void)
+{
+  const Arrays &a = mArrays;
+  if (!a.paged || a.offsets == mOffsets.constData())
+    return;
+  Q_ASSERT(!a.quantized);
+  mOffsets.resize(a.nodeCount + 1);
+  std::copy(a.offsets, a.offsets + a.nodeCount + 1, mOffsets.begin());
+  mEnds.resize(a.nodeCount);
+  std::copy(a.ends, a.ends + a.nodeCount, mEnds.begin());
+  mStartTargets.resize(a.startCount);
+  std::copy(a.startTargets, a.startTargets + a.startCount, mStartTargets.begin());
+  mStartAliasProbability.resize(a.startCount);
+  std::copy(a.startAliasProbability, a.startAliasProbability + a.startCount, mStartAliasProbability.begin());
+  mStartAlias.resize(a.startCount);
+  std::copy(a.startAlias, a.startAlias + a.startCount, mStartAlias.begin());
+  mOrder.resize(a.orderCount);
+  std::copy(a.order, a.order + a.orderCount, mOrder.begin());
+  updateArrays();
+}
+
+
+void MarkovFrozenChain::addEdge(TokenId target, quint32 count)
+{
+  Q_ASSERT(!mQuantized);
+  detachPaged();
+  const bool firstOfNode = mEdgeBase + mTargets.size() == int(mOffsets.last());
+  mTargets.append(target);
+  mCounts.append(count);
+  mCumulative.append(firstOfNode ? count : mCumulative.last() + count);
+}
+
+
+void MarkovFrozenChain::closeNode(void)
+{
+  detachPaged();
+  const int first = int(mOffsets.last());
+  const int local = first - mEdgeBase;
+  const int degree = mTargets.size() - local;
+  const quint32 last = quint32(mEdgeBase + mTargets.size());
+  mAliasProbability.resize(mTargets.size());
+  mAlias.resize(mTargets.size());
+  buildAliasTable(mCounts.constData() + local, degree, mAliasProbability.data() + local, mAlias.data() + local);
+  if (mReopened != MarkovVocabulary::InvalidId) {
+    const int id = int(mReopened);
+    mGarbage += int(mEnds.at(id) - mOffsets.at(id));
+    ++mReopenCount;
+    mOffsets[id] = quint32(first);
+    mEnds[id] = last;
+    mOffsets.last() = last;
+    mReopened = MarkovVocabulary::InvalidId;
+  }
+  else {
+    mOffsets.append(last);
+    mEnds.append(last);
+  }
+  updateArrays();
+}
+
+
+// The edges added from now on up to the next closeNode() replace those
+// of node `id`, which must have been closed before.
+void MarkovFrozenChain::reopenNode(TokenId id)
+{
+  Q_ASSERT((mSnapshot.isNull() || mArrays.paged) && !mArrays.quantized && int(id) < nodeCount() && mReopened == MarkovVocabulary::InvalidId);
+  detachPaged();
+  mReopened = id;
+}
+
+
+void MarkovFrozenChain::appendNode(const MarkovFrozenChain &other, TokenId id)
+{
+  Q_ASSERT(!mQuantized);
+  const Edges &src = other.edges(id);
+  for (int i = 0; i < src.degree; ++i) {
+    mTargets.append(src.targets[i]);
+    mCounts.append(src.counts != Q_NULLPTR ? src.counts[i] : src.quantizedCounts[i]);
+    mCumulative.append(src.cumulative != Q_NULLPTR ? src.cumulative[i] : src.quantizedCumulative[i]);
+    mAliasProbability.append(src.aliasProbability[i]);
+    mAlias.append(src.alias[i]);
+  }
+  mOffsets.append(quint32(mTargets.size()));
+  mEnds.append(quint32(mTargets.size()));
+  updateArrays();
+}
+
+
+// Stores the counts in 16 bits, scaling down nodes whose total exceeds
+// MaxQuantizedTotal. Returns the mass moved between successors.
+qreal MarkovFrozenChain::quantize(void)
+{
+  Q_ASSERT(isCompact() && !isMapped() && !mQuantized);
+  mQuantizedCounts.resize(mCounts.size());
+  mQuantizedCumulative.resize(mCounts.size());
+  qreal moved = 0;
+  for (int i = 0; i < nodeCount(); ++i) {
+    const int first = int(mOffsets.at(i));
+    const int last = int(mEnds.at(i));
+    const int degree = last - first;
+    const quint64 total = first < last ? mCumulative.at(last - 1) : 0;
+    const bool scaled = total > MaxQuantizedTotal;
+    const quint64 minimum = quint64(degree) <= MaxQuantizedTotal ? 1 : 0;
+    const quint64 budget = MaxQuantizedTotal - minimum * quint64(degree);
+    quint32 sum = 0;
+    for (int edge = first; edge < last; ++edge) {
+      const quint32 count = scaled ? quint32(qMax(minimum, mCounts.at(edge) * budget / total)) : mCounts.at(edge);
+      sum += count;
+      mQuantizedCounts[edge] = quint16(count);
+      mQuantizedCumulative[edge] = quint16(sum);
+    }
+    if (sum == 0 && degree > 0) {
+      // all edges too rare to keep a count: keep the most frequent one
+      const int kept = int(std::max_element(mCounts.constBegin() + first, mCounts.constBegin() + last) - mCounts.constBegin());
+      mQuantizedCounts[kept] = 1;
+      sum = 1;
+      for (int edge = kept; edge < last; ++edge) {
+        mQuantizedCumulative[edge] = 1;
+      }
+    }
+    if (!scaled)
+      continue;
+    qreal distance = 0;
+    for (int edge = first; edge < last; ++edge) {
+      distance += qAbs(qreal(mCounts.at(edge)) / total - qreal(mQuantizedCounts.at(edge)) / sum);
+      mCounts[edge] = mQuantizedCounts.at(edge);
+    }
+    moved += distance / 2 * total;
+    buildAliasTable(mCounts.constData() + first, degree, mAliasProbability.data() + first, mAlias.data() + first);
+  }
+  mCounts = QVector<quint32>();
+  mCumulative = QVector<quint32>();
+  mQuantized = true;
+  updateArrays();
+  return moved;
+}
+
+
+void MarkovFrozenChain::buildAliasTable(const quint32 *counts, int n, float *probability, quint32 *alias)
+{
+  // Vose's method in integer arithmetic
+  quint64 total = 0;
+  for (int i = 0; i < n; ++i) {
+    total += counts[i];
+  }
+  mScaled.resize(n);
+  mSmall.clear();
+  mLarge.clear();
+  for (int i = 0; i < n; ++i) {
+    mScaled[i] = quint64(counts[i]) * quint64(n);
+    if (mScaled.at(i) < total) {
+      mSmall.append(i);
+    }
+    else {
+      mLarge.append(i);
+    }
+  }
+  while (!mSmall.isEmpty() && !mLarge.isEmpty()) {
+    const int s = mSmall.takeLast();
+    const int l = mLarge.last();
+    probability[s] = float(qreal(mScaled.at(s)) / qreal(total));
+    alias[s] = quint32(l);
+    mScaled[l] -= total - mScaled.at(s);
+    if (mScaled.at(l) < total) {
+      mLarge.removeLast();
+      mSmall.append(l);
+    }
+  }
+  foreach (int i, mLarge) {
+    probability[i] = 1.f;
+    alias[i] = quint32(i);
+  }
+  foreach (int i, mSmall) {
+    probability[i] = 1.f;
+    alias[i] = quint32(i);
+  }
+}
+
+
+// Ordered by token, so that seeded walks don't depend on the numbering.
+void MarkovFrozenChain::buildSentenceStarts(const QVector<TokenId> &terminators, const MarkovVocabulary &vocabulary)
+{
+  detachPaged();
+  QMap<TokenId, quint32> starts;
+  foreach (TokenId id, terminators) {
+    if (id != MarkovVocabulary::InvalidId && int(id) < nodeCount()) {
+      const Edges &e = edges(id);
+      for (int i = 0; i < e.degree; ++i) {
+        starts[e.target(i)] += e.count(i);
+      }
+    }
+  }
+  mStartTargets = starts.keys().toVector();
+  std::sort(mStartTargets.begin(), mStartTargets.end(), [&vocabulary](TokenId a, TokenId b) {
+    return vocabulary.lessThan(a, b);
+  });
+  QVector<quint32> counts;
+  counts.reserve(mStartTargets.size());
+  foreach (TokenId id, mStartTargets) {
+    counts.append(starts.value(id));
+  }
+  mStartAliasProbability.resize(counts.size());
+  mStartAlias.resize(counts.size());
+  buildAliasTable(counts.constData(), counts.size(), mStartAliasProbability.data(), mStartAlias.data());
+  updateArrays();
+}
+
+
+void MarkovFrozenChain::setOrder(const QVector<TokenId> &order)
+{
+  detachPaged();
+  mOrder = order;
+  updateArrays();
+}
+
+
+void MarkovFrozenChain::setSamplingMode(SamplingMode mode)
+{
+  mSamplingMode = mode;
+}
+
+
+MarkovFrozenChain::SamplingMode MarkovFrozenChain::samplingMode(void) const
+{
+  return mSamplingMode;
+}
+
+
+int MarkovFrozenChain::nodeCount(void) const
+{
+  return mArrays.nodeCount;
+}
+
+
+int MarkovFrozenChain::edgeCount(void) const
+{
+  return mArrays.edgeCount;
+}
+
+
+int MarkovFrozenChain::garbageCount(void) const
+{
+  return mGarbage;
+}
+
+
+// Whether the offsets alone describe the edges.
+bool MarkovFrozenChain::isCompact(void) const
+{
+  return mReopenCount == 0;
+}
+
+
+bool MarkovFrozenChain::isMapped(void) const
+{
+  return !mSnapshot.isNull();
+}
+
+
+bool MarkovFrozenChain::isPaged(void) const
+{
+  return mArrays.paged;
+}
+
+
+bool MarkovFrozenChain::isQuantized(void) const
+{
+  return mArrays.quantized;
+}
+
+
+qint64 MarkovFrozenChain::memoryUsage(void) const
+{
+  const Arrays &a = mArrays;
+  // offsets and ends are held in memory unless mapped
+  const qint64 perNode = qint64(sizeof(quint32)) * (a.offsets == mOffsets.constData() ? 2 : 1);
+  const qint64 countSize = qint64(a.quantized ? sizeof(quint16) : sizeof(quint32));
+  const qint64 perEdge = qint64(sizeof(TokenId) + sizeof(quint32) + sizeof(float)) + 2 * countSize;
+  const qint64 perStart = qint64(sizeof(TokenId) + sizeof(float) + sizeof(quint32));
+  // the pages of a paged chain are accounted for by the snapshot
+  return perNode * (a.nodeCount + 1) + perEdge * (a.edgeCount - mEdgeBase) + perStart * a.startCount + qint64(sizeof(TokenId)) * a.orderCount;
+}
+
+
+int MarkovFrozenChain::begin(TokenId id) const
+{
+  return int(mArrays.offsets[id]);
+}
+
+
+int MarkovFrozenChain::end(TokenId id) const
+{
+  return int(mArrays.ends[id]);
+}
+
+
+// Slow on a paged chain, see edges().
+MarkovFrozenChain::TokenId MarkovFrozenChain::target(int edge) const
+{
+  if (edge < mEdgeBase) {
+    const TokenId id = nodeOf(edge);
+    return pageIn(id).target(edge - int(mPagedOffsets[id]));
+  }
+  return mArrays.targets[edge - mEdgeBase];
+}
+
+
+quint32 MarkovFrozenChain::count(int edge) const
+{
+  if (edge < mEdgeBase) {
+    const TokenId id = nodeOf(edge);
+    return pageIn(id).count(edge - int(mPagedOffsets[id]));
+  }
+  return mArrays.quantized ? mArrays.quantizedCounts[edge - mEdgeBase] : mArrays.counts[edge - mEdgeBase];
+}
+
+
+MarkovFrozenChain::TokenId MarkovFrozenChain::Edges::target(int i) const
+{
+  return targets[i];
+}
+
+
+quint32 MarkovFrozenChain::Edges::count(int i) const
+{
+  return quantizedCounts != Q_NULLPTR ? quantizedCounts[i] : counts[i];
+}
+
+
+// The edges of node `id`, paged in if need be.
+MarkovFrozenChain::Edges MarkovFrozenChain::edges(TokenId id) const
+{
+  const Arrays &a = mArrays;
+  const int degree = end(id) - begin(id);
+  if (degree > 0 && begin(id) < mEdgeBase)
+    return pageIn(id);
+  const int first = degree > 0 ? begin(id) - mEdgeBase : 0;
+  Edges e;
+  e.targets = a.targets + first;
+  e.counts = a.quantized ? Q_NULLPTR : a.counts + first;
+  e.cumulative = a.quantized ? Q_NULLPTR : a.cumulative + first;
+  e.quantizedCounts = a.quantized ? a.quantizedCounts + first : Q_NULLPTR;
+  e.quantizedCumulative = a.quantized ? a.quantizedCumulative + first : Q_NULLPTR;
+  e.aliasProbability = a.aliasProbability + first;
+  e.alias = a.alias + first;
+  e.degree = degree;
+  return e;
+}
+
+
+// A node whose page cannot be read or is invalid has no successors.
+MarkovFrozenChain::Edges MarkovFrozenChain::pageIn(TokenId id) const
+{
+  const Arrays &a = mArrays;
+  const int first = int(mPagedOffsets[id]);
+  const int degree = int(mPagedOffsets[id + 1]) - first;
+  const int countSize = a.quantized ? int(sizeof(quint16)) : int(sizeof(quint32));
+  const int stride = int(sizeof(TokenId) + sizeof(quint32) + sizeof(float)) + 2 * countSize;
+  const quint32 component = quint32(a.pageKey >> 32);
+  const quint64 key = a.pageKey | quint64(id);
+  Edges e;
+  e.page = mSnapshot->page(key);
+  if (e.page.isNull()) {
+    QByteArray *data = new QByteArray(degree * stride, Qt::Uninitialized);
+    char *p = data->data();
+    const bool ok = mSnapshot->read(MarkovSnapshot::tag(component, TargetsField), int(sizeof(TokenId)), first, degree, p)
+        && mSnapshot->read(MarkovSnapshot::tag(component, AliasField), int(sizeof(quint32)), first, degree, p + degree * int(sizeof(TokenId)))
+        && mSnapshot->read(MarkovSnapshot::tag(component, AliasProbabilityField), int(sizeof(float)), first, degree, p + degree * int(sizeof(TokenId) + sizeof(quint32)))
+        && mSnapshot->read(MarkovSnapshot::tag(component, a.quantized ? QuantizedCountsField : CountsField), countSize, first, degree, p + degree * int(sizeof(TokenId) + sizeof(quint32) + sizeof(float)))
+        && mSnapshot->read(MarkovSnapshot::tag(component, a.quantized ? QuantizedCumulativeField : CumulativeField), countSize, first, degree, p + degree * (stride - countSize))
+        && isValidNode(reinterpret_cast<const TokenId*>(p), reinterpret_cast<const quint32*>(p + degree * int(sizeof(TokenId))), degree, mPagedTokenCount);
+    if (!ok) {
+      qWarning("MarkovFrozenChain: cannot page in the edges of node %u", id);
+      data->clear();
+    }
+    e.page = QSharedPointer<const QByteArray>(data);
+    if (ok) {
+      mSnapshot->insertPage(key, e.page);
+    }
+  }
+  const int n = e.page->isEmpty() ? 0 : degree;
+  const char *p = e.page->constData();
+  e.targets = reinterpret_cast<const TokenId*>(p);
+  e.alias = reinterpret_cast<const quint32*>(p + n * int(sizeof(TokenId)));
+  e.aliasProbability = reinterpret_cast<const float*>(p + n * int(sizeof(TokenId) + sizeof(quint32)));
+  const char *counts = p + n * int(sizeof(TokenId) + sizeof(quint32) + sizeof(float));
+  const char *cumulative = counts + n * countSize;
+  e.counts = a.quantized ? Q_NULLPTR : reinterpret_cast<const quint32*>(counts);
+  e.cumulative = a.quantized ? Q_NULLPTR : reinterpret_cast<const quint32*>(cumulative);
+  e.quantizedCounts = a.quantized ? reinterpret_cast<const quint16*>(counts) : Q_NULLPTR;
+  e.quantizedCumulative = a.quantized ? reinterpret_cast<const quint16*>(cumulative) : Q_NULLPTR;
+  e.degree = n;
+  return e;
+}
+
+
+// The node in the paged snapshot whose edges include `edge`.
+MarkovFrozenChain::TokenId MarkovFrozenChain::nodeOf(int edge) const
+{
+  const quint32 *offsets = mPagedOffsets;
+  return TokenId(std::upper_bound(offsets, offsets + mPagedNodeCount + 1, quint32(edge)) - offsets - 1);
+}
+
+
+quint32 MarkovFrozenChain::totalCount(TokenId id) const
+{
+  if (begin(id) == end(id))
+    return 0;
+  const Edges &e = edges(id);
+  if (e.degree == 0)
+    return 0;
+  return e.quantizedCumulative != Q_NULLPTR ? e.quantizedCumulative[e.degree - 1] : e.cumulative[e.degree - 1];
+}
+
+
+const MarkovFrozenChain::TokenId *MarkovFrozenChain::order(void) const
+{
+  return mArrays.order;
+}
+
+
+int MarkovFrozenChain::orderCount(void) const
+{
+  return mArrays.orderCount;
+}
+
+
+MarkovFrozenChain::TokenId MarkovFrozenChain::selectSuccessor(TokenId id, qreal p) const
+{
+  return mSamplingMode == AliasSampling
+      ? selectSuccessorAlias(id, p)
+      : selectSuccessorCumulative(id, p);
+}
+
+
+MarkovFrozenChain::TokenId MarkovFrozenChain::selectSuccessorCumulative(TokenId id, qreal p) const
+{
+  if (int(id) >= nodeCount() || begin(id) == end(id))
+    return MarkovVocabulary::InvalidId;
+  const Edges &e = edges(id);
+  if (e.degree == 0)
+    return MarkovVocabulary::InvalidId;
+  const int edge = e.quantizedCumulative != Q_NULLPTR
+      ? drawCumulative(e.quantizedCumulative, 0, e.degree, p)
+      : drawCumulative(e.cumulative, 0, e.degree, p);
+  return e.targets[edge];
+}
+
+
+MarkovFrozenChain::TokenId MarkovFrozenChain::selectSuccessorAlias(TokenId id, qreal p) const
+{
+  if (int(id) >= nodeCount() || begin(id) == end(id))
+    return MarkovVocabulary::InvalidId;
+  const Edges &e = edges(id);
+  const int degree = e.degree;
+  if (degree == 0)
+    return MarkovVocabulary::InvalidId;
+  const qreal x = p * degree;
+  const int bucket = qMin(int(x), degree - 1);
+  const int edge = (x - bucket < e.aliasProbability[bucket])
+      ? bucket
+      : int(e.alias[bucket]);
+  return e.targets[edge];
+}
+
+
+// Draws successors[i] of ids[i] with p[i] like selectSuccessor(), in
+// blocks of LockstepWidth whose reads are prefetched stage by stage.
+void MarkovFrozenChain::selectSuccessors(const TokenId *ids, const qreal *p, TokenId *successors, int n) const
+{
+  const Arrays &a = mArrays;
+  if (a.paged) {
+    // the time goes to reading the pages
+    for (int i = 0; i < n; ++i) {
+      successors[i] = selectSuccessor(ids[i], p[i]);
+    }
+    return;
+  }
+  int first[LockstepWidth];
+  int degree[LockstepWidth];
+  int edge[LockstepWidth];
+  for (int block = 0; block < n; block += LockstepWidth) {
+    const int m = qMin(LockstepWidth, n - block);
+    const TokenId *id = ids + block;
+    const qreal *q = p + block;
+    for (int i = 0; i < m; ++i) {
+      if (id[i] < TokenId(a.nodeCount)) {
+        prefetch(a.offsets + id[i]);
+        prefetch(a.ends + id[i]);
+      }
+    }
+    for (int i = 0; i < m; ++i) {
+      const bool valid = id[i] < TokenId(a.nodeCount);
+      first[i] = valid ? begin(id[i]) : 0;
+      degree[i] = valid ? end(id[i]) - first[i] : 0;
+    }
+    if (mSamplingMode == AliasSampling) {
+      for (int i = 0; i < m; ++i) {
+        if (degree[i] > 0) {
+          edge[i] = first[i] + qMin(int(q[i] * degree[i]), degree[i] - 1);
+          prefetch(a.aliasProbability + edge[i]);
+          prefetch(a.alias + edge[i]);
+        }
+      }
+      for (int i = 0; i < m; ++i) {
+        if (degree[i] > 0) {
+          const int bucket = edge[i] - first[i];
+          edge[i] = (q[i] * degree[i] - bucket < a.aliasProbability[edge[i]])
+              ? edge[i]
+              : first[i] + int(a.alias[edge[i]]);
+          prefetch(a.targets + edge[i]);
+        }
+      }
+    }
+    else if (a.quantized) {
+      drawCumulative(a.quantizedCumulative, first, degree, q, edge, m);
+    }
+    else {
+      drawCumulative(a.cumulative, first, degree, q, edge, m);
+    }
+    for (int i = 0; i < m; ++i) {
+      const TokenId successor = degree[i] > 0 ? a.targets[edge[i]] : MarkovVocabulary::InvalidId;
+      if (successor < TokenId(a.nodeCount)) {
+        prefetch(a.offsets + successor);
+      }
+      successors[block + i] = successor;
+    }
+  }
+}
+
+
+MarkovFrozenChain::TokenId MarkovFrozenChain::selectSentenceStart(qreal p) const
+{
+  const int n = mArrays.startCount;
+  if (n == 0)
+    return MarkovVocabulary::InvalidId;
+  const qreal x = p * n;
+  const int bucket = qMin(int(x), n - 1);
+  const int start = (x - bucket < mArrays.startAliasProbability[bucket])
+      ? bucket
+      : int(mArrays.startAlias[bucket]);
+  return mArrays.startTargets[start];
+}
+
+
+int MarkovFrozenChain::sentenceStartCount(void) const
+{
+  return mArrays.startCount;
+}
+
+
+// Only the offsets are written, so the chain must be compact.
+void MarkovFrozenChain::writeTo(MarkovSnapshot &snapshot, quint32 component) const
+{
+  Q_ASSERT(isCompact() && !isPaged());
+  const Arrays &a = mArrays;
+  snapshot.addSection(MarkovSnapshot::tag(component, OffsetsField), a.offsets, a.nodeCount + 1);
+  snapshot.addSection(MarkovSnapshot::tag(component, TargetsField), a.targets, a.edgeCount);
+  if (a.quantized) {
+    snapshot.addSection(MarkovSnapshot::tag(component, QuantizedCountsField), a.quantizedCounts, a.edgeCount);
+    snapshot.addSection(MarkovSnapshot::tag(component, QuantizedCumulativeField), a.quantizedCumulative, a.edgeCount);
+  }
+  else {
+    snapshot.addSection(MarkovSnapshot::tag(component, CountsField), a.counts, a.edgeCount);
+    snapshot.addSection(MarkovSnapshot::tag(component, CumulativeField), a.cumulative, a.edgeCount);
+  }
+  snapshot.addSection(MarkovSnapshot::tag(component, AliasProbabilityField), a.aliasProbability, a.edgeCount);
+  snapshot.addSection(MarkovSnapshot::tag(component, AliasField), a.alias, a.edgeCount);
+  snapshot.addSection(MarkovSnapshot::tag(component, StartTargetsField), a.startTargets, a.startCount);
+  snapshot.addSection(MarkovSnapshot::tag(component, StartAliasProbabilityField), a.startAliasProbability, a.startCount);
+  snapshot.addSection(MarkovSnapshot::tag(component, StartAliasField), a.startAlias, a.startCount);
+  snapshot.addSection(MarkovSnapshot::tag(component, OrderField), a.order, a.orderCount);
+}
+
+
+// Points the read accessors into the mapped `snapshot`, whose arrays must
+// stay within the chain. Paged edges are checked in pageIn().
+bool MarkovFrozenChain::attach(const QSharedPointer<MarkovSnapshot> &snapshot, quint32 component, int tokenCount)
+{
+  Arrays a;
+  int offsetCount = 0;
+  int startCounts[3];
+  a.quantized = snapshot->contains(MarkovSnapshot::tag(component, QuantizedCountsField));
+  a.paged = snapshot->isPaged();
+  a.pageKey = quint64(component) << 32;
+  const int countSize = a.quantized ? int(sizeof(quint16)) : int(sizeof(quint32));
+  const int edgeCounts[5] = {
+    snapshot->elementCount(MarkovSnapshot::tag(component, TargetsField), int(sizeof(TokenId))),
+    snapshot->elementCount(MarkovSnapshot::tag(component, a.quantized ? QuantizedCountsField : CountsField), countSize),
+    snapshot->elementCount(MarkovSnapshot::tag(component, a.quantized ? QuantizedCumulativeField : CumulativeField), countSize),
+    snapshot->elementCount(MarkovSnapshot::tag(component, AliasProbabilityField), int(sizeof(float))),
+    snapshot->elementCount(MarkovSnapshot::tag(component, AliasField), int(sizeof(quint32)))
+  };
+  a.targets = Q_NULLPTR;
+  a.counts = Q_NULLPTR;
+  a.cumulative = Q_NULLPTR;
+  a.quantizedCounts = Q_NULLPTR;
+  a.quantizedCumulative = Q_NULLPTR;
+  a.aliasProbability = Q_NULLPTR;
+  a.alias = Q_NULLPTR;
+  if (!a.paged) {
+    a.targets = snapshot->section<TokenId>(MarkovSnapshot::tag(component, TargetsField));
+    if (a.quantized) {
+      a.quantizedCounts = snapshot->section<quint16>(MarkovSnapshot::tag(component, QuantizedCountsField));
+      a.quantizedCumulative = snapshot->section<quint16>(MarkovSnapshot::tag(component, QuantizedCumulativeField));
+    }
+    else {
+      a.counts = snapshot->section<quint32>(MarkovSnapshot::tag(component, CountsField));
+      a.cumulative = snapshot->section<quint32>(MarkovSnapshot::tag(component, CumulativeField));
+    }
+    a.aliasProbability = snapshot->section<float>(MarkovSnapshot::tag(component, AliasProbabilityField));
+    a.alias = snapshot->section<quint32>(MarkovSnapshot::tag(component, AliasField));
+  }
+  a.offsets = snapshot->section<quint32>(MarkovSnapshot::tag(component, OffsetsField), &offsetCount);
+  a.startTargets = snapshot->section<TokenId>(MarkovSnapshot::tag(component, StartTargetsField), &startCounts[0]);
+  a.startAliasProbability = snapshot->section<float>(MarkovSnapshot::tag(component, StartAliasProbabilityField), &startCounts[1]);
+  a.startAlias = snapshot->section<quint32>(MarkovSnapshot::tag(component, StartAliasField), &startCounts[2]);
+  a.order = snapshot->section<TokenId>(MarkovSnapshot::tag(component, OrderField), &a.orderCount);
+  if (a.offsets == Q_NULLPTR || a.startTargets == Q_NULLPTR || a.startAliasProbability == Q_NULLPTR
+      || a.startAlias == Q_NULLPTR || a.order == Q_NULLPTR || offsetCount < 1 || edgeCounts[0] < 0)
+    return false;
+  a.ends = a.offsets + 1;
+  a.nodeCount = offsetCount - 1;
+  a.edgeCount = edgeCounts[0];
+  a.startCount = startCounts[0];
+  for (int i = 1; i < 5; ++i) {
+    if (edgeCounts[i] != a.edgeCount)
+      return false;
+  }
+  if (startCounts[1] != a.startCount || startCounts[2] != a.startCount || a.offsets[a.nodeCount] != quint32(a.edgeCount))
+    return false;
+  for (int i = 0; i < a.nodeCount; ++i) {
+    if (a.offsets[i] > a.offsets[i + 1])
+      return false;
+  }
+  if (!isValidNode(a.startTargets, a.startAlias, a.startCount, tokenCount))
+    return false;
+  for (int i = 0; i < a.orderCount; ++i) {
+    if (a.order[i] >= quint32(tokenCount))
+      return false;
+  }
+  if (!a.paged) {
+    for (int i = 0; i < a.nodeCount; ++i) {
+      const int first = int(a.offsets[i]);
+      if (!isValidNode(a.targets + first, a.alias + first, int(a.offsets[i + 1]) - first, tokenCount))
+        return false;
+    }
+  }
+  clear();
+  mArrays = a;
+  mSnapshot = snapshot;
+  if (a.paged) {
+    mPagedOffsets = a.offsets;
+    mPagedNodeCount = a.nodeCount;
+    mEdgeBase = a.edgeCount;
+    mPagedTokenCount = tokenCount;
+  }
+  return true;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVFROZENCHAIN_H_
+#define __MARKOVFROZENCHAIN_H_
+
+#include <QtGlobal>
+#include <QVector>
+#include <QByteArray>
+#include <QSharedPointer>
+
+#include "markovvocabulary.h"
+#include "markovsnapshot.h"
+
+
+// Read-optimized copy of the successor lists of a MarkovChain: the edges
+// of node `id` are [begin(id), end(id)) of flat arrays, ordered by token,
+// with an alias table per node. The arrays may also point into a mapped
+// or paged MarkovSnapshot, see attach().
+class MarkovFrozenChain {
+public:
+  typedef MarkovVocabulary::TokenId TokenId;
+
+  enum SamplingMode {
+    CumulativeSampling,
+    AliasSampling
+  };
+
+  // the edges of one node, pointing into the arrays or into a page
+  struct Edges {
+    TokenId target(int i) const;
+    quint32 count(int i) const;
+    const TokenId *targets;
+    const quint32 *counts;
+    const quint32 *cumulative;
+    const quint16 *quantizedCounts;
+    const quint16 *quantizedCumulative;
+    const float *aliasProbability;
+    const quint32 *alias;
+    int degree;
+    // keeps the page alive while the edges are used
+    QSharedPointer<const QByteArray> page;
+  };
+
+  static const quint32 MaxQuantizedTotal = 0xffffU;
+  // number of draws selectSuccessors() makes in lockstep
+  static const int LockstepWidth = 64;
+
+  MarkovFrozenChain(void);
+
+  void clear(void);
+  void swap(MarkovFrozenChain &other);
+
+  void addEdge(TokenId target, quint32 count);
+  void closeNode(void);
+  void reopenNode(TokenId id);
+  void appendNode(const MarkovFrozenChain &other, TokenId id);
+  void setOrder(const QVector<TokenId> &order);
+  void buildSentenceStarts(const QVector<TokenId> &terminators, const MarkovVocabulary &vocabulary);
+  void setSamplingMode(SamplingMode mode);
+  SamplingMode samplingMode(void) const;
+  qreal quantize(void);
+
+  int nodeCount(void) const;
+  int edgeCount(void) const;
+  int garbageCount(void) const;
+  bool isCompact(void) const;
+  bool isMapped(void) const;
+  bool isPaged(void) const;
+  bool isQuantized(void) const;
+  qint64 memoryUsage(void) const;
+  int begin(TokenId id) const;
+  int end(TokenId id) const;
+  TokenId target(int edge) const;
+  quint32 count(int edge) const;
+  quint32 totalCount(TokenId id) const;
+  Edges edges(TokenId id) const;
+  const TokenId *order(void) const;
+  int orderCount(void) const;
+
+  TokenId selectSuccessor(TokenId id, qreal p) const;
+  TokenId selectSuccessorCumulative(TokenId id, qreal p) const;
+  TokenId selectSuccessorAlias(TokenId id, qreal p) const;
+  void selectSuccessors(const TokenId *ids, const qreal *p, TokenId *successors, int n) const;
+  TokenId selectSentenceStart(qreal p) const;
+  int sentenceStartCount(void) const;
+
+  void writeTo(MarkovSnapshot &snapshot, quint32 component) const;
+  bool attach(const QSharedPointer<MarkovSnapshot> &snapshot, quint32 component, int tokenCount);
+
+private:
+  enum SnapshotField {
+    OffsetsField,
+    TargetsField,
+    CountsField,
+    CumulativeField,
+    AliasProbabilityField,
+    AliasField,
+    StartTargetsField,
+    StartAliasProbabilityField,
+    StartAliasField,
+    OrderField,
+    QuantizedCountsField,
+    QuantizedCumulativeField
+  };
+
+  struct Arrays {
+    const quint32 *offsets;
+    const quint32 *ends;
+    const TokenId *targets;
+    const quint32 *counts;
+    const quint32 *cumulative;
+    // instead of counts and cumulative if quantized
+    const quint16 *quantizedCounts;
+    const quint16 *quantizedCumulative;
+    const float *aliasProbability;
+    const quint32 *alias;
+    const TokenId *startTargets;
+    const float *startAliasProbability;
+    const quint32 *startAlias;
+    const TokenId *order;
+    int nodeCount;
+    int edgeCount;
+    int startCount;
+    int orderCount;
+    bool quantized;
+    // edges are paged in under keys pageKey | node
+    bool paged;
+    quint64 pageKey;
+  };
+
+  void updateArrays(void);
+  Edges pageIn(TokenId id) const;
+  void detachPaged(void);
+  TokenId nodeOf(int edge) const;
+  void buildAliasTable(const quint32 *counts, int n, float *probability, quint32 *alias);
+
+  // first edge of every node, followed by where the next node's edges go
+  QVector<quint32> mOffsets;
+  // end of the edges of every node, which is the next node's offset unless reopened
+  QVector<quint32> mEnds;
+  QVector<TokenId> mTargets;
+  QVector<quint32> mCounts;
+  QVector<quint32> mCumulative;
+  QVector<quint16> mQuantizedCounts;
+  QVector<quint16> mQuantizedCumulative;
+  // aliases are relative to the node's first edge
+  QVector<float> mAliasProbability;
+  QVector<quint32> mAlias;
+  QVector<TokenId> mStartTargets;
+  QVector<float> mStartAliasProbability;
+  QVector<quint32> mStartAlias;
+  // all node IDs ordered by token
+  QVector<TokenId> mOrder;
+  SamplingMode mSamplingMode;
+  bool mQuantized;
+  // node whose edges are being rebuilt, see reopenNode()
+  TokenId mReopened;
+  // edges left behind by reopened nodes, and the number of times a node was reopened
+  int mGarbage;
+  int mReopenCount;
+  Arrays mArrays;
+  // keeps the mapping alive while mArrays point into it
+  QSharedPointer<MarkovSnapshot> mSnapshot;
+  // of a paged chain: edges below mEdgeBase are paged in by these offsets
+  const quint32 *mPagedOffsets;
+  int mPagedNodeCount;
+  int mEdgeBase;
+  int mPagedTokenCount;
+  // scratch buffers for buildAliasTable()
+  QVector<quint64> mScaled;
+  QVector<int> mSmall;
+  QVector<int> mLarge;
+};
+
+
+#endif // __MARKOVFROZENCHAIN_H_
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovgenerator.h"
+#include "markovchain.h"
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QThread>
+#include <QVector>
+#include <QtConcurrent>
+
+#include <algorithm>
+
+// tokens that are not preceded by a blank
+const QStringList MarkovGenerator::StopTokens = { ".", ",", ":", ";", "?", "!", ")", "«", "_" };
+const int MarkovGenerator::ChunkWords;
+const int MarkovGenerator::LockstepWalks;
+
+
+// The node `n`-th in token order, as far as the chain's order reaches, so
+// that a walk restarts at the same tokens however they were numbered.
+static MarkovVocabulary::TokenId nodeAt(const MarkovChain *chain, int n)
+{
+  const MarkovFrozenChain &frozen = chain->frozen();
+  return n < frozen.orderCount() ? frozen.order()[n] : MarkovVocabulary::TokenId(n);
+}
+
+
+MarkovGenerator::MarkovGenerator(const MarkovChain *chain)
+  : mChain(chain)
+{
+  /* ... */
+}
+
+
+QString MarkovGenerator::generate(int wordCount, std::mt19937 &rng) const
+{
+  QElapsedTimer timer;
+  timer.start();
+  const QString &text = walk(wordCount, rng);
+  mChain->addGenerated(wordCount, timer.nsecsElapsed());
+  return text;
+}
+
+
+QString MarkovGenerator::walk(int wordCount, std::mt19937 &rng) const
+{
+  QString result;
+  MarkovWalker(mChain, rng).next(result, wordCount);
+  return result;
+}
+
+
+// Writes a text of `wordCount` words to `out` in pieces of ChunkWords
+// words. Returns the number of words written, which falls short only if
+// the chain is empty.
+qint64 MarkovGenerator::generate(qint64 wordCount, std::mt19937 &rng, QTextStream &out) const
+{
+  QElapsedTimer timer;
+  timer.start();
+  MarkovWalker walker(mChain, rng);
+  QString text;
+  while (walker.wordCount() < wordCount) {
+    text.resize(0);
+    if (walker.next(text, int(qMin(qint64(ChunkWords), wordCount - walker.wordCount()))) == 0)
+      break;
+    out << text;
+  }
+  mChain->addGenerated(walker.wordCount(), timer.nsecsElapsed());
+  return walker.wordCount();
+}
+
+
+// Generates texts firstText .. firstText + textCount - 1 of the run
+// seeded with `seed`, in groups small enough to keep every thread busy.
+QStringList MarkovGenerator::generate(int firstText, int textCount, int wordCount, quint32 seed) const
+{
+  QElapsedTimer timer;
+  timer.start();
+  const int groupSize = qBound(1, textCount / qMax(1, QThread::idealThreadCount()), LockstepWalks);
+  QVector<int> groups;
+  for (int text = 0; text < textCount; text += groupSize) {
+    groups.append(text);
+  }
+  const QList<QStringList> &parts = QtConcurrent::blockingMapped<QList<QStringList> >(groups, [this, firstText, textCount, wordCount, seed, groupSize](int text) {
+    return walk(firstText + text, qMin(groupSize, textCount - text), wordCount, seed);
+  });
+  QStringList result;
+  foreach (const QStringList &part, parts) {
+    result.append(part);
+  }
+  mChain->addGenerated(qint64(textCount) * wordCount, timer.nsecsElapsed());
+  return result;
+}
+
+
+// Walks texts firstText .. firstText + textCount - 1 in lockstep.
+QStringList MarkovGenerator::walk(int firstText, int textCount, int wordCount, quint32 seed) const
+{
+  QVector<std::mt19937> rngs;
+  rngs.reserve(textCount);
+  for (int i = 0; i < textCount; ++i) {
+    rngs.append(rngFor(seed, firstText + i));
+  }
+  QStringList texts;
+  texts.reserve(textCount);
+  for (int i = 0; i < textCount; ++i) {
+    texts.append(QString());
+  }
+  MarkovBatchWalker(mChain, rngs).next(texts, wordCount);
+  return texts;
+}
+
+
+std::mt19937 MarkovGenerator::rngFor(quint32 seed, int text)
+{
+  std::seed_seq seq = { seed, quint32(text) };
+  return std::mt19937(seq);
+}
+
+
+MarkovWalker::MarkovWalker(const MarkovChain *chain, std::mt19937 &rng)
+  : mChain(chain)
+  , mRng(rng)
+  , mPDist(0.0, 1.0)
+  // an online chain's nodes may be added to meanwhile, so they are not counted here
+  , mNDist(0, chain->isOnline() ? 0 : qMax(0, chain->count() - 1))
+  , mOnline(chain->isOnline())
+  , mNode(Q_NULLPTR)
+  , mOnlineNode(MarkovVocabulary::InvalidId)
+  , mWordCount(0)
+{
+  /* ... */
+}
+
+
+// Appends the next `wordCount` words to `text`, each with the blank or
+// line break that separates it from the word before. Returns the number
+// of words appended, which is 0 if the chain is empty.
+int MarkovWalker::next(QString &text, int wordCount)
+{
+  if (mOnline)
+    return nextOnline(text, wordCount);
+  if (mChain->count() == 0)
+    return 0;
+  for (int i = 0; i < wordCount; ++i) {
+    if (mNode == Q_NULLPTR) {
+      mNode = mChain->selectSentenceStart(mPDist(mRng));
+      if (mNode == Q_NULLPTR) {
+        mNode = mChain->node(nodeAt(mChain, mNDist(mRng)));
+      }
+      if (mWordCount > 0) {
+        text += " \\\n";
+      }
+      mHistory.clear();
+    }
+    const QString &token = mNode->token();
+    if (!mLastToken.isEmpty() && !MarkovGenerator::StopTokens.contains(token)) {
+      text += " ";
+    }
+    text += token;
+    mLastToken = token;
+    ++mWordCount;
+    mHistory.append(mNode->id());
+    if (mHistory.size() > mChain->modelOrder()) {
+      mHistory.remove(0);
+    }
+    mNode = mChain->selectSuccessor(mHistory, mPDist(mRng));
+  }
+  return wordCount;
+}
+
+
+// Like next(), with the tokens drawn from the chain's online model, which
+// may be added to meanwhile. Returns fewer words than asked for only if
+// the model has not counted anything yet.
+int MarkovWalker::nextOnline(QString &text, int wordCount)
+{
+  const MarkovOnlineModel &online = mChain->online();
+  for (int i = 0; i < wordCount; ++i) {
+    if (mOnlineNode == MarkovVocabulary::InvalidId) {
+      mOnlineNode = online.selectSentenceStart(mPDist(mRng));
+      if (mOnlineNode == MarkovVocabulary::InvalidId) {
+        const int tokenCount = online.tokenCount();
+        if (tokenCount == 0)
+          return i;
+        mOnlineNode = MarkovVocabulary::TokenId(std::uniform_int_distribution<int>(0, tokenCount - 1)(mRng));
+      }
+      if (mWordCount > 0) {
+        text += " \\\n";
+      }
+    }
+    const QString &token = mChain->token(mOnlineNode);
+    if (!mLastToken.isEmpty() && !MarkovGenerator::StopTokens.contains(token)) {
+      text += " ";
+    }
+    text += token;
+    mLastToken = token;
+    ++mWordCount;
+    mOnlineNode = online.selectSuccessor(mOnlineNode, mPDist(mRng));
+  }
+  return wordCount;
+}
+
+
+qint64 MarkovWalker::wordCount(void) const
+{
+  return mWordCount;
+}
+
+
+MarkovBatchWalker::MarkovBatchWalker(const MarkovChain *chain, QVector<std::mt19937> &rngs)
+  : mChain(chain)
+  , mRngs(rngs)
+  , mPDist(0.0, 1.0)
+  , mNDist(0, qMax(0, chain->count() - 1))
+  , mOrder(chain->modelOrder())
+  , mNodes(rngs.size(), MarkovVocabulary::InvalidId)
+  , mHistory(rngs.size() * chain->modelOrder())
+  , mHistoryLength(rngs.size(), 0)
+  , mP(rngs.size())
+  , mSuccessors(rngs.size())
+  , mWordCount(0)
+{
+  /* ... */
+}
+
+
+// Appends the next `wordCount` words of walk i to texts[i], which must
+// hold walkCount() texts. Returns the number of words appended to each
+// text, which is 0 if the chain is empty.
+int MarkovBatchWalker::next(QStringList &texts, int wordCount)
+{
+  if (mChain->count() == 0)
+    return 0;
+  const MarkovFrozenChain &frozen = mChain->frozen();
+  const int n = walkCount();
+  for (int step = 0; step < wordCount; ++step) {
+    for (int i = 0; i < n; ++i) {
+      if (mNodes.at(i) == MarkovVocabulary::InvalidId) {
+        MarkovVocabulary::TokenId start = frozen.selectSentenceStart(mPDist(mRngs[i]));
+        if (start == MarkovVocabulary::InvalidId) {
+          start = nodeAt(mChain, mNDist(mRngs[i]));
+        }
+        if (mWordCount > 0) {
+          texts[i] += " \\\n";
+        }
+        mHistoryLength[i] = 0;
+        mNodes[i] = start;
+      }
+      const QString &token = mChain->node(mNodes.at(i))->token();
+      if (mWordCount > 0 && !MarkovGenerator::StopTokens.contains(token)) {
+        texts[i] += " ";
+      }
+      texts[i] += token;
+      MarkovVocabulary::TokenId *history = mHistory.data() + i * mOrder;
+      if (mHistoryLength.at(i) == mOrder) {
+        std::copy(history + 1, history + mOrder, history);
+      }
+      else {
+        ++mHistoryLength[i];
+      }
+      history[mHistoryLength.at(i) - 1] = mNodes.at(i);
+    }
+    ++mWordCount;
+    for (int i = 0; i < n; ++i) {
+      mP[i] = mPDist(mRngs[i]);
+    }
+    selectSuccessors();
+    mNodes.swap(mSuccessors);
+  }
+  return wordCount;
+}
+
+
+// Selects the successors of all walks into mSuccessors. Like
+// MarkovChain::selectSuccessor(), a walk's context is looked up first,
+// and the walks without a successor there back off to their last node,
+// whose successors are selected together.
+void MarkovBatchWalker::selectSuccessors(void)
+{
+  const MarkovFrozenChain &frozen = mChain->frozen();
+  const int n = walkCount();
+  if (mOrder < 2) {
+    frozen.selectSuccessors(mNodes.constData(), mP.constData(), mSuccessors.data(), n);
+    return;
+  }
+  const MarkovContextModel &contexts = mChain->contexts();
+  mBackOff.resize(0);
+  mBackOffNodes.resize(0);
+  mBackOffP.resize(0);
+  for (int i = 0; i < n; ++i) {
+    const MarkovVocabulary::TokenId *history = mHistory.constData() + i * mOrder;
+    mSuccessors[i] = contexts.selectSuccessor(history, mHistoryLength.at(i), mP.at(i));
+    if (mSuccessors.at(i) == MarkovVocabulary::InvalidId) {
+      mBackOff.append(i);
+      mBackOffNodes.append(history[mHistoryLength.at(i) - 1]);
+      mBackOffP.append(mP.at(i));
+    }
+  }
+  mBackOffSuccessors.resize(mBackOff.size());
+  frozen.selectSuccessors(mBackOffNodes.constData(), mBackOffP.constData(), mBackOffSuccessors.data(), mBackOff.size());
+  for (int j = 0; j < mBackOff.size(); ++j) {
+    mSuccessors[mBackOff.at(j)] = mBackOffSuccessors.at(j);
+  }
+}
+
+
+int MarkovBatchWalker::walkCount(void) const
+{
+  return mRngs.size();
+}
+
+
+qint64 MarkovBatchWalker::wordCount(void) const
+{
+  return mWordCount;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVGENERATOR_H_
+#define __MARKOVGENERATOR_H_
+
+#include <random>
+
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+#include <QVector>
+
+#include "markovvocabulary.h"
+
+class MarkovChain;
+class MarkovNode;
+
+
+// Generates text by random walks through a frozen MarkovChain, which it
+// only reads from. A walk starts at a sentence start, or at a random
+// node if there are none, follows successors of the chain's model order
+// and starts over where a node has no successors.
+//
+// Texts generated in bulk are walked concurrently on the global thread
+// pool, in groups of up to LockstepWalks texts that a MarkovBatchWalker
+// walks side by side. Text i draws from a random number generator of its own, seeded
+// from the master seed and i, so the texts do not depend on the number
+// of threads nor on how the texts are split into calls. The words and
+// the wall time of every call are counted in the chain's metrics().
+//
+// Long texts are better written to a stream, which takes them from a
+// MarkovWalker ChunkWords words at a time, so that memory does not grow
+// with their length.
+class MarkovGenerator {
+public:
+  explicit MarkovGenerator(const MarkovChain *chain);
+
+  QString generate(int wordCount, std::mt19937 &rng) const;
+  QStringList generate(int firstText, int textCount, int wordCount, quint32 seed) const;
+  qint64 generate(qint64 wordCount, std::mt19937 &rng, QTextStream &out) const;
+
+  static std::mt19937 rngFor(quint32 seed, int text);
+
+  static const QStringList StopTokens;
+  static const int ChunkWords = 4096;
+  static const int LockstepWalks = 256;
+
+private:
+  QString walk(int wordCount, std::mt19937 &rng) const;
+  QStringList walk(int firstText, int textCount, int wordCount, quint32 seed) const;
+
+  const MarkovChain *mChain;
+};
+
+
+// A walk through a frozen MarkovChain that hands out its text on demand:
+// every next() carries on where the previous one stopped, so a text of
+// any length can be pulled in pieces, e.g. by a worker feeding a window.
+// The pieces joined give the text MarkovGenerator would have generated
+// in one go from the same random number generator. The walker only reads
+// from the chain, which must not be changed while the walker is used.
+//
+// If the chain is online when the walker is made, it walks the chain's
+// MarkovOnlineModel instead, following only the last token, and may be
+// used while text is being added to the chain.
+class MarkovWalker {
+public:
+  MarkovWalker(const MarkovChain *chain, std::mt19937 &rng);
+
+  int next(QString &text, int wordCount);
+  qint64 wordCount(void) const;
+
+private:
+  int nextOnline(QString &text, int wordCount);
+
+  const MarkovChain *mChain;
+  std::mt19937 &mRng;
+  std::uniform_real_distribution<qreal> mPDist;
+  std::uniform_int_distribution<int> mNDist;
+  const bool mOnline;
+  const MarkovNode *mNode;
+  // the current token if mOnline, there being no node to point to safely
+  MarkovVocabulary::TokenId mOnlineNode;
+  QVector<MarkovVocabulary::TokenId> mHistory;
+  QString mLastToken;
+  qint64 mWordCount;
+};
+
+
+// Many walks through a frozen MarkovChain made in lockstep, each drawing
+// from a random number generator of its own: a step draws the next number
+// of every walk, then selects all their successors in one go with
+// MarkovFrozenChain::selectSuccessors(), which overlaps the cache misses
+// a walk made alone would wait for one by one. The walks are kept in
+// parallel arrays. Walk i appends to texts[i] what a MarkovWalker would
+// from rngs[i], so the two can be used in place of each other. The walks
+// always go through the frozen chain, even if the chain is online.
+class MarkovBatchWalker {
+public:
+  MarkovBatchWalker(const MarkovChain *chain, QVector<std::mt19937> &rngs);
+
+  int next(QStringList &texts, int wordCount);
+  int walkCount(void) const;
+  qint64 wordCount(void) const;
+
+private:
+  void selectSuccessors(void);
+
+  const MarkovChain *mChain;
+  QVector<std::mt19937> &mRngs;
+  std::uniform_real_distribution<qreal> mPDist;
+  std::uniform_int_distribution<int> mNDist;
+  int mOrder;
+  // current node of every walk, InvalidId if it starts over
+  QVector<MarkovVocabulary::TokenId> mNodes;
+  // the last mOrder nodes of every walk, newest last
+  QVector<MarkovVocabulary::TokenId> mHistory;
+  QVector<int> mHistoryLength;
+  QVector<qreal> mP;
+  QVector<MarkovVocabulary::TokenId> mSuccessors;
+  // walks that the context model has no successor for, see selectSuccessors()
+  QVector<int> mBackOff;
+  QVector<MarkovVocabulary::TokenId> mBackOffNodes;
+  QVector<qreal> mBackOffP;
+  QVector<MarkovVocabulary::TokenId> mBackOffSuccessors;
+  qint64 mWordCount;
+};
+
+
+#endif // __MARKOVGENERATOR_H_
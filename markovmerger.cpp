@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovmerger.h"
+#include "markovchain.h"
+#include "markovsnapshot.h"
+#include "markovvocabulary.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QObject>
+#include <QSaveFile>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QTemporaryFile>
+#include <QVector>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+
+// The lines of one model file, split into token and successors.
+class MarkovMerger::Input {
+public:
+  struct Edge {
+    const char *token;
+    int size;
+    quint32 count;
+  };
+
+  Input(void);
+
+  bool open(const QString &filename);
+  bool next(void);
+  QString errorString(void) const;
+
+  const char *token;
+  int tokenSize;
+  QVector<Edge> edges;
+
+private:
+  enum Format {
+    PlainFormat,
+    CompressedFormat,
+    ChunkedFormat,
+    SnapshotFormat
+  };
+
+  bool readLine(void);
+  bool refill(void);
+  void parse(void);
+
+  QString mFilename;
+  Format mFormat;
+  QFile mFile;
+  // mPos is the start of the next line
+  QByteArray mBuffer;
+  int mPos;
+  QByteArray mLine;
+  QByteArray mPrevious;
+  QScopedPointer<MarkovChain> mChain;
+  int mNext;
+  QString mErrorString;
+};
+
+
+// qUncompress() gives nothing for corrupt data, so the size is checked.
+static bool uncompress(const char *data, int size, QByteArray &text)
+{
+  if (size < int(sizeof(quint32)))
+    return false;
+  const QByteArray &uncompressed = qUncompress(reinterpret_cast<const uchar*>(data), size);
+  if (uncompressed.size() != int(qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(data))))
+    return false;
+  text.append(uncompressed);
+  return true;
+}
+
+
+MarkovMerger::Input::Input(void)
+  : token(Q_NULLPTR)
+  , tokenSize(0)
+  , mFormat(PlainFormat)
+  , mPos(0)
+  , mNext(0)
+{
+  /* ... */
+}
+
+
+bool MarkovMerger::Input::open(const QString &filename)
+{
+  mFilename = filename;
+  if (MarkovSnapshot::isSnapshot(filename)) {
+    mFormat = SnapshotFormat;
+    mChain.reset(new MarkovChain);
+    if (!mChain->readFromSnapshot(filename)) {
+      mErrorString = QObject::tr("cannot read snapshot %1").arg(filename);
+      return false;
+    }
+    return true;
+  }
+  mFile.setFileName(filename);
+  if (!mFile.open(QIODevice::ReadOnly)) {
+    mErrorString = QObject::tr("cannot open %1: %2").arg(filename).arg(mFile.errorString());
+    return false;
+  }
+  const QByteArray &header = mFile.peek(MarkovChain::FileHeader.size());
+  if (header == MarkovChain::ChunkedFileHeader) {
+    mFormat = ChunkedFormat;
+    mFile.read(header.size());
+  }
+  else if (header == MarkovChain::FileHeader) {
+    mFormat = CompressedFormat;
+    const QByteArray &data = mFile.readAll();
+    if (!uncompress(data.constData() + header.size(), data.size() - header.size(), mBuffer)) {
+      mErrorString = QObject::tr("%1 is corrupt").arg(filename);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// Returns false at the end of the input or on an error, see errorString().
+bool MarkovMerger::Input::next(void)
+{
+  do {
+    if (!readLine())
+      return false;
+    parse();
+  } while (tokenSize == 0);
+  if (!mPrevious.isNull() && !MarkovVocabulary::lessThan(mPrevious.constData(), mPrevious.size(), token, tokenSize)) {
+    mErrorString = QObject::tr("%1 is not ordered by token").arg(mFilename);
+    return false;
+  }
+  for (int i = 1; i < edges.size(); ++i) {
+    if (!MarkovVocabulary::lessThan(edges.at(i - 1).token, edges.at(i - 1).size, edges.at(i).token, edges.at(i).size)) {
+      mErrorString = QObject::tr("the successors of %1 in %2 are not ordered by token").arg(QString::fromUtf8(token, tokenSize)).arg(mFilename);
+      return false;
+    }
+  }
+  mPrevious = QByteArray(token, tokenSize);
+  return true;
+}
+
+
+QString MarkovMerger::Input::errorString(void) const
+{
+  return mErrorString;
+}
+
+
+bool MarkovMerger::Input::readLine(void)
+{
+  if (mFormat == SnapshotFormat) {
+    const MarkovFrozenChain &frozen = mChain->frozen();
+    if (mNext >= frozen.orderCount())
+      return false;
+    mLine.resize(0);
+    mChain->node(frozen.order()[mNext++])->appendTo(mLine);
+    return true;
+  }
+  int eol;
+  while ((eol = mBuffer.indexOf('\n', mPos)) < 0) {
+    if (!refill()) {
+      if (!mErrorString.isEmpty() || mPos >= mBuffer.size())
+        return false;
+      eol = mBuffer.size();
+      break;
+    }
+  }
+  mLine = mBuffer.mid(mPos, eol - mPos);
+  mPos = eol + 1;
+  return true;
+}
+
+
+bool MarkovMerger::Input::refill(void)
+{
+  mBuffer.remove(0, mPos);
+  mPos = 0;
+  if (mFormat == PlainFormat) {
+    const QByteArray &data = mFile.read(MarkovChain::ChunkSize);
+    if (data.isEmpty())
+      return false;
+    mBuffer.append(data);
+    return true;
+  }
+  if (mFormat == ChunkedFormat) {
+    uchar size[sizeof(quint32)];
+    const qint64 n = mFile.read(reinterpret_cast<char*>(size), sizeof(size));
+    if (n == 0)
+      return false;
+    const QByteArray &chunk = (n == qint64(sizeof(size))) ? mFile.read(qFromLittleEndian<quint32>(size)) : QByteArray();
+    if (n != qint64(sizeof(size)) || chunk.size() != int(qFromLittleEndian<quint32>(size))
+        || !uncompress(chunk.constData(), chunk.size(), mBuffer)) {
+      mErrorString = QObject::tr("%1 is cut short or corrupt").arg(mFilename);
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+
+void MarkovMerger::Input::parse(void)
+{
+  edges.resize(0);
+  tokenSize = 0;
+  const char *p = mLine.constData();
+  const char *end = p + mLine.size();
+  // fields are separated by one or more blanks: token (count successor)*
+  int fieldCount = 0;
+  quint32 count = 0;
+  while (p < end) {
+    while (p < end && *p == ' ') {
+      ++p;
+    }
+    const char *fieldBegin = p;
+    while (p < end && *p != ' ') {
+      ++p;
+    }
+    if (p == fieldBegin)
+      break;
+    const int fieldSize = int(p - fieldBegin);
+    if (fieldCount == 0) {
+      token = fieldBegin;
+      tokenSize = fieldSize;
+    }
+    else if (fieldCount % 2 == 1) {
+      count = QByteArray::fromRawData(fieldBegin, fieldSize).toUInt();
+    }
+    else {
+      const Edge edge = { fieldBegin, fieldSize, count };
+      edges.append(edge);
+    }
+    ++fieldCount;
+  }
+}
+
+
+static bool sameToken(const char *a, int na, const char *b, int nb)
+{
+  return na == nb && memcmp(a, b, size_t(na)) == 0;
+}
+
+
+MarkovMerger::MarkovMerger(void)
+  : mLineCount(0)
+  , mEdgeCount(0)
+{
+  /* ... */
+}
+
+
+bool MarkovMerger::merge(const QStringList &inputs, const QString &output)
+{
+  mErrorString.clear();
+  mLineCount = 0;
+  mEdgeCount = 0;
+  if (!output.endsWith(MarkovChain::SnapshotSuffix))
+    return mergeToFile(inputs, output);
+  QTemporaryFile tempFile(QFileInfo(output).absolutePath() + "/XXXXXX.markov");
+  if (!tempFile.open()) {
+    mErrorString = QObject::tr("cannot create a temporary file next to %1").arg(output);
+    return false;
+  }
+  tempFile.close();
+  if (!mergeToFile(inputs, tempFile.fileName()))
+    return false;
+  MarkovChain chain;
+  if (!chain.readFromMarkovFile(tempFile.fileName()) || !chain.saveSnapshot(output)) {
+    mErrorString = QObject::tr("cannot convert the merged model to %1").arg(output);
+    return false;
+  }
+  return true;
+}
+
+
+bool MarkovMerger::mergeToFile(const QStringList &inputs, const QString &output)
+{
+  QVector<QSharedPointer<Input> > sources;
+  std::vector<int> heap;
+  foreach (QString filename, inputs) {
+    QSharedPointer<Input> input(new Input);
+    if (!input->open(filename)) {
+      mErrorString = input->errorString();
+      return false;
+    }
+    if (input->next()) {
+      heap.push_back(sources.size());
+    }
+    else if (!input->errorString().isEmpty()) {
+      mErrorString = input->errorString();
+      return false;
+    }
+    sources.append(input);
+  }
+  // a min-heap of inputs by their current token
+  const auto tokenGreater = [&sources](int a, int b) {
+    const Input &ia = *sources.at(a);
+    const Input &ib = *sources.at(b);
+    return MarkovVocabulary::lessThan(ib.token, ib.tokenSize, ia.token, ia.tokenSize);
+  };
+  std::make_heap(heap.begin(), heap.end(), tokenGreater);
+
+  QSaveFile outFile(output);
+  if (!outFile.open(QIODevice::WriteOnly)) {
+    mErrorString = QObject::tr("cannot write %1: %2").arg(output).arg(outFile.errorString());
+    return false;
+  }
+  const bool compressed = output.endsWith('z');
+  if (compressed) {
+    outFile.write(MarkovChain::ChunkedFileHeader);
+  }
+  QByteArray lines;
+  const auto flush = [&outFile, &lines, compressed](void) {
+    if (compressed) {
+      const QByteArray &data = qCompress(lines, 9);
+      uchar size[sizeof(quint32)];
+      qToLittleEndian<quint32>(quint32(data.size()), size);
+      outFile.write(reinterpret_cast<const char*>(size), sizeof(size));
+      outFile.write(data);
+    }
+    else {
+      outFile.write(lines);
+    }
+    lines.resize(0);
+  };
+  QVector<int> group;
+  QVector<int> heads;
+  while (!heap.empty()) {
+    // all inputs on the least token
+    group.resize(0);
+    do {
+      std::pop_heap(heap.begin(), heap.end(), tokenGreater);
+      group.append(heap.back());
+      heap.pop_back();
+    } while (!heap.empty() && sameToken(sources.at(heap.front())->token, sources.at(heap.front())->tokenSize,
+                                        sources.at(group.first())->token, sources.at(group.first())->tokenSize));
+    const Input &first = *sources.at(group.first());
+    lines.append(first.token, first.tokenSize).append(' ');
+    heads.fill(0, group.size());
+    for (bool firstEdge = true; ; firstEdge = false) {
+      const Input::Edge *least = Q_NULLPTR;
+      for (int g = 0; g < group.size(); ++g) {
+        const QVector<Input::Edge> &edges = sources.at(group.at(g))->edges;
+        if (heads.at(g) < edges.size()) {
+          const Input::Edge &edge = edges.at(heads.at(g));
+          if (least == Q_NULLPTR || MarkovVocabulary::lessThan(edge.token, edge.size, least->token, least->size)) {
+            least = &edge;
+          }
+        }
+      }
+      if (least == Q_NULLPTR)
+        break;
+      const Input::Edge target = *least;
+      quint32 count = 0;
+      for (int g = 0; g < group.size(); ++g) {
+        const QVector<Input::Edge> &edges = sources.at(group.at(g))->edges;
+        if (heads.at(g) < edges.size() && sameToken(edges.at(heads.at(g)).token, edges.at(heads.at(g)).size, target.token, target.size)) {
+          count += edges.at(heads.at(g)).count;
+          ++heads[g];
+        }
+      }
+      if (!firstEdge) {
+        lines.append(' ');
+      }
+      lines.append(QByteArray::number(count)).append(' ').append(target.token, target.size);
+      ++mEdgeCount;
+    }
+    lines.append('\n');
+    ++mLineCount;
+    if (lines.size() >= MarkovChain::ChunkSize) {
+      flush();
+    }
+    foreach (int i, group) {
+      if (sources.at(i)->next()) {
+        heap.push_back(i);
+        std::push_heap(heap.begin(), heap.end(), tokenGreater);
+      }
+      else if (!sources.at(i)->errorString().isEmpty()) {
+        mErrorString = sources.at(i)->errorString();
+        outFile.cancelWriting();
+        return false;
+      }
+    }
+  }
+  if (!lines.isEmpty()) {
+    flush();
+  }
+  if (!outFile.commit()) {
+    mErrorString = QObject::tr("cannot write %1: %2").arg(output).arg(outFile.errorString());
+    return false;
+  }
+  return true;
+}
+
+
+QString MarkovMerger::errorString(void) const
+{
+  return mErrorString;
+}
+
+
+qint64 MarkovMerger::lineCount(void) const
+{
+  return mLineCount;
+}
+
+
+qint64 MarkovMerger::edgeCount(void) const
+{
+  return mEdgeCount;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVMERGER_H_
+#define __MARKOVMERGER_H_
+
+#include <QString>
+#include <QStringList>
+
+
+// Merges model files into one line by line, without loading them as a
+// whole, which works because lines and successors are ordered by token.
+class MarkovMerger {
+public:
+  MarkovMerger(void);
+
+  bool merge(const QStringList &inputs, const QString &output);
+  QString errorString(void) const;
+  qint64 lineCount(void) const;
+  qint64 edgeCount(void) const;
+
+private:
+  class Input;
+
+  bool mergeToFile(const QStringList &inputs, const QString &output);
+
+  QString mErrorString;
+  qint64 mLineCount;
+  qint64 mEdgeCount;
+};
+
+
+#endif // __MARKOVMERGER_H_
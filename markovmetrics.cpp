@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovmetrics.h"
+
+
+MarkovMetrics::MarkovMetrics(void)
+  : bytesRead(0)
+  , tokens(0)
+  , wordsGenerated(0)
+  , importTime(0)
+  , nodes(0)
+  , edges(0)
+  , nodeMemory(0)
+  , edgeMemory(0)
+  , stringMemory(0)
+  , contextMemory(0)
+  , pageHits(0)
+  , pageMisses(0)
+{
+  for (int i = 0; i < PhaseCount; ++i) {
+    phaseTime[i] = 0;
+  }
+}
+
+
+// Adds the counters of `other`, but not its model size.
+void MarkovMetrics::add(const MarkovMetrics &other)
+{
+  bytesRead += other.bytesRead;
+  tokens += other.tokens;
+  wordsGenerated += other.wordsGenerated;
+  importTime += other.importTime;
+  for (int i = 0; i < PhaseCount; ++i) {
+    phaseTime[i] += other.phaseTime[i];
+  }
+}
+
+
+// Tokens per second of wall-clock time, not of the phase times, which add
+// up the time of every thread.
+qreal MarkovMetrics::tokensPerSecond(void) const
+{
+  return importTime > 0 ? 1e9 * qreal(tokens) / qreal(importTime) : 0;
+}
+
+
+qreal MarkovMetrics::wordsPerSecond(void) const
+{
+  return phaseTime[GeneratePhase] > 0 ? 1e9 * qreal(wordsGenerated) / qreal(phaseTime[GeneratePhase]) : 0;
+}
+
+
+qint64 MarkovMetrics::memoryUsage(void) const
+{
+  return nodeMemory + edgeMemory + stringMemory + contextMemory;
+}
+
+
+const char *MarkovMetrics::phaseName(Phase phase)
+{
+  static const char *const Names[PhaseCount] = { "read", "tokenize", "insert", "finalize", "serialize", "generate" };
+  return Names[phase];
+}
+
+
+QJsonObject MarkovMetrics::toJson(void) const
+{
+  QJsonObject times;
+  for (int i = 0; i < PhaseCount; ++i) {
+    times[phaseName(Phase(i))] = double(phaseTime[i]);
+  }
+  QJsonObject memory;
+  memory["nodes"] = double(nodeMemory);
+  memory["edges"] = double(edgeMemory);
+  memory["strings"] = double(stringMemory);
+  memory["contexts"] = double(contextMemory);
+  memory["total"] = double(memoryUsage());
+  QJsonObject json;
+  json["bytesRead"] = double(bytesRead);
+  json["tokens"] = double(tokens);
+  json["wordsGenerated"] = double(wordsGenerated);
+  json["phaseNs"] = times;
+  json["importNs"] = double(importTime);
+  json["tokensPerSecond"] = tokensPerSecond();
+  json["wordsPerSecond"] = wordsPerSecond();
+  json["nodes"] = double(nodes);
+  json["edges"] = double(edges);
+  json["memoryBytes"] = memory;
+  json["pageHits"] = double(pageHits);
+  json["pageMisses"] = double(pageMisses);
+  return json;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVMETRICS_H_
+#define __MARKOVMETRICS_H_
+
+#include <QtGlobal>
+#include <QJsonObject>
+
+
+// Counters of the work done by a MarkovChain, see MarkovChain::metrics(),
+// and the estimated size of its model. Times are in nanoseconds; where
+// work runs on several threads they add up the time of every thread.
+struct MarkovMetrics {
+  enum Phase {
+    ReadPhase,
+    TokenizePhase,
+    InsertPhase,
+    FinalizePhase,
+    SerializePhase,
+    GeneratePhase,
+    PhaseCount
+  };
+
+  MarkovMetrics(void);
+
+  void add(const MarkovMetrics &other);
+  qreal tokensPerSecond(void) const;
+  qreal wordsPerSecond(void) const;
+  qint64 memoryUsage(void) const;
+  QJsonObject toJson(void) const;
+
+  static const char *phaseName(Phase phase);
+
+  qint64 bytesRead;
+  qint64 tokens;
+  qint64 wordsGenerated;
+  qint64 phaseTime[PhaseCount];
+  // wall-clock time of adding text, of which phaseTime has the breakdown
+  qint64 importTime;
+
+  // the model at the time the metrics were taken
+  qint64 nodes;
+  qint64 edges;
+  qint64 nodeMemory;
+  qint64 edgeMemory;
+  qint64 stringMemory;
+  qint64 contextMemory;
+  // node edges found in or read into the page cache, if the model is paged
+  qint64 pageHits;
+  qint64 pageMisses;
+};
+
+
+#endif // __MARKOVMETRICS_H_
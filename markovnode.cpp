@@ -7,25 +7,28 @@
 #include "markovchain.h"
 #include "markovnode.h"
 #include "markovedge.h"
+#include "markovfrozenchain.h"
 
 #include <QDebug>
 #include <QtGlobal>
 #include <algorithm>
 
 
-MarkovNode::MarkovNode(const QString &token)
-  : mToken(token)
+MarkovNode::MarkovNode(MarkovChain *chain, MarkovVocabulary::TokenId id, bool frozen)
+  : mChain(chain)
+  , mId(id)
+  , mFrozen(frozen)
 {
   /* ... */
 }
 
 
 bool edgeLessThan(MarkovEdge *a, MarkovEdge *b) {
-  return a->node()->token() < b->node()->token();
+  return a->target() < b->target();
 }
 
 
-void MarkovNode::addSuccessor(MarkovNode *node)
+void MarkovNode::addSuccessor(MarkovNode *node, MarkovEdgePool &edges)
 {
   // NOTES:
   // - Both algorithms have almost identical runtime behavior independent of the number of Markov nodes and edges.
@@ -34,25 +37,25 @@ void MarkovNode::addSuccessor(MarkovNode *node)
 #if LINEAR
   MarkovEdgeList::iterator i;
   for (i = mSuccessors.begin(); i != mSuccessors.end(); ++i) {
-    if ((*i)->node() == node) {
+    if ((*i)->target() == node->id()) {
       (*i)->increaseCount();
       break;
     }
   }
   if (i == mSuccessors.end()) {
-    mSuccessors.append(new MarkovEdge(node));
+    mSuccessors.append(edges.create(node->id()));
   }
 #elif INSERTION
-  MarkovEdge soughtEdge(node);
+  MarkovEdge soughtEdge(node->id());
   MarkovEdgeList::iterator i = std::lower_bound(mSuccessors.begin(), mSuccessors.end(), &soughtEdge, edgeLessThan);
   if (i == mSuccessors.end()) {
-    mSuccessors.append(new MarkovEdge(node));
+    mSuccessors.append(edges.create(node->id()));
   }
-  else if ((*i)->node() == node) {
+  else if ((*i)->target() == node->id()) {
      (*i)->increaseCount();
   }
   else {
-    mSuccessors.insert(i, new MarkovEdge(node));
+    mSuccessors.insert(i, edges.create(node->id()));
   }
 #endif
 }
@@ -65,24 +68,92 @@ void MarkovNode::addSuccessor(MarkovEdge *edge)
 }
 
 
-void MarkovNode::calcProbabilities(void) {
-  int N = 0;
-  foreach(MarkovEdge *edge, mSuccessors) {
-    N += edge->count();
+void MarkovNode::mergeSuccessor(MarkovVocabulary::TokenId target, int count, MarkovEdgePool &edges)
+{
+  MarkovEdge soughtEdge(target);
+  MarkovEdgeList::iterator i = std::lower_bound(mSuccessors.begin(), mSuccessors.end(), &soughtEdge, edgeLessThan);
+  if (i != mSuccessors.end() && (*i)->target() == target) {
+    (*i)->setCount((*i)->count() + count);
+  }
+  else {
+    mSuccessors.insert(i, edges.create(target, count));
   }
-  if (N > 0) {
-    qreal p = 1.0;
-    foreach(MarkovEdge *edge, mSuccessors) {
-      p -= qreal(edge->count()) / N;
-      if (qFuzzyIsNull(p)) {
-        p = 0;
-      }
-      else {
-        p = qMax(p, 0.0);
-      }
-      edge->setProbability(p);
+}
+
+
+// Adds the counts of `successors`, which must be sorted by target and
+// free of duplicates, in a single pass over both sorted lists.
+void MarkovNode::mergeSuccessors(const QVector<Successor> &successors, MarkovEdgePool &edges)
+{
+  MarkovEdgeList merged;
+  merged.reserve(mSuccessors.size() + successors.size());
+  MarkovEdgeList::const_iterator i = mSuccessors.constBegin();
+  QVector<Successor>::const_iterator j = successors.constBegin();
+  while (i != mSuccessors.constEnd() || j != successors.constEnd()) {
+    if (j == successors.constEnd() || (i != mSuccessors.constEnd() && (*i)->target() < j->first)) {
+      merged.append(*i++);
+    }
+    else if (i == mSuccessors.constEnd() || j->first < (*i)->target()) {
+      merged.append(edges.create(j->first, j->second));
+      ++j;
     }
+    else {
+      (*i)->setCount((*i)->count() + j->second);
+      merged.append(*i++);
+      ++j;
+    }
+  }
+  mSuccessors.swap(merged);
+}
+
+
+void MarkovNode::freeze(MarkovFrozenChain &frozen, const QVector<quint32> &rank, MarkovEdgePool &edges)
+{
+  std::sort(mSuccessors.begin(), mSuccessors.end(), [&rank](MarkovEdge *a, MarkovEdge *b) {
+    return rank.at(int(a->target())) < rank.at(int(b->target()));
+  });
+  store(frozen, edges);
+}
+
+
+// Like freeze() above, for when there is no rank of all tokens at hand.
+void MarkovNode::freeze(MarkovFrozenChain &frozen, const MarkovVocabulary &vocabulary, MarkovEdgePool &edges)
+{
+  std::sort(mSuccessors.begin(), mSuccessors.end(), [&vocabulary](MarkovEdge *a, MarkovEdge *b) {
+    return vocabulary.lessThan(a->target(), b->target());
+  });
+  store(frozen, edges);
+}
+
+
+void MarkovNode::store(MarkovFrozenChain &frozen, MarkovEdgePool &edges)
+{
+  foreach (MarkovEdge *edge, mSuccessors) {
+    frozen.addEdge(edge->target(), quint32(edge->count()));
+    edges.destroy(edge);
+  }
+  frozen.closeNode();
+  mSuccessors.clear();
+  mFrozen = true;
+}
+
+
+void MarkovNode::thaw(const MarkovFrozenChain &frozen, MarkovEdgePool &edges)
+{
+  Q_ASSERT(mFrozen && mSuccessors.isEmpty());
+  const MarkovFrozenChain::Edges &frozenEdges = frozen.edges(mId);
+  mSuccessors.reserve(frozenEdges.degree);
+  for (int i = 0; i < frozenEdges.degree; ++i) {
+    mSuccessors.append(edges.create(frozenEdges.target(i), int(frozenEdges.count(i))));
   }
+  std::sort(mSuccessors.begin(), mSuccessors.end(), edgeLessThan);
+  mFrozen = false;
+}
+
+
+bool MarkovNode::isFrozen(void) const
+{
+  return mFrozen;
 }
 
 
@@ -92,33 +163,60 @@ const MarkovNode::MarkovEdgeList &MarkovNode::successors(void) const
 }
 
 
-const QString &MarkovNode::token(void) const
+const MarkovChain *MarkovNode::chain(void) const
 {
-  return mToken;
+  return mChain;
 }
 
 
-MarkovNode *MarkovNode::selectSuccessor(const qreal p)
+MarkovVocabulary::TokenId MarkovNode::id(void) const
 {
-  foreach(MarkovEdge *edge, mSuccessors) {
-    if (p > edge->p()) {
-      return edge->node();
-    }
-  }
-  return Q_NULLPTR;
+  return mId;
+}
+
+
+QString MarkovNode::token(void) const
+{
+  return mChain->vocabulary().token(mId);
 }
 
 
 QString MarkovNode::toString(void) const
 {
-  QString result = mToken + ' ';
-  for (MarkovEdgeList::const_iterator i = mSuccessors.constBegin(); i != mSuccessors.constEnd(); ++i) {
+  QByteArray line;
+  appendTo(line);
+  return QString::fromUtf8(line);
+}
+
+
+// Appends the node's line of a .markov file, without the line break:
+// the token, then count and token of every successor ordered by token.
+void MarkovNode::appendTo(QByteArray &line) const
+{
+  const MarkovVocabulary &vocabulary = mChain->vocabulary();
+  line.append(vocabulary.data(mId), vocabulary.size(mId)).append(' ');
+  if (mFrozen) {
+    const MarkovFrozenChain::Edges &edges = mChain->frozen().edges(mId);
+    for (int i = 0; i < edges.degree; ++i) {
+      if (i > 0)
+        line.append(' ');
+      const MarkovVocabulary::TokenId target = edges.target(i);
+      line.append(QByteArray::number(edges.count(i))).append(' ').append(vocabulary.data(target), vocabulary.size(target));
+    }
+    return;
+  }
+  // successors are kept in ID order, but files list them ordered by token
+  MarkovEdgeList sorted = mSuccessors;
+  std::sort(sorted.begin(), sorted.end(), [&vocabulary](MarkovEdge *a, MarkovEdge *b) {
+    return vocabulary.lessThan(a->target(), b->target());
+  });
+  for (MarkovEdgeList::const_iterator i = sorted.constBegin(); i != sorted.constEnd(); ++i) {
     const MarkovEdge *successor = *i;
-    result.append(successor->toString());
-    if (i < (mSuccessors.constEnd() - 1))
-      result.append(' ');
+    const MarkovVocabulary::TokenId target = successor->target();
+    line.append(QByteArray::number(successor->count())).append(' ').append(vocabulary.data(target), vocabulary.size(target));
+    if (i < (sorted.constEnd() - 1))
+      line.append(' ');
   }
-  return result;
 }
 
 
@@ -128,7 +226,7 @@ QDebug operator<<(QDebug debug, const MarkovNode &node)
   Q_UNUSED(saver);
   debug.nospace() << "(" << node.token() << " -> ";
   foreach(MarkovEdge *edge, node.successors()) {
-    debug << edge->node()->token() << "@" << edge->p() << " ";
+    debug << node.chain()->vocabulary().token(edge->target()) << "@" << edge->count() << " ";
   }
   debug << ")";
   return debug;
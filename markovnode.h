@@ -8,34 +8,53 @@
 #ifndef __MARKOVNODE_H_
 #define __MARKOVNODE_H_
 
+#include <QByteArray>
 #include <QList>
+#include <QPair>
 #include <QString>
+#include <QVector>
 
+#include "markovvocabulary.h"
+#include "markovedge.h"
 
 class MarkovChain;
-class MarkovEdge;
+class MarkovFrozenChain;
 
 
 class MarkovNode {
 public:
   typedef QList<MarkovEdge*> MarkovEdgeList;
+  // target and count
+  typedef QPair<MarkovVocabulary::TokenId, int> Successor;
 
-  explicit MarkovNode(const QString &token);
+  MarkovNode(MarkovChain *chain, MarkovVocabulary::TokenId id, bool frozen = false);
 
-  void addSuccessor(MarkovNode *node);
+  // edges are created in and returned to the MarkovEdgePool passed in
+  void addSuccessor(MarkovNode *node, MarkovEdgePool &edges);
   void addSuccessor(MarkovEdge *edge);
-  void calcProbabilities(void);
+  void mergeSuccessor(MarkovVocabulary::TokenId target, int count, MarkovEdgePool &edges);
+  void mergeSuccessors(const QVector<Successor> &successors, MarkovEdgePool &edges);
+  void freeze(MarkovFrozenChain &frozen, const QVector<quint32> &rank, MarkovEdgePool &edges);
+  void freeze(MarkovFrozenChain &frozen, const MarkovVocabulary &vocabulary, MarkovEdgePool &edges);
+  void thaw(const MarkovFrozenChain &frozen, MarkovEdgePool &edges);
+  bool isFrozen(void) const;
 
   const MarkovEdgeList &successors(void) const;
-  const QString &token(void) const;
-
-  MarkovNode *selectSuccessor(const qreal p);
+  const MarkovChain *chain(void) const;
+  MarkovVocabulary::TokenId id(void) const;
+  QString token(void) const;
 
   QString toString(void) const;
+  void appendTo(QByteArray &line) const;
 
 private:
-  QString mToken;
+  void store(MarkovFrozenChain &frozen, MarkovEdgePool &edges);
+
+  MarkovChain *mChain;
+  MarkovVocabulary::TokenId mId;
   MarkovEdgeList mSuccessors;
+  // successors live in the chain's MarkovFrozenChain instead of mSuccessors
+  bool mFrozen;
 };
 
 
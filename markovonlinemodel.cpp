@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovonlinemodel.h"
+
+#include <QReadLocker>
+#include <QWriteLocker>
+
+
+MarkovOnlineModel::MarkovOnlineModel(void)
+  : mTokenCount(0)
+  , mBase(Q_NULLPTR)
+{
+  /* ... */
+}
+
+
+void MarkovOnlineModel::clear(void)
+{
+  QWriteLocker locker(&mLock);
+  mNodes.clear();
+  mEdges.clear();
+  mTerminators.clear();
+  mTokenCount = 0;
+}
+
+
+void MarkovOnlineModel::setBase(const MarkovFrozenChain *base)
+{
+  QWriteLocker locker(&mLock);
+  mBase = base;
+}
+
+
+QReadWriteLock *MarkovOnlineModel::lock(void) const
+{
+  return &mLock;
+}
+
+
+// Whether the node's counts are held here rather than in the base.
+bool MarkovOnlineModel::contains(TokenId id) const
+{
+  QReadLocker locker(&mLock);
+  return isAdded(id);
+}
+
+
+bool MarkovOnlineModel::isAdded(TokenId id) const
+{
+  return int(id) < mNodes.size() && mNodes.at(int(id)).total > 0;
+}
+
+
+quint64 MarkovOnlineModel::baseTotalCount(TokenId id) const
+{
+  return (mBase != Q_NULLPTR && int(id) < mBase->nodeCount()) ? mBase->totalCount(id) : 0;
+}
+
+
+// A node's first counts must include those it has in the base.
+void MarkovOnlineModel::add(const QHash<quint64, int> &transitions, const QVector<TokenId> &terminators)
+{
+  QWriteLocker locker(&mLock);
+  mTerminators = terminators;
+  for (QHash<quint64, int>::const_iterator i = transitions.constBegin(); i != transitions.constEnd(); ++i) {
+    const TokenId source = TokenId(i.key() >> 32);
+    const TokenId target = TokenId(quint32(i.key()));
+    const quint64 count = quint64(i.value());
+    mTokenCount = qMax(mTokenCount, int(qMax(source, target)) + 1);
+    if (int(source) >= mNodes.size()) {
+      mNodes.resize(int(source) + 1);
+    }
+    Node &node = mNodes[int(source)];
+    node.total += count;
+    const QHash<quint64, int>::const_iterator edge = mEdges.constFind(i.key());
+    if (edge == mEdges.constEnd()) {
+      // the new last entry sums its own count and those of the entries it covers
+      const int n = node.tree.size() + 1;
+      const quint64 covered = prefixCount(node, n - 1) - prefixCount(node, n - (n & -n));
+      mEdges.insert(i.key(), node.targets.size());
+      node.targets.append(target);
+      node.tree.append(count + covered);
+    }
+    else {
+      for (int j = edge.value() + 1; j <= node.tree.size(); j += j & -j) {
+        node.tree[j - 1] += count;
+      }
+    }
+  }
+}
+
+
+// The sum of the counts of the node's first `n` edges.
+quint64 MarkovOnlineModel::prefixCount(const Node &node, int n)
+{
+  quint64 sum = 0;
+  for (int j = n; j > 0; j -= j & -j) {
+    sum += node.tree.at(j - 1);
+  }
+  return sum;
+}
+
+
+// The first edge whose prefix count exceeds `r`.
+int MarkovOnlineModel::drawEdge(const Node &node, quint64 r)
+{
+  const int n = node.tree.size();
+  int step = 1;
+  while (2 * step <= n) {
+    step *= 2;
+  }
+  int pos = 0;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= n && node.tree.at(pos + step - 1) <= r) {
+      pos += step;
+      r -= node.tree.at(pos - 1);
+    }
+  }
+  return pos;
+}
+
+
+MarkovOnlineModel::TokenId MarkovOnlineModel::selectSuccessor(TokenId id, qreal p) const
+{
+  QReadLocker locker(&mLock);
+  if (!isAdded(id))
+    return baseTotalCount(id) > 0 ? mBase->selectSuccessor(id, p) : MarkovVocabulary::InvalidId;
+  const Node &node = mNodes.at(int(id));
+  const quint64 r = qMin(quint64(p * node.total), node.total - 1);
+  return node.targets.at(drawEdge(node, r));
+}
+
+
+MarkovOnlineModel::TokenId MarkovOnlineModel::selectSentenceStart(qreal p) const
+{
+  QReadLocker locker(&mLock);
+  quint64 total = 0;
+  foreach (TokenId id, mTerminators) {
+    total += isAdded(id) ? mNodes.at(int(id)).total : baseTotalCount(id);
+  }
+  if (total == 0)
+    return MarkovVocabulary::InvalidId;
+  // the draw picks a terminator by its share of the total, then one of its edges
+  quint64 r = qMin(quint64(p * total), total - 1);
+  foreach (TokenId id, mTerminators) {
+    if (isAdded(id)) {
+      const Node &node = mNodes.at(int(id));
+      if (r < node.total)
+        return node.targets.at(drawEdge(node, r));
+      r -= node.total;
+      continue;
+    }
+    const quint64 baseTotal = baseTotalCount(id);
+    if (r < baseTotal)
+      return mBase->selectSuccessor(id, (qreal(r) + 0.5) / qreal(baseTotal));
+    r -= baseTotal;
+  }
+  return MarkovVocabulary::InvalidId;
+}
+
+
+quint64 MarkovOnlineModel::count(TokenId source, TokenId target) const
+{
+  QReadLocker locker(&mLock);
+  if (!isAdded(source)) {
+    if (baseTotalCount(source) == 0)
+      return 0;
+    const MarkovFrozenChain::Edges &edges = mBase->edges(source);
+    for (int i = 0; i < edges.degree; ++i) {
+      if (edges.target(i) == target)
+        return edges.count(i);
+    }
+    return 0;
+  }
+  const QHash<quint64, int>::const_iterator edge = mEdges.constFind((quint64(source) << 32) | target);
+  if (edge == mEdges.constEnd())
+    return 0;
+  const Node &node = mNodes.at(int(source));
+  return prefixCount(node, edge.value() + 1) - prefixCount(node, edge.value());
+}
+
+
+quint64 MarkovOnlineModel::totalCount(TokenId id) const
+{
+  QReadLocker locker(&mLock);
+  return isAdded(id) ? mNodes.at(int(id)).total : baseTotalCount(id);
+}
+
+
+int MarkovOnlineModel::tokenCount(void) const
+{
+  QReadLocker locker(&mLock);
+  return qMax(mTokenCount, mBase != Q_NULLPTR ? mBase->nodeCount() : 0);
+}
+
+
+qint64 MarkovOnlineModel::memoryUsage(void) const
+{
+  QReadLocker locker(&mLock);
+  qint64 bytes = qint64(sizeof(Node)) * mNodes.capacity();
+  foreach (const Node &node, mNodes) {
+    bytes += qint64(sizeof(TokenId)) * node.targets.capacity() + qint64(sizeof(quint64)) * node.tree.capacity();
+  }
+  bytes += qint64(sizeof(quint64) + sizeof(int) + sizeof(void*)) * mEdges.size();
+  return bytes;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVONLINEMODEL_H_
+#define __MARKOVONLINEMODEL_H_
+
+#include <QtGlobal>
+#include <QHash>
+#include <QReadWriteLock>
+#include <QVector>
+
+#include "markovvocabulary.h"
+#include "markovfrozenchain.h"
+
+
+// Successor counts that can be drawn from while text is being added,
+// with a Fenwick tree per node. Nodes not added to are drawn from the
+// base frozen chain. Draws and add() share a read-write lock.
+class MarkovOnlineModel {
+public:
+  typedef MarkovVocabulary::TokenId TokenId;
+
+  MarkovOnlineModel(void);
+
+  void clear(void);
+  void setBase(const MarkovFrozenChain *base);
+  QReadWriteLock *lock(void) const;
+  void add(const QHash<quint64, int> &transitions, const QVector<TokenId> &terminators);
+  bool contains(TokenId id) const;
+
+  TokenId selectSuccessor(TokenId id, qreal p) const;
+  TokenId selectSentenceStart(qreal p) const;
+  quint64 count(TokenId source, TokenId target) const;
+  quint64 totalCount(TokenId id) const;
+  int tokenCount(void) const;
+  qint64 memoryUsage(void) const;
+
+private:
+  struct Node {
+    Node(void) : total(0) { /* ... */ }
+    QVector<TokenId> targets;
+    // tree[i] sums the counts of the edges (i + 1 - lowbit(i + 1), i]
+    QVector<quint64> tree;
+    quint64 total;
+  };
+
+  static quint64 prefixCount(const Node &node, int n);
+  static int drawEdge(const Node &node, quint64 r);
+  bool isAdded(TokenId id) const;
+  quint64 baseTotalCount(TokenId id) const;
+
+  QVector<Node> mNodes;
+  // (source << 32 | target) -> index of the edge in the source's node
+  QHash<quint64, int> mEdges;
+  QVector<TokenId> mTerminators;
+  // one more than the largest token ID counted
+  int mTokenCount;
+  const MarkovFrozenChain *mBase;
+  mutable QReadWriteLock mLock;
+};
+
+
+#endif // __MARKOVONLINEMODEL_H_
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVPOOL_H_
+#define __MARKOVPOOL_H_
+
+#include <QtGlobal>
+#include <QVector>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+// Slab allocator for objects of type T. Objects are carved from blocks of
+// BlockSize objects by bumping a pointer; destroyed ones go to a free list
+// that create() takes from first. clear() releases the blocks without
+// running destructors, so objects still holding memory of their own must
+// be destroyed before. A pool is not thread-safe: concurrent workers fill
+// private pools, which the owner takes over with adopt().
+template <typename T, int BlockSize = 4096>
+class MarkovPool {
+public:
+  MarkovPool(void)
+    : mNext(Q_NULLPTR)
+    , mEnd(Q_NULLPTR)
+    , mFree(Q_NULLPTR)
+  {
+    /* ... */
+  }
+
+  ~MarkovPool()
+  {
+    clear();
+  }
+
+  template <typename... Args>
+  T *create(Args&&... args)
+  {
+    Slot *slot = mFree;
+    if (slot != Q_NULLPTR) {
+      mFree = slot->next;
+    }
+    else {
+      if (mNext == mEnd) {
+        mNext = static_cast<Slot*>(::operator new(sizeof(Slot) * BlockSize));
+        mEnd = mNext + BlockSize;
+        mBlocks.append(mNext);
+      }
+      slot = mNext++;
+    }
+    return new (slot) T(std::forward<Args>(args)...);
+  }
+
+  void destroy(T *object)
+  {
+    object->~T();
+    Slot *slot = reinterpret_cast<Slot*>(object);
+    slot->next = mFree;
+    mFree = slot;
+  }
+
+  // Takes over the blocks of `other`, which is left empty. The unused
+  // rest of its current block and its free list are not reused.
+  void adopt(MarkovPool &other)
+  {
+    mBlocks += other.mBlocks;
+    other.mBlocks.clear();
+    other.mNext = other.mEnd = Q_NULLPTR;
+    other.mFree = Q_NULLPTR;
+  }
+
+  void clear(void)
+  {
+    foreach (Slot *block, mBlocks) {
+      ::operator delete(block);
+    }
+    mBlocks.clear();
+    mNext = mEnd = Q_NULLPTR;
+    mFree = Q_NULLPTR;
+  }
+
+  int blockCount(void) const
+  {
+    return mBlocks.size();
+  }
+
+  qint64 memoryUsage(void) const
+  {
+    return qint64(mBlocks.size()) * BlockSize * qint64(sizeof(Slot));
+  }
+
+private:
+  Q_DISABLE_COPY(MarkovPool)
+
+  union Slot {
+    Slot *next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  QVector<Slot*> mBlocks;
+  Slot *mNext;
+  Slot *mEnd;
+  Slot *mFree;
+};
+
+
+#endif // __MARKOVPOOL_H_
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovsnapshot.h"
+
+#include <QMutexLocker>
+#include <QObject>
+#include <QSaveFile>
+
+#include <climits>
+#include <cstring>
+
+const QByteArray MarkovSnapshot::Magic("MRKVSNAP", 8);
+const quint32 MarkovSnapshot::Version;
+const quint32 MarkovSnapshot::ByteOrderMark;
+const int MarkovSnapshot::Alignment;
+const int MarkovSnapshot::PageCostUnit;
+
+
+static qint64 aligned(qint64 offset)
+{
+  return (offset + MarkovSnapshot::Alignment - 1) & ~qint64(MarkovSnapshot::Alignment - 1);
+}
+
+
+quint32 MarkovSnapshot::tag(quint32 component, quint32 field)
+{
+  return (component << 8) | field;
+}
+
+
+MarkovSnapshot::MarkovSnapshot(void)
+  : mData(Q_NULLPTR)
+  , mSize(0)
+  , mSections(Q_NULLPTR)
+  , mSectionCount(0)
+  , mPaged(false)
+  , mPageHits(0)
+  , mPageMisses(0)
+{
+  /* ... */
+}
+
+
+MarkovSnapshot::~MarkovSnapshot()
+{
+  if (mData != Q_NULLPTR) {
+    mFile.unmap(const_cast<uchar*>(mData));
+  }
+}
+
+
+void MarkovSnapshot::addSection(quint32 tag, const void *data, int elementSize, qint64 count)
+{
+  Section section;
+  section.tag = tag;
+  section.elementSize = quint32(elementSize);
+  section.count = quint64(count);
+  section.offset = 0;
+  mPending.append(section);
+  mPendingData.append(data);
+}
+
+
+// Writes to a temporary file that replaces `filename` when complete, so
+// processes that have the old file mapped keep seeing consistent data.
+bool MarkovSnapshot::write(const QString &filename) const
+{
+  QVector<Section> sections = mPending;
+  qint64 offset = aligned(qint64(sizeof(Header)) + sections.size() * qint64(sizeof(Section)));
+  for (int i = 0; i < sections.size(); ++i) {
+    sections[i].offset = quint64(offset);
+    offset = aligned(offset + qint64(sections.at(i).elementSize * sections.at(i).count));
+  }
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, Magic.constData(), sizeof(header.magic));
+  header.version = Version;
+  header.byteOrder = ByteOrderMark;
+  header.sectionCount = quint32(sections.size());
+  header.fileSize = quint64(offset);
+
+  QSaveFile outFile(filename);
+  if (!outFile.open(QIODevice::WriteOnly))
+    return false;
+  const QByteArray padding(Alignment, '\0');
+  outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  outFile.write(reinterpret_cast<const char*>(sections.constData()), sections.size() * qint64(sizeof(Section)));
+  for (int i = 0; i < sections.size(); ++i) {
+    const Section &section = sections.at(i);
+    outFile.write(padding.constData(), qint64(section.offset) - outFile.pos());
+    outFile.write(reinterpret_cast<const char*>(mPendingData.at(i)), qint64(section.elementSize * section.count));
+  }
+  outFile.write(padding.constData(), offset - outFile.pos());
+  return outFile.commit();
+}
+
+
+bool MarkovSnapshot::map(const QString &filename)
+{
+  mFile.setFileName(filename);
+  if (!mFile.open(QIODevice::ReadOnly)) {
+    mErrorString = mFile.errorString();
+    return false;
+  }
+  mSize = mFile.size();
+  if (mSize < qint64(sizeof(Header))) {
+    mErrorString = QObject::tr("file too short");
+    return false;
+  }
+  // the file stays open, closing it would unmap it
+  mData = mFile.map(0, mSize);
+  if (mData == Q_NULLPTR) {
+    mErrorString = mFile.errorString();
+    return false;
+  }
+  const Header *header = reinterpret_cast<const Header*>(mData);
+  if (!checkHeader(header))
+    return false;
+  mSections = reinterpret_cast<const Section*>(mData + sizeof(Header));
+  mSectionCount = int(header->sectionCount);
+  return checkSections();
+}
+
+
+// Opens the snapshot without mapping it, for section() and read() to read
+// from the file, and keeps up to about `pageBudget` bytes of pages.
+bool MarkovSnapshot::open(const QString &filename, qint64 pageBudget)
+{
+  mFile.setFileName(filename);
+  if (!mFile.open(QIODevice::ReadOnly)) {
+    mErrorString = mFile.errorString();
+    return false;
+  }
+  mSize = mFile.size();
+  Header header;
+  if (mFile.read(reinterpret_cast<char*>(&header), sizeof(header)) != qint64(sizeof(header))) {
+    mErrorString = QObject::tr("file too short");
+    return false;
+  }
+  if (!checkHeader(&header))
+    return false;
+  mSectionTable = mFile.read(header.sectionCount * qint64(sizeof(Section)));
+  mSections = reinterpret_cast<const Section*>(mSectionTable.constData());
+  mSectionCount = int(header.sectionCount);
+  mPages.setMaxCost(int(qBound(qint64(1), pageBudget / PageCostUnit, qint64(INT_MAX))));
+  mPaged = true;
+  return checkSections();
+}
+
+
+bool MarkovSnapshot::checkHeader(const Header *header)
+{
+  if (memcmp(header->magic, Magic.constData(), sizeof(header->magic)) != 0) {
+    mErrorString = QObject::tr("not a Markov snapshot");
+    return false;
+  }
+  if (header->byteOrder != ByteOrderMark) {
+    mErrorString = QObject::tr("snapshot was written with a different byte order");
+    return false;
+  }
+  if (header->version != Version) {
+    mErrorString = QObject::tr("unsupported snapshot version %1").arg(header->version);
+    return false;
+  }
+  if (header->fileSize != quint64(mSize) || qint64(sizeof(Header)) + header->sectionCount * qint64(sizeof(Section)) > mSize) {
+    mErrorString = QObject::tr("snapshot is truncated");
+    return false;
+  }
+  return true;
+}
+
+
+bool MarkovSnapshot::checkSections(void)
+{
+  for (int i = 0; i < mSectionCount; ++i) {
+    const Section &section = mSections[i];
+    if (section.offset % Alignment != 0 || section.offset + section.elementSize * section.count > quint64(mSize)) {
+      mErrorString = QObject::tr("section %1 is out of bounds").arg(section.tag);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+const MarkovSnapshot::Section *MarkovSnapshot::find(quint32 tag) const
+{
+  for (int i = 0; i < mSectionCount; ++i) {
+    if (mSections[i].tag == tag)
+      return mSections + i;
+  }
+  return Q_NULLPTR;
+}
+
+
+bool MarkovSnapshot::contains(quint32 tag) const
+{
+  return find(tag) != Q_NULLPTR;
+}
+
+
+// Returns Q_NULLPTR if there is no such section or its elements are not
+// `elementSize` bytes wide. A paged snapshot reads the section on first
+// use and keeps it.
+const void *MarkovSnapshot::section(quint32 tag, int elementSize, int *count) const
+{
+  const Section *section = find(tag);
+  if (section == Q_NULLPTR || section->elementSize != quint32(elementSize) || section->count > quint64(INT_MAX))
+    return Q_NULLPTR;
+  if (count != Q_NULLPTR) {
+    *count = int(section->count);
+  }
+  if (!mPaged)
+    return mData + section->offset;
+  QMutexLocker locker(&mFileMutex);
+  QHash<quint32, QByteArray>::const_iterator resident = mResident.constFind(tag);
+  if (resident == mResident.constEnd()) {
+    if (section->elementSize * section->count > quint64(INT_MAX))
+      return Q_NULLPTR;
+    QByteArray data(int(section->elementSize * section->count), Qt::Uninitialized);
+    if (!mFile.seek(qint64(section->offset)) || mFile.read(data.data(), data.size()) != data.size())
+      return Q_NULLPTR;
+    resident = mResident.insert(tag, data);
+  }
+  return resident.value().constData();
+}
+
+
+// Returns the number of elements in the section, or -1 if there is no
+// such section or its elements are not `elementSize` bytes wide.
+int MarkovSnapshot::elementCount(quint32 tag, int elementSize) const
+{
+  const Section *section = find(tag);
+  if (section == Q_NULLPTR || section->elementSize != quint32(elementSize) || section->count > quint64(INT_MAX))
+    return -1;
+  return int(section->count);
+}
+
+
+// Copies elements first .. first + count - 1 of the section to `data`.
+bool MarkovSnapshot::read(quint32 tag, int elementSize, qint64 first, qint64 count, void *data) const
+{
+  const Section *section = find(tag);
+  if (section == Q_NULLPTR || section->elementSize != quint32(elementSize) || first < 0 || count < 0
+      || quint64(first + count) > section->count)
+    return false;
+  const qint64 offset = qint64(section->offset) + first * elementSize;
+  const qint64 size = count * elementSize;
+  if (!mPaged) {
+    memcpy(data, mData + offset, size_t(size));
+    return true;
+  }
+  QMutexLocker locker(&mFileMutex);
+  return mFile.seek(offset) && mFile.read(static_cast<char*>(data), size) == size;
+}
+
+
+bool MarkovSnapshot::isPaged(void) const
+{
+  return mPaged;
+}
+
+
+// Returns the page inserted with `key` and marks it as the most recently
+// used one, or a null pointer if there is no such page (anymore).
+QSharedPointer<const QByteArray> MarkovSnapshot::page(quint64 key) const
+{
+  QMutexLocker locker(&mPageMutex);
+  QSharedPointer<const QByteArray> *page = mPages.object(key);
+  if (page == Q_NULLPTR) {
+    ++mPageMisses;
+    return QSharedPointer<const QByteArray>();
+  }
+  ++mPageHits;
+  return *page;
+}
+
+
+// Evicts the least recently used pages while the budget is exceeded. The
+// pages stay valid for those who still hold them.
+void MarkovSnapshot::insertPage(quint64 key, const QSharedPointer<const QByteArray> &page) const
+{
+  QMutexLocker locker(&mPageMutex);
+  mPages.insert(key, new QSharedPointer<const QByteArray>(page), 1 + page->size() / PageCostUnit);
+}
+
+
+qint64 MarkovSnapshot::pageHits(void) const
+{
+  QMutexLocker locker(&mPageMutex);
+  return mPageHits;
+}
+
+
+qint64 MarkovSnapshot::pageMisses(void) const
+{
+  QMutexLocker locker(&mPageMutex);
+  return mPageMisses;
+}
+
+
+// The memory held by the pages in the cache, not counting evicted pages
+// that are still in use.
+qint64 MarkovSnapshot::pageMemory(void) const
+{
+  QMutexLocker locker(&mPageMutex);
+  return qint64(mPages.totalCost()) * PageCostUnit;
+}
+
+
+QString MarkovSnapshot::errorString(void) const
+{
+  return mErrorString;
+}
+
+
+bool MarkovSnapshot::isSnapshot(const QString &filename)
+{
+  QFile file(filename);
+  return file.open(QIODevice::ReadOnly) && file.read(Magic.size()) == Magic;
+}
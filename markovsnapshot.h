@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVSNAPSHOT_H_
+#define __MARKOVSNAPSHOT_H_
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QCache>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+
+// Binary model file (.markovs) made of flat arrays that can be used
+// in place once the file has been mapped into memory.
+//
+// Layout: a Header, a table of `sectionCount` Section entries, then the
+// section data, each section starting at a multiple of Alignment. All
+// numbers are in the byte order of the machine that wrote the file;
+// Header::byteOrder tells whether it is ours. Sections are identified by
+// a tag made of a component number (see MarkovChain::saveSnapshot()) and
+// a field number, and carry their element size, so a reader can refuse
+// arrays whose layout it does not know.
+//
+// The file is mapped read-only and shared, so processes loading the same
+// snapshot share one copy of it in the page cache.
+//
+// A snapshot larger than the memory at hand can be opened paged instead:
+// only the header and the section table are read then. A section asked
+// for with section() is read as a whole and stays resident, while the
+// users of large sections read() the pieces they need and keep them as
+// pages, which are evicted least recently used first once they exceed
+// the page budget. Pages are identified by a key their users choose.
+// Reading and the page cache are thread-safe.
+class MarkovSnapshot {
+public:
+  static const QByteArray Magic;
+  static const quint32 Version = 1;
+  static const quint32 ByteOrderMark = 0x01020304U;
+  static const int Alignment = 64;
+
+  static quint32 tag(quint32 component, quint32 field);
+
+  MarkovSnapshot(void);
+  ~MarkovSnapshot();
+
+  // writing
+  template <typename T>
+  void addSection(quint32 tag, const T *data, qint64 count)
+  {
+    addSection(tag, data, int(sizeof(T)), count);
+  }
+  template <typename T>
+  void addSection(quint32 tag, const QVector<T> &data)
+  {
+    addSection(tag, data.constData(), int(sizeof(T)), data.size());
+  }
+  void addSection(quint32 tag, const void *data, int elementSize, qint64 count);
+  bool write(const QString &filename) const;
+
+  // reading
+  bool map(const QString &filename);
+  bool contains(quint32 tag) const;
+  template <typename T>
+  const T *section(quint32 tag, int *count = Q_NULLPTR) const
+  {
+    return reinterpret_cast<const T*>(section(tag, int(sizeof(T)), count));
+  }
+  const void *section(quint32 tag, int elementSize, int *count) const;
+  int elementCount(quint32 tag, int elementSize) const;
+  bool read(quint32 tag, int elementSize, qint64 first, qint64 count, void *data) const;
+  QString errorString(void) const;
+
+  // paged reading
+  bool open(const QString &filename, qint64 pageBudget);
+  bool isPaged(void) const;
+  QSharedPointer<const QByteArray> page(quint64 key) const;
+  void insertPage(quint64 key, const QSharedPointer<const QByteArray> &page) const;
+  qint64 pageHits(void) const;
+  qint64 pageMisses(void) const;
+  qint64 pageMemory(void) const;
+
+  static bool isSnapshot(const QString &filename);
+
+private:
+  struct Header {
+    char magic[8];
+    quint32 version;
+    quint32 byteOrder;
+    quint32 sectionCount;
+    quint32 reserved;
+    quint64 fileSize;
+  };
+
+  struct Section {
+    quint32 tag;
+    quint32 elementSize;
+    quint64 count;
+    quint64 offset;
+  };
+
+  // pages are charged to the budget in units of this many bytes
+  static const int PageCostUnit = 64;
+
+  const Section *find(quint32 tag) const;
+  bool checkHeader(const Header *header);
+  bool checkSections(void);
+
+  // sections to write, pointing into the caller's arrays
+  QVector<Section> mPending;
+  QVector<const void*> mPendingData;
+
+  mutable QFile mFile;
+  const uchar *mData;
+  qint64 mSize;
+  const Section *mSections;
+  int mSectionCount;
+  QString mErrorString;
+
+  // if paged: the section table, the sections read as a whole, and the
+  // pages; mFileMutex guards the file position and mResident
+  bool mPaged;
+  QByteArray mSectionTable;
+  mutable QHash<quint32, QByteArray> mResident;
+  mutable QMutex mFileMutex;
+  mutable QCache<quint64, QSharedPointer<const QByteArray> > mPages;
+  mutable QMutex mPageMutex;
+  mutable qint64 mPageHits;
+  mutable qint64 mPageMisses;
+};
+
+
+#endif // __MARKOVSNAPSHOT_H_
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovtokenizer.h"
+
+#include <QChar>
+#include <QRegExp>
+
+namespace {
+
+enum CharClass {
+  Start = 0x01,      // first byte of a code point
+  Word = 0x02,       // \w as in QRegExp: letter, number, mark or '_'
+  Breaker = 0x04,    // ends a token: \s or 'ˇ'
+  Punct = 0x08,      // may follow a token as a token of its own
+  Malformed = 0x10   // invalid UTF-8, decodes to U+FFFD
+};
+
+const uint Caron = 0x02c7;
+const uint LeftGuillemet = 0x00ab;
+const uint RightGuillemet = 0x00bb;
+
+
+struct AsciiTable {
+  AsciiTable(void)
+  {
+    for (int c = 0; c < 128; ++c) {
+      quint8 f = Start;
+      if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_') {
+        f |= Word;
+      }
+      if (c == ' ' || (c >= 0x09 && c <= 0x0d)) {
+        f |= Breaker;
+      }
+      switch (c) {
+      case '.': case ',': case ';': case '!': case ':': case '?':
+      case '(': case ')': case '"': case '\'': case '_':
+        f |= Punct;
+        break;
+      default:
+        break;
+      }
+      flags[c] = f;
+    }
+  }
+  quint8 flags[128];
+};
+
+const AsciiTable Ascii;
+
+
+inline bool isContinuation(uchar c)
+{
+  return (c & 0xc0) == 0x80;
+}
+
+
+// Decodes the code point at p and returns its length in bytes. Malformed
+// sequences, overlong forms and surrogates count as one byte each.
+inline int decode(const uchar *p, const uchar *end, uint &cp)
+{
+  const uchar c = p[0];
+  const int avail = int(end - p);
+  if (c >= 0xc2 && c <= 0xdf && avail >= 2 && isContinuation(p[1])) {
+    cp = (uint(c & 0x1f) << 6) | (p[1] & 0x3f);
+    return 2;
+  }
+  if (c >= 0xe0 && c <= 0xef && avail >= 3 && isContinuation(p[1]) && isContinuation(p[2])) {
+    if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] > 0x9f))
+      return 0;
+    cp = (uint(c & 0x0f) << 12) | (uint(p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+    return 3;
+  }
+  if (c >= 0xf0 && c <= 0xf4 && avail >= 4 && isContinuation(p[1]) && isContinuation(p[2]) && isContinuation(p[3])) {
+    if ((c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] > 0x8f))
+      return 0;
+    cp = (uint(c & 0x07) << 18) | (uint(p[1] & 0x3f) << 12) | (uint(p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+    return 4;
+  }
+  return 0;
+}
+
+
+inline quint8 classify(uint cp)
+{
+  // QRegExp looks at UTF-16 code units; the surrogates of a supplementary
+  // character are neither word characters nor spaces
+  if (cp > 0xffff)
+    return Start;
+  quint8 f = Start;
+  if (QChar::isLetterOrNumber(cp) || QChar::isMark(cp)) {
+    f |= Word;
+  }
+  if (QChar::isSpace(cp) || cp == Caron) {
+    f |= Breaker;
+  }
+  if (cp == LeftGuillemet || cp == RightGuillemet) {
+    f |= Punct;
+  }
+  return f;
+}
+
+}
+
+
+MarkovTokenizer::MarkovTokenizer(void)
+  : mSize(0)
+{
+  /* ... */
+}
+
+
+int MarkovTokenizer::next(int i) const
+{
+  do {
+    ++i;
+  } while (i < mSize && mFlags.at(i) == 0);
+  return i;
+}
+
+
+// `data` must begin at the start of a line, so that the character before
+// it is no word character, and must not end within a line.
+void MarkovTokenizer::tokenize(const char *data, int size, TokenList &tokens)
+{
+  const uchar *src = reinterpret_cast<const uchar*>(data);
+  const uchar *end = src + size;
+  mSize = size;
+  mFlags.resize(size);
+  quint8 *flags = mFlags.data();
+  bool malformed = false;
+  for (int i = 0; i < size; ) {
+    const uchar c = src[i];
+    if (c < 0x80) {
+      flags[i++] = Ascii.flags[c];
+      continue;
+    }
+    uint cp = 0;
+    const int n = decode(src + i, end, cp);
+    if (n == 0) {
+      flags[i++] = Start | Malformed;
+      malformed = true;
+      continue;
+    }
+    flags[i] = classify(cp);
+    for (int k = 1; k < n; ++k) {
+      flags[i + k] = 0;
+    }
+    i += n;
+  }
+
+  // Emulates the regular expression: a match starts at the leftmost word
+  // boundary that is followed by a non-breaking character. The greedy
+  // [^\sˇ]+ then runs to the next breaker and backtracks to the last word
+  // boundary within that run.
+  bool prevWord = false;
+  int i = 0;
+  while (i < size) {
+    const bool word = (flags[i] & Word) != 0;
+    if (word == prevWord || (flags[i] & Breaker) != 0) {
+      prevWord = word;
+      i = next(i);
+      continue;
+    }
+    int boundary = -1;
+    bool lastWord = word;
+    int k = next(i);
+    forever {
+      const bool kWord = k < size && (flags[k] & Word) != 0;
+      if (kWord != lastWord) {
+        boundary = k;
+      }
+      if (k == size || (flags[k] & Breaker) != 0)
+        break;
+      lastWord = kWord;
+      k = next(k);
+    }
+    if (boundary < 0) {
+      // no boundary anywhere in the rest of the run, so no match can start in it
+      prevWord = lastWord;
+      i = k;
+      continue;
+    }
+    Token t1 = { data + i, boundary - i, true };
+    if (malformed) {
+      for (int b = i; b < boundary; ++b) {
+        t1.wellFormed = t1.wellFormed && (flags[b] & Malformed) == 0;
+      }
+    }
+    tokens.append(t1);
+    if (boundary < size && (flags[boundary] & Punct) != 0) {
+      const int punctEnd = next(boundary);
+      const Token t2 = { data + boundary, punctEnd - boundary, true };
+      tokens.append(t2);
+      prevWord = (flags[boundary] & Word) != 0;
+      i = punctEnd;
+    }
+    else {
+      prevWord = !(boundary < size && (flags[boundary] & Word) != 0);
+      i = boundary;
+    }
+  }
+}
+
+
+void MarkovTokenizer::tokenize(const QByteArray &text, TokenList &tokens)
+{
+  tokenize(text.constData(), text.size(), tokens);
+}
+
+
+// The tokenizer MarkovChain used to run on every line of input; kept as
+// the reference for verify().
+QStringList MarkovTokenizer::tokenizeRegExp(const QString &text)
+{
+  static const QRegExp reTokens("(\\b[^\\sˇ]+\\b)([\\.,;!:\\?\\(\\)»«\"'_])?", Qt::CaseSensitive, QRegExp::RegExp);
+  QRegExp re(reTokens);
+  QStringList tokens;
+  int pos = 0;
+  while ((pos = re.indexIn(text, pos)) != -1) {
+    const QString &t1 = re.cap(1);
+    if (re.captureCount() > 0 && !t1.isEmpty()) {
+      tokens << t1;
+    }
+    const QString &t2 = re.cap(2);
+    if (re.captureCount() > 1 && !t2.isEmpty()) {
+      tokens << t2;
+    }
+    pos += re.matchedLength();
+  }
+  return tokens;
+}
+
+
+// Tokenizes `text` line by line with the regular expression and as a
+// whole with tokenize() and compares the results. On a mismatch the
+// first differing token and its neighbourhood go to `difference`.
+bool MarkovTokenizer::verify(const QByteArray &text, QString *difference)
+{
+  QStringList expected;
+  int lineBegin = 0;
+  while (lineBegin < text.size()) {
+    int lineEnd = text.indexOf('\n', lineBegin);
+    lineEnd = lineEnd < 0 ? text.size() : lineEnd + 1;
+    expected << tokenizeRegExp(QString::fromUtf8(text.constData() + lineBegin, lineEnd - lineBegin));
+    lineBegin = lineEnd;
+  }
+  TokenList tokens;
+  tokenize(text, tokens);
+  const int n = qMin(expected.size(), tokens.size());
+  for (int i = 0; i <= n; ++i) {
+    const bool atEnd = i == n;
+    if (atEnd && expected.size() == tokens.size())
+      return true;
+    const QString &actual = atEnd ? QString() : QString::fromUtf8(tokens.at(i).data, tokens.at(i).size);
+    if (atEnd || actual != expected.at(i)) {
+      if (difference != Q_NULLPTR) {
+        *difference = QString("token #%1: expected \"%2\", got \"%3\" after \"%4\"")
+            .arg(i)
+            .arg(i < expected.size() ? expected.at(i) : QString("<end>"))
+            .arg(i < tokens.size() ? actual : QString("<end>"))
+            .arg(QStringList(expected.mid(qMax(0, i - 5), qMin(i, 5))).join(' '));
+      }
+      return false;
+    }
+  }
+  return true;
+}
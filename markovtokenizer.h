@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVTOKENIZER_H_
+#define __MARKOVTOKENIZER_H_
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+
+// Splits UTF-8 text into the same tokens as the regular expression
+//   (\b[^\sˇ]+\b)([\.,;!:\?\(\)»«"'_])?
+// used to, but works on the bytes directly: a lookup table classifies
+// ASCII, other code points are decoded and classified through QChar.
+// Tokens are views into the input, so tokenize() does not allocate
+// once its buffers have grown to the size of the input.
+class MarkovTokenizer {
+public:
+  struct Token {
+    const char *data;
+    int size;
+    // false if the token contains malformed UTF-8
+    bool wellFormed;
+  };
+  typedef QVector<Token> TokenList;
+
+  MarkovTokenizer(void);
+
+  void tokenize(const char *data, int size, TokenList &tokens);
+  void tokenize(const QByteArray &text, TokenList &tokens);
+
+  static QStringList tokenizeRegExp(const QString &text);
+  bool verify(const QByteArray &text, QString *difference = Q_NULLPTR);
+
+private:
+  int next(int i) const;
+
+  // per input byte: the class of the code point starting there, 0 for continuation bytes
+  QVector<quint8> mFlags;
+  int mSize;
+};
+
+
+#endif // __MARKOVTOKENIZER_H_
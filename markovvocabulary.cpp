@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+#include "markovvocabulary.h"
+
+#include <cstring>
+
+const MarkovVocabulary::TokenId MarkovVocabulary::InvalidId;
+
+
+MarkovVocabulary::MarkovVocabulary(void)
+{
+  clear();
+}
+
+
+quint32 MarkovVocabulary::hash(const char *data, int size)
+{
+  // FNV-1a
+  quint32 h = 2166136261U;
+  for (int i = 0; i < size; ++i) {
+    h ^= quint8(data[i]);
+    h *= 16777619U;
+  }
+  return h;
+}
+
+
+int MarkovVocabulary::slotOf(const char *data, int size, quint32 h) const
+{
+  const int mask = mArrays.tableSize - 1;
+  int slot = int(h) & mask;
+  forever {
+    const TokenId id = mArrays.table[slot];
+    if (id == InvalidId)
+      return slot;
+    if (mArrays.hashes[id] == h && this->size(id) == size && memcmp(this->data(id), data, size_t(size)) == 0)
+      return slot;
+    slot = (slot + 1) & mask;
+  }
+}
+
+
+void MarkovVocabulary::rehash(int capacity)
+{
+  mSlots.fill(InvalidId, capacity);
+  const int mask = capacity - 1;
+  for (TokenId id = 0; id < TokenId(mHashes.size()); ++id) {
+    int slot = int(mHashes.at(id)) & mask;
+    while (mSlots.at(slot) != InvalidId) {
+      slot = (slot + 1) & mask;
+    }
+    mSlots[slot] = id;
+  }
+  updateArrays();
+}
+
+
+MarkovVocabulary::TokenId MarkovVocabulary::intern(const char *data, int size)
+{
+  const quint32 h = hash(data, size);
+  int slot = slotOf(data, size, h);
+  TokenId id = mArrays.table[slot];
+  if (id == InvalidId) {
+    detach();
+    id = TokenId(mHashes.size());
+    mPool.append(data, size);
+    mOffsets.append(quint32(mPool.size()));
+    mHashes.append(h);
+    mSlots[slot] = id;
+    // keep the load factor below 1/2
+    if (2 * mHashes.size() > mSlots.size()) {
+      rehash(2 * mSlots.size());
+    }
+    else {
+      updateArrays();
+    }
+  }
+  return id;
+}
+
+
+MarkovVocabulary::TokenId MarkovVocabulary::intern(const QByteArray &token)
+{
+  return intern(token.constData(), token.size());
+}
+
+
+MarkovVocabulary::TokenId MarkovVocabulary::intern(const QString &token)
+{
+  return intern(token.toUtf8());
+}
+
+
+MarkovVocabulary::TokenId MarkovVocabulary::find(const char *data, int size) const
+{
+  return mArrays.table[slotOf(data, size, hash(data, size))];
+}
+
+
+MarkovVocabulary::TokenId MarkovVocabulary::find(const QString &token) const
+{
+  const QByteArray &utf8 = token.toUtf8();
+  return find(utf8.constData(), utf8.size());
+}
+
+
+int MarkovVocabulary::count(void) const
+{
+  return mArrays.count;
+}
+
+
+QString MarkovVocabulary::token(TokenId id) const
+{
+  return QString::fromUtf8(data(id), size(id));
+}
+
+
+const char *MarkovVocabulary::data(TokenId id) const
+{
+  return mArrays.pool + mArrays.offsets[id];
+}
+
+
+int MarkovVocabulary::size(TokenId id) const
+{
+  return int(mArrays.offsets[id + 1] - mArrays.offsets[id]);
+}
+
+
+bool MarkovVocabulary::lessThan(TokenId a, TokenId b) const
+{
+  return lessThan(data(a), size(a), data(b), size(b));
+}
+
+
+bool MarkovVocabulary::lessThan(const char *a, int na, const char *b, int nb)
+{
+  // Orders like QString::operator<(), i.e. by UTF-16 code units. Plain UTF-8 byte order
+  // equals code point order, which only disagrees for U+E000..U+FFFF (lead bytes 0xEE, 0xEF)
+  // versus supplementary characters (lead bytes 0xF0..0xF4, surrogates in UTF-16).
+  const quint8 *pa = reinterpret_cast<const quint8*>(a);
+  const quint8 *pb = reinterpret_cast<const quint8*>(b);
+  const int n = qMin(na, nb);
+  for (int i = 0; i < n; ++i) {
+    if (pa[i] != pb[i]) {
+      const int ca = (pa[i] == 0xEE || pa[i] == 0xEF) ? pa[i] + 0x10 : pa[i];
+      const int cb = (pb[i] == 0xEE || pb[i] == 0xEF) ? pb[i] + 0x10 : pb[i];
+      return ca < cb;
+    }
+  }
+  return na < nb;
+}
+
+
+qint64 MarkovVocabulary::memoryUsage(void) const
+{
+  const Arrays &a = mArrays;
+  return qint64(a.offsets[a.count]) + qint64(sizeof(quint32)) * (2 * a.count + 1) + qint64(sizeof(TokenId)) * a.tableSize;
+}
+
+
+void MarkovVocabulary::clear(void)
+{
+  mPool.clear();
+  mOffsets.clear();
+  mOffsets.append(0);
+  mHashes.clear();
+  mSlots.fill(InvalidId, 1024);
+  mSnapshot.clear();
+  updateArrays();
+}
+
+
+void MarkovVocabulary::swap(MarkovVocabulary &other)
+{
+  mPool.swap(other.mPool);
+  mOffsets.swap(other.mOffsets);
+  mHashes.swap(other.mHashes);
+  mSlots.swap(other.mSlots);
+  mSnapshot.swap(other.mSnapshot);
+  qSwap(mArrays, other.mArrays);
+}
+
+
+void MarkovVocabulary::updateArrays(void)
+{
+  mArrays.pool = mPool.constData();
+  mArrays.offsets = mOffsets.constData();
+  mArrays.hashes = mHashes.constData();
+  mArrays.table = mSlots.constData();
+  mArrays.count = mHashes.size();
+  mArrays.tableSize = mSlots.size();
+}
+
+
+// Copies a mapped vocabulary into our own vectors before it is modified.
+void MarkovVocabulary::detach(void)
+{
+  if (mSnapshot.isNull())
+    return;
+  const Arrays a = mArrays;
+  mPool = QByteArray(a.pool, int(a.offsets[a.count]));
+  mOffsets.resize(a.count + 1);
+  memcpy(mOffsets.data(), a.offsets, sizeof(quint32) * size_t(a.count + 1));
+  mHashes.resize(a.count);
+  memcpy(mHashes.data(), a.hashes, sizeof(quint32) * size_t(a.count));
+  mSlots.resize(a.tableSize);
+  memcpy(mSlots.data(), a.table, sizeof(TokenId) * size_t(a.tableSize));
+  mSnapshot.clear();
+  updateArrays();
+}
+
+
+void MarkovVocabulary::writeTo(MarkovSnapshot &snapshot, quint32 component) const
+{
+  const Arrays &a = mArrays;
+  snapshot.addSection(MarkovSnapshot::tag(component, PoolField), a.pool, a.offsets[a.count]);
+  snapshot.addSection(MarkovSnapshot::tag(component, OffsetsField), a.offsets, a.count + 1);
+  snapshot.addSection(MarkovSnapshot::tag(component, HashesField), a.hashes, a.count);
+  snapshot.addSection(MarkovSnapshot::tag(component, SlotsField), a.table, a.tableSize);
+}
+
+
+// Looks tokens up in the mapped `snapshot` without copying; the first
+// intern() of a new token copies the vocabulary.
+bool MarkovVocabulary::attach(const QSharedPointer<MarkovSnapshot> &snapshot, quint32 component)
+{
+  Arrays a;
+  int poolSize = 0;
+  int offsetCount = 0;
+  a.pool = snapshot->section<char>(MarkovSnapshot::tag(component, PoolField), &poolSize);
+  a.offsets = snapshot->section<quint32>(MarkovSnapshot::tag(component, OffsetsField), &offsetCount);
+  a.hashes = snapshot->section<quint32>(MarkovSnapshot::tag(component, HashesField), &a.count);
+  a.table = snapshot->section<TokenId>(MarkovSnapshot::tag(component, SlotsField), &a.tableSize);
+  if (a.pool == Q_NULLPTR || a.offsets == Q_NULLPTR || a.hashes == Q_NULLPTR || a.table == Q_NULLPTR)
+    return false;
+  // the slot count must be a power of two with room for every token
+  if (offsetCount != a.count + 1 || a.offsets[a.count] != quint32(poolSize)
+      || a.tableSize <= a.count || (a.tableSize & (a.tableSize - 1)) != 0)
+    return false;
+  mPool.clear();
+  mOffsets.clear();
+  mHashes.clear();
+  mSlots.clear();
+  mArrays = a;
+  mSnapshot = snapshot;
+  return true;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015 Oliver Lau <oliver@ersatzworld.net>
+ * All rights reserved.
+ *
+ */
+
+
+#ifndef __MARKOVVOCABULARY_H_
+#define __MARKOVVOCABULARY_H_
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <QSharedPointer>
+
+#include "markovsnapshot.h"
+
+
+class MarkovVocabulary {
+public:
+  typedef quint32 TokenId;
+  static const TokenId InvalidId = 0xffffffffU;
+
+  MarkovVocabulary(void);
+
+  TokenId intern(const char *data, int size);
+  TokenId intern(const QByteArray &token);
+  TokenId intern(const QString &token);
+  TokenId find(const char *data, int size) const;
+  TokenId find(const QString &token) const;
+
+  int count(void) const;
+  QString token(TokenId id) const;
+  const char *data(TokenId id) const;
+  int size(TokenId id) const;
+  bool lessThan(TokenId a, TokenId b) const;
+  static bool lessThan(const char *a, int na, const char *b, int nb);
+  qint64 memoryUsage(void) const;
+
+  void clear(void);
+  void swap(MarkovVocabulary &other);
+
+  void writeTo(MarkovSnapshot &snapshot, quint32 component) const;
+  bool attach(const QSharedPointer<MarkovSnapshot> &snapshot, quint32 component);
+
+private:
+  enum SnapshotField {
+    PoolField,
+    OffsetsField,
+    HashesField,
+    SlotsField
+  };
+
+  struct Arrays {
+    const char *pool;
+    const quint32 *offsets;
+    const quint32 *hashes;
+    const TokenId *table;
+    int count;
+    int tableSize;
+  };
+
+  void updateArrays(void);
+  void detach(void);
+  static quint32 hash(const char *data, int size);
+  int slotOf(const char *data, int size, quint32 h) const;
+  void rehash(int capacity);
+
+  // all tokens back to back in UTF-8, token i spans mOffsets[i] .. mOffsets[i+1]
+  QByteArray mPool;
+  QVector<quint32> mOffsets;
+  QVector<quint32> mHashes;
+  // open addressing with linear probing, capacity is a power of two
+  QVector<TokenId> mSlots;
+  // what lookups use: the vectors above or a mapped snapshot
+  Arrays mArrays;
+  QSharedPointer<MarkovSnapshot> mSnapshot;
+};
+
+
+#endif // __MARKOVVOCABULARY_H_